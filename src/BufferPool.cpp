@@ -0,0 +1,86 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+#include "BufferPool.hpp"
+
+#include <algorithm>
+
+BufferPool::BufferPool(size_t bufferSize, size_t buffersPerSlab) :
+    mBufferSize(std::max(bufferSize, sizeof(char*))),
+    mBuffersPerSlab(std::max<size_t>(buffersPerSlab, 1)),
+    mFreeList(nullptr),
+    mBuffersInUse(0)
+{
+    // Keep every buffer aligned for the largest scalar type
+    mBufferSize = (mBufferSize + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) * alignof(std::max_align_t);
+}
+
+char* BufferPool::acquire()
+{
+    if (mFreeList == nullptr) {
+        allocateSlab();
+    }
+    
+    char* buffer = mFreeList;
+    mFreeList = *reinterpret_cast<char**>(buffer);
+    ++mBuffersInUse;
+    
+    return buffer;
+}
+
+void BufferPool::release(char* buffer)
+{
+    if (buffer == nullptr) {
+        return;
+    }
+    
+    *reinterpret_cast<char**>(buffer) = mFreeList;
+    mFreeList = buffer;
+    --mBuffersInUse;
+}
+
+size_t BufferPool::getBufferSize() const
+{
+    return mBufferSize;
+}
+
+size_t BufferPool::getBuffersInUse() const
+{
+    return mBuffersInUse;
+}
+
+size_t BufferPool::getAllocatedBytes() const
+{
+    return mSlabs.size() * mBuffersPerSlab * mBufferSize;
+}
+
+void BufferPool::allocateSlab()
+{
+    mSlabs.emplace_back(new char[mBufferSize * mBuffersPerSlab]);
+    char* slab = mSlabs.back().get();
+    
+    // Push the buffers in reverse so they are handed out in address order
+    for (size_t index = mBuffersPerSlab; index > 0; --index) {
+        char* buffer = slab + (index - 1) * mBufferSize;
+        *reinterpret_cast<char**>(buffer) = mFreeList;
+        mFreeList = buffer;
+    }
+}
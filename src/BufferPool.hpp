@@ -0,0 +1,95 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+/**
+ * Pool of fixed size buffers that connections borrow while they have data in flight. Memory is
+ * allocated in slabs and never returned to the system, freed buffers are kept in a free list.
+ * This class is not thread safe, it must only be used by the thread that owns the connections.
+ */
+class BufferPool
+{
+public:
+    
+    /**
+     * Constructor
+     * @param bufferSize Size of each buffer in bytes
+     * @param buffersPerSlab Number of buffers allocated at once when the pool runs out
+     */
+    BufferPool(size_t bufferSize, size_t buffersPerSlab = 256);
+    
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+    
+    /**
+     * Borrow a buffer from the pool
+     * @return Buffer of getBufferSize() bytes
+     */
+    char* acquire();
+    
+    /**
+     * Return a buffer to the pool
+     * @param buffer Buffer previously returned by acquire()
+     */
+    void release(char* buffer);
+    
+    /**
+     * @return Size of each buffer in bytes
+     */
+    size_t getBufferSize() const;
+    
+    /**
+     * @return Number of buffers currently borrowed
+     */
+    size_t getBuffersInUse() const;
+    
+    /**
+     * @return Total number of bytes allocated by the pool
+     */
+    size_t getAllocatedBytes() const;
+	
+private:
+    
+    /**
+     * Allocate a new slab and add its buffers to the free list
+     */
+    void allocateSlab();
+    
+    // Size of each buffer, rounded up so a free list pointer fits and buffers stay aligned
+    size_t mBufferSize;
+    
+    // Number of buffers allocated per slab
+    size_t mBuffersPerSlab;
+    
+    // Allocated slabs
+    std::vector<std::unique_ptr<char[]>> mSlabs;
+    
+    // Head of the free list, the next pointer is stored in the first bytes of each free buffer
+    char* mFreeList;
+    
+    // Number of buffers currently borrowed
+    size_t mBuffersInUse;
+};
@@ -0,0 +1,68 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "BufferPool.hpp"
+#include "PhaseProfiler.hpp"
+#include "RequestTracer.hpp"
+#include "RoomManager.hpp"
+#include "TrafficCapture.hpp"
+#include "Transport.hpp"
+#include "UdpRelay.hpp"
+
+/**
+ * Resources shared by all clients handled by the same event loop
+ */
+struct ClientContext
+{
+    // Room manager
+    RoomManager& roomManager;
+    
+    // Pool of receive buffers
+    BufferPool& bufferPool;
+    
+    // Request tracer
+    RequestTracer& tracer;
+    
+    // Traffic capture, nullptr when capturing is disabled
+    TrafficCapture* capture;
+    
+    // UDP relay, nullptr when relaying is disabled
+    UdpRelay* relay;
+    
+    // Transport the client connections and room number connections go through
+    Transport& transport;
+    
+    // Bytes a client receives per event loop iteration, the rest waits for its next turn
+    uint32_t maxBytesPerWakeup = 4096;
+    
+    // Messages a client processes per event loop iteration, the rest wait for its next turn
+    uint32_t maxMessagesPerWakeup = 16;
+    
+    // Rooms a host connection can register with REGISTER_NP_SERVERS
+    uint32_t maxRoomsPerConnection = 256;
+    
+    // Profiler the event loop phases are charged to, nullptr when profiling is disabled
+    PhaseProfiler* profiler = nullptr;
+};
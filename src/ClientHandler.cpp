@@ -24,69 +24,41 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
-#include <sys/ioctl.h>
-#include <unistd.h>
+#include <sys/uio.h>
 
 #include <algorithm>
+#include <cstring>
 #include "spdlog/spdlog.h"
 
-std::unordered_map<int,int> ClientHandler::mMessageIdToSize;
+thread_local std::array<char,ClientHandler::SEND_BUFFER_SIZE> ClientHandler::mSendBuffer;
+thread_local std::vector<ListedRoom> ClientHandler::mQueryResults;
 
-ClientHandler::ClientHandler(RoomManager& roomManager, int socketHandle) :
+ClientHandler::ClientHandler(ClientContext& context, int socketHandle) :
+    mContext(context),
     mSocketHandle(socketHandle),
     mSocketHandleSendRoomNumber(-1),
-    mCurrentBufferOffset(0),
-    mCurrentMessageSize(-1),
-    mRoomManager(roomManager),
     mRoomNumber(0),
+    mRelayPort(0),
+    mCaptureConnectionId(0),
+    mSubscribedRoom(0),
+    mMessageBudget(0),
     mRoomNumberSent(false),
-    mRoomNumberSentBytes(0),
-    mHasBeenInit(false)
+    mHasRoom(false),
+    mHasSubscription(false),
+    mWorkDeferred(false)
 {
-    if (mMessageIdToSize.empty())
-    {
-        mMessageIdToSize[INIT_SESSION] = 8;
-        mMessageIdToSize[REGISTER_NP_SERVER] = 8;
-        mMessageIdToSize[NP_SERVER_GAME_STARTED] = 4;
-        mMessageIdToSize[NP_CLIENT_REQUEST_REGISTRATION] = 8;
+    if (mContext.capture != nullptr) {
+        mCaptureConnectionId = mContext.capture->openConnection();
     }
-}
-
-ClientHandler::ClientHandler( const ClientHandler & _clientHandler) :
-    mSocketHandle(_clientHandler.mSocketHandle),
-    mSocketHandleSendRoomNumber(_clientHandler.mSocketHandleSendRoomNumber),
-    mReceiveBuffer(_clientHandler.mReceiveBuffer),
-    mSendBuffer(_clientHandler.mSendBuffer),
-    mRegistrationResponse(_clientHandler.mRegistrationResponse),
-    mCurrentBufferOffset(_clientHandler.mCurrentBufferOffset),
-    mCurrentMessageSize(_clientHandler.mCurrentMessageSize),
-    mRoomManager(_clientHandler.mRoomManager),
-    mRoomNumber(_clientHandler.mRoomNumber),
-    mRoomNumberSent(_clientHandler.mRoomNumberSent),
-    mRoomNumberSentBytes(_clientHandler.mRoomNumberSentBytes)
-{
-
-}
-
-ClientHandler::ClientHandler( const ClientHandler && _clientHandler) :
-    mSocketHandle(std::move(_clientHandler.mSocketHandle)),
-    mSocketHandleSendRoomNumber(std::move(_clientHandler.mSocketHandleSendRoomNumber)),
-    mReceiveBuffer(std::move(_clientHandler.mReceiveBuffer)),
-    mSendBuffer(std::move(_clientHandler.mSendBuffer)),
-    mRegistrationResponse(std::move(_clientHandler.mRegistrationResponse)),
-    mCurrentBufferOffset(std::move(_clientHandler.mCurrentBufferOffset)),
-    mCurrentMessageSize(std::move(_clientHandler.mCurrentMessageSize)),
-    mRoomManager(_clientHandler.mRoomManager),
-    mRoomNumber(std::move(_clientHandler.mRoomNumber)),
-    mRoomNumberSent(std::move(_clientHandler.mRoomNumberSent)),
-    mRoomNumberSentBytes(std::move(_clientHandler.mRoomNumberSentBytes))
-{
+    
+    // Runs until it waits for the first frame
+    mConnection = serve();
 }
 
 ClientHandler::~ClientHandler()
 {
     if (mSocketHandleSendRoomNumber != -1) {
-        close(mSocketHandleSendRoomNumber);
+        mContext.transport.close(mSocketHandleSendRoomNumber);
         
         if (!mRoomNumberSent) {
             SPDLOG_WARN("Connection closed without sending room number {} on socket {} and client socket {}",
@@ -94,18 +66,67 @@ ClientHandler::~ClientHandler()
         }
     }
     
-    mRoomManager.removeRoom(mRoomNumber);
+    mContext.bufferPool.release(mReceiveBuffer.detach());
+    
+    if (mContext.capture != nullptr) {
+        mContext.capture->closeConnection(mCaptureConnectionId);
+    }
+    
+    if (mHasRoom) {
+        mContext.roomManager.removeRoom(mRoomNumber);
+        
+        // Joiners can't be sent to the relay port anymore, so it's free for the next relayed room
+        if (mRelayPort != 0 && mContext.relay != nullptr) {
+            mContext.relay->closeSession(mRelayPort);
+        }
+    }
+    
+    if (!mHostedRooms.empty()) {
+        mContext.roomManager.removeRooms(mHostedRooms);
+    }
+    
+    if (mHasSubscription) {
+        mContext.roomManager.unsubscribe(mSubscribedRoom, mSocketHandle);
+    }
 }
 
 bool ClientHandler::processStream()
 {
     bool closeConn = false;
+    uint32_t byteBudget = mContext.maxBytesPerWakeup;
+    mMessageBudget = mContext.maxMessagesPerWakeup;
+    mWorkDeferred = false;
+    
+    // Borrow a receive ring while there is data to process, idle connections don't hold one
+    if (!mReceiveBuffer.hasStorage()) {
+        mReceiveBuffer.attach(mContext.bufferPool.acquire(), RECEIVE_BUFFER_SIZE);
+    }
+    
+    // Frames left over from the last turn are processed before anything new is received
+    resumeConnectionIfFrameReady();
+    closeConn = mConnection.done();
     
-    // Receive data on this connection until the recv fails with EWOULDBLOCK. If any other
-    // failure occurs, we will close the connection.
-    while (true) {
+    // Receive data on this connection until the recv fails with EWOULDBLOCK or the budget of this turn
+    // is used up. If any other failure occurs, we will close the connection.
+    while (!closeConn) {
+        
+        // The event loop gives this connection another turn once the others had theirs
+        if (byteBudget == 0 || mMessageBudget == 0) {
+            mWorkDeferred = true;
+            break;
+        }
         
-        int receivedBytes = recv(mSocketHandle, mReceiveBuffer.data() + mCurrentBufferOffset, mReceiveBuffer.size() - mCurrentBufferOffset, 0);
+        // Frames are never larger than the ring and complete frames are processed while the message budget
+        // lasts, so there is always free space here
+        iovec segments[2];
+        int numberOfSegments = mReceiveBuffer.getWritableSegments(segments);
+        uint32_t segmentBudget = byteBudget;
+        for (int segmentIndex = 0; segmentIndex < numberOfSegments; ++segmentIndex) {
+            segments[segmentIndex].iov_len = std::min<size_t>(segments[segmentIndex].iov_len, segmentBudget);
+            segmentBudget -= segments[segmentIndex].iov_len;
+        }
+        
+        int receivedBytes = mContext.transport.receive(mSocketHandle, segments, numberOfSegments);
 
         if (receivedBytes < 0)
         {
@@ -125,77 +146,196 @@ bool ClientHandler::processStream()
         }
         
         // Data was received
-        mCurrentBufferOffset += receivedBytes;
-        
-        uint32_t messageId = -1;
-        if (mCurrentBufferOffset >= MESSAGE_ID_SIZE_BYTES) {
-            messageId = ntohl(*reinterpret_cast<uint32_t*>(mReceiveBuffer.data()));
-            
-            if (mMessageIdToSize.count(messageId) != 0) {
-                mCurrentMessageSize = mMessageIdToSize[messageId];
-                if (mCurrentMessageSize > mReceiveBuffer.size()) {
-                    SPDLOG_ERROR("Unexpected message size for message id {}", messageId);
-                    closeConn = true;
-                    break;
-                }
-                
-            } else {
-                SPDLOG_ERROR("Received invalid message id {}", messageId);
-                closeConn = true;
-                break;
+        if (mContext.capture != nullptr) {
+            int firstSegmentBytes = std::min<int>(receivedBytes, segments[0].iov_len);
+            mContext.capture->recordData(mCaptureConnectionId, static_cast<char*>(segments[0].iov_base), firstSegmentBytes);
+            if (receivedBytes > firstSegmentBytes) {
+                mContext.capture->recordData(mCaptureConnectionId, static_cast<char*>(segments[1].iov_base),
+                    receivedBytes - firstSegmentBytes);
             }
         }
+        mReceiveBuffer.commit(receivedBytes);
+        byteBudget -= receivedBytes;
         
-        // The full message has been received, process it
-        if (mCurrentBufferOffset >= mCurrentMessageSize) {
-            closeConn = !processPendingMessage(messageId);
-            
-            mCurrentBufferOffset -= mCurrentMessageSize;
-        }
+        resumeConnectionIfFrameReady();
+        closeConn = mConnection.done();
+    }
+    
+    // Give the ring back if there is no partial frame left in it
+    if (mReceiveBuffer.size() == 0) {
+        mContext.bufferPool.release(mReceiveBuffer.detach());
     }
     
     return closeConn;
 }
 
+bool ClientHandler::hasDeferredWork() const
+{
+    return mWorkDeferred;
+}
+
+void ClientHandler::resumeConnectionIfFrameReady()
+{
+    // The connection flow runs until it needs another frame, runs out of budget or closes the connection
+    if (mFrameReady.isWaiting() && mMessageBudget > 0 && peekFrame().status != FRAME_INCOMPLETE) {
+        mFrameReady.resume();
+    }
+}
 
-bool ClientHandler::processPendingMessage(int messageId)
+ClientHandler::ReceivedFrame ClientHandler::peekFrame() const
+{
+    ReceivedFrame received{FRAME_INCOMPLETE, 0, 0};
+    if (mReceiveBuffer.size() < Protocol::MESSAGE_ID_SIZE_BYTES) {
+        return received;
+    }
+    
+    FrameView pending = mReceiveBuffer.peek(mReceiveBuffer.size());
+    received.messageId = pending.readUint32(0);
+    
+    int messageFrameSize = Protocol::InboundMessages::getFrameSize(received.messageId);
+    if (messageFrameSize == Protocol::UNKNOWN_FRAME_SIZE) {
+        received.status = FRAME_UNKNOWN_MESSAGE;
+        return received;
+    }
+    
+    // Variable length frames carry their payload length after the message id
+    received.size = messageFrameSize;
+    if (messageFrameSize == Protocol::VARIABLE_FRAME_SIZE) {
+        if (pending.size() < Protocol::VARIABLE_FRAME_HEADER_SIZE) {
+            return received;
+        }
+        
+        uint32_t payloadSize = pending.readUint32(Protocol::MESSAGE_ID_SIZE_BYTES);
+        received.size = payloadSize > RECEIVE_BUFFER_SIZE ? RECEIVE_BUFFER_SIZE + 1 :
+            Protocol::VARIABLE_FRAME_HEADER_SIZE + payloadSize;
+    }
+    
+    // Bound the memory used by a connection, frames must fit in the ring
+    if (received.size > RECEIVE_BUFFER_SIZE) {
+        received.status = FRAME_TOO_LARGE;
+        return received;
+    }
+    
+    // Wait for the rest of the frame
+    if (pending.size() >= received.size) {
+        received.status = FRAME_COMPLETE;
+    }
+    
+    return received;
+}
+
+ClientHandler::FrameAwaiter ClientHandler::nextFrame()
+{
+    return FrameAwaiter{*this, ReceivedFrame{FRAME_INCOMPLETE, 0, 0}};
+}
+
+bool ClientHandler::isValidFrame(const ReceivedFrame& received) const
+{
+    switch (received.status) {
+        case FRAME_COMPLETE:
+            return true;
+        case FRAME_UNKNOWN_MESSAGE:
+            SPDLOG_ERROR("Received invalid message id {}", received.messageId);
+            return false;
+        case FRAME_TOO_LARGE:
+            SPDLOG_ERROR("Unexpected message size {} for message id {}", received.size, received.messageId);
+            return false;
+        default:
+            return false;
+    }
+}
+
+ConnectionTask ClientHandler::serve()
+{
+    // Handshake, the session must start with INIT_SESSION with a supported version
+    ReceivedFrame received = co_await nextFrame();
+    if (!isValidFrame(received)) {
+        co_return;
+    }
+    
+    // INIT_SESSION on its own, or combined with the first request to save a round trip
+    if (received.messageId != Protocol::InitSession::ID && received.messageId != Protocol::InitRegisterNpServer::ID &&
+        received.messageId != Protocol::InitNpClientRequestRegistration::ID &&
+        received.messageId != Protocol::InitRegisterNpServerRelay::ID) {
+        SPDLOG_ERROR("Expected INIT_SESSION on socket {}, received message id {}", mSocketHandle, received.messageId);
+        co_return;
+    }
+    
+    bool connectionOpen;
+    {
+        ProfileScope profileScope(mContext.profiler, ProfilePhase::HANDLER);
+        connectionOpen = processPendingMessage(received.messageId, mReceiveBuffer.peek(received.size));
+    }
+    mReceiveBuffer.consume(received.size);
+    
+    // Requests, each complete frame is processed in place until a handler closes the connection
+    while (connectionOpen) {
+        received = co_await nextFrame();
+        if (!isValidFrame(received)) {
+            co_return;
+        }
+        
+        {
+            ProfileScope profileScope(mContext.profiler, ProfilePhase::HANDLER);
+            connectionOpen = processPendingMessage(received.messageId, mReceiveBuffer.peek(received.size));
+        }
+        mReceiveBuffer.consume(received.size);
+    }
+}
+
+bool ClientHandler::processPendingMessage(uint32_t messageId, const FrameView& frame)
 {
     switch(messageId) {
-        case INIT_SESSION:
-            return handleInitSession();
-        case REGISTER_NP_SERVER:
-            return handleRegisterNpServer();
-        case NP_SERVER_GAME_STARTED:
-            return handleNpServerGameStarted();
-        case NP_CLIENT_REQUEST_REGISTRATION:
-            return handleNpClientRequestRegistration();
+        case Protocol::InitSession::ID:
+            return handleInitSession(frame);
+        case Protocol::RegisterNpServer::ID:
+            return handleRegisterNpServer(frame);
+        case Protocol::NpServerGameStarted::ID:
+            return handleNpServerGameStarted(frame);
+        case Protocol::NpClientRequestRegistration::ID:
+            return handleNpClientRequestRegistration(frame);
+        case Protocol::RegisterNpServerRelay::ID:
+            return handleRegisterNpServerRelay(frame);
+        case Protocol::SubscribeRoom::ID:
+            return handleSubscribeRoom(frame);
+        case Protocol::InitRegisterNpServer::ID:
+            return handleInitRegisterNpServer(frame);
+        case Protocol::InitNpClientRequestRegistration::ID:
+            return handleInitNpClientRequestRegistration(frame);
+        case Protocol::InitRegisterNpServerRelay::ID:
+            return handleInitRegisterNpServerRelay(frame);
+        case Protocol::RegisterNpServers::ID:
+            return handleRegisterNpServers(frame);
+        case Protocol::RenewNpServers::ID:
+            return handleRenewNpServers(frame);
+        case Protocol::CloseNpServers::ID:
+            return handleCloseNpServers(frame);
+        case Protocol::RegisterListedNpServer::ID:
+            return handleRegisterListedNpServer(frame);
+        case Protocol::UpdateRoomListing::ID:
+            return handleUpdateRoomListing(frame);
+        case Protocol::QueryRooms::ID:
+            return handleQueryRooms(frame);
         default:
             // Do nothing
             return true;
     }
 }
 
-bool ClientHandler::handleInitSession()
+bool ClientHandler::handleInitSession(const FrameView& frame)
 {
     bool sendSuccess = true;
 
     // Parse the message
-    char* receiveBufferOffset = mReceiveBuffer.data();
-    receiveBufferOffset += MESSAGE_ID_SIZE_BYTES; // Skip the message id
-    uint32_t netplayVersion = ntohl(*reinterpret_cast<uint32_t*>(receiveBufferOffset));
+    auto [netplayVersion] = Protocol::InitSession::decode(frame);
+    bool supportedVersion = startSession(netplayVersion);
     
     // Send the response
-    int sendBufferOffset = 0;
-    uint32_t messageId = htonl(INIT_SESSION_RESPONSE);
-    std::copy_n(reinterpret_cast<char*>(&messageId), sizeof(uint32_t), mSendBuffer.data() + sendBufferOffset);
-    sendBufferOffset += sizeof(uint32_t);
-
-    mHasBeenInit = netplayVersion == NETPLAY_VERSION;
-    bool validVersion = htonl(mHasBeenInit);
-    std::copy_n(reinterpret_cast<char*>(&validVersion), sizeof(uint32_t), mSendBuffer.data() + sendBufferOffset);
-    sendBufferOffset += sizeof(uint32_t);
+    static_assert(Protocol::InitSessionResponse::SIZE <= SEND_BUFFER_SIZE, "Send buffer is too small");
+    uint32_t validVersion = supportedVersion ? 1 : 0;
+    uint32_t responseSize = Protocol::InitSessionResponse::encode(mSendBuffer.data(), validVersion);
     
-    int sentBytes = send(mSocketHandle, mSendBuffer.data(), sendBufferOffset, 0);
+    int sentBytes = mContext.transport.send(mSocketHandle, mSendBuffer.data(), responseSize);
 
     if (sentBytes < 0)
     {
@@ -203,163 +343,597 @@ bool ClientHandler::handleInitSession()
         SPDLOG_ERROR("Unable to send init session response message");
     }
     
-    if (!mHasBeenInit) {
+    if (!supportedVersion) {
         sendSuccess = false;
     }
     
     return sendSuccess;
 }
 
-bool ClientHandler::handleRegisterNpServer()
+bool ClientHandler::startSession(uint32_t netplayVersion)
+{
+    uint64_t nowMicroseconds = MonotonicClock::nowMicroseconds();
+    mTrace.mark(ConnectionTrace::INIT_SESSION, nowMicroseconds);
+    mContext.tracer.record(TracePhase::INIT_SESSION, mTrace.sinceAccepted(nowMicroseconds), mSocketHandle, 0);
+    
+    return netplayVersion == Protocol::NETPLAY_VERSION;
+}
+
+bool ClientHandler::handleRegisterNpServer(const FrameView& frame)
+{
+    // Parse the message
+    auto [netplayServerPort] = Protocol::RegisterNpServer::decode(frame);
+    
+    return registerNpServer(netplayServerPort);
+}
+
+bool ClientHandler::handleInitRegisterNpServer(const FrameView& frame)
 {
-    if (!mHasBeenInit) {
+    // Parse the message
+    auto [netplayVersion, netplayServerPort] = Protocol::InitRegisterNpServer::decode(frame);
+    bool supportedVersion = startSession(netplayVersion);
+    
+    if (supportedVersion && !registerNpServer(netplayServerPort)) {
         return false;
     }
     
-    std::unique_lock<std::mutex> lock(mClientRoomMutex);
+    // The room number goes back on this connection as well, the host doesn't have to wait for the netplay server
+    static_assert(Protocol::InitRegisterNpServerResponse::SIZE <= SEND_BUFFER_SIZE, "Send buffer is too small");
+    uint32_t responseSize = Protocol::InitRegisterNpServerResponse::encode(mSendBuffer.data(), supportedVersion ? 1 : 0,
+        supportedVersion ? mRoomNumber : 0);
     
-    bool sendSuccess = true;
+    if (mContext.transport.send(mSocketHandle, mSendBuffer.data(), responseSize) < 0)
+    {
+        SPDLOG_ERROR("Unable to send combined registration response");
+        return false;
+    }
+    
+    return supportedVersion;
+}
 
-    // Parse the message
-    char* receiveBufferOffset = mReceiveBuffer.data();
-    receiveBufferOffset += MESSAGE_ID_SIZE_BYTES; // Skip the message id
-    uint32_t netplayServerPort = ntohl(*reinterpret_cast<uint32_t*>(receiveBufferOffset));
-    receiveBufferOffset += sizeof(uint32_t);
+bool ClientHandler::registerNpServer(uint32_t netplayServerPort)
+{
+    // Joiners of a relayed room must keep going through the relay, the host can't be reached directly
+    if (mRelayPort != 0) {
+        SPDLOG_ERROR("Direct registration of relayed room {} on socket {}", mRoomNumber, mSocketHandle);
+        return false;
+    }
     
-    sockaddr_storage addrStorage;
-    socklen_t len = sizeof(sockaddr_storage);
-    getpeername(mSocketHandle, reinterpret_cast<sockaddr*>(&addrStorage), &len);
+    sockaddr_in6 address;
+    if (!mContext.transport.getPeerAddress(mSocketHandle, address)) {
+        SPDLOG_ERROR("getpeername() failed on socket {}, errno={}", mSocketHandle, errno);
+        return false;
+    }
     
     char ipAddress[INET6_ADDRSTRLEN];
-    sockaddr_in6& address = *reinterpret_cast<sockaddr_in6*>(&addrStorage);
     inet_ntop(AF_INET6, &address.sin6_addr, ipAddress, sizeof(ipAddress));
     
+    // Registering again keeps the room number, subscribers are told about the new address. The netplay
+    // server already has its room number, so it's not sent again.
+    if (mHasRoom) {
+        mContext.roomManager.updateRoom(mRoomNumber, std::string(ipAddress), netplayServerPort);
+        SPDLOG_INFO("Updated room {} on socket {}: {}:{}", mRoomNumber, mSocketHandle, ipAddress, netplayServerPort);
+        return true;
+    }
+    
     // Create the room
-    mRoomNumber = mRoomManager.createRoom(std::string(ipAddress), netplayServerPort);
+    mRoomNumber = mContext.roomManager.createRoom(std::string(ipAddress), netplayServerPort);
+    mHasRoom = true;
     SPDLOG_INFO("Created room {} on socket {}: {}:{}", mRoomNumber, mSocketHandle, ipAddress, netplayServerPort);
+    
+    uint64_t nowMicroseconds = MonotonicClock::nowMicroseconds();
+    mTrace.mark(ConnectionTrace::REGISTERED, nowMicroseconds);
+    mContext.tracer.record(TracePhase::REGISTER_NP_SERVER, mTrace.since(ConnectionTrace::INIT_SESSION, nowMicroseconds),
+        mSocketHandle, mRoomNumber);
+
+    sockaddr_in6 server_addr = {};
+    server_addr.sin6_family = AF_INET6;
+    server_addr.sin6_addr = address.sin6_addr;
+    server_addr.sin6_port = htons(netplayServerPort); 
+    
+    if (mContext.capture != nullptr) {
+        mContext.capture->recordCallback(mCaptureConnectionId, static_cast<uint16_t>(netplayServerPort), mRoomNumber);
+    }
+    
+    // Nonblocking, the room number is sent once the connection completes
+    mSocketHandleSendRoomNumber = mContext.transport.connect(server_addr);
+    if (mSocketHandleSendRoomNumber < 0) {
+        SPDLOG_ERROR("connect() failed on socket {} address: {}:{}, error={}", mSocketHandle, ipAddress, netplayServerPort, strerror(errno));
+        return false;
+    }
+    
+    // Runs until it waits for the connection to complete
+    mRoomNumberDelivery = deliverRoomNumber();
+
+    return true;
+}
+
+bool ClientHandler::handleRegisterListedNpServer(const FrameView& frame)
+{
+    // Parse the message
+    auto [netplayServerPort, gameId, region, openSlots] = Protocol::RegisterListedNpServer::decode(frame);
+    
+    if (!registerNpServer(netplayServerPort)) {
+        return false;
+    }
+    
+    mContext.roomManager.setListing(mRoomNumber, RoomListing{gameId, region, openSlots});
+    SPDLOG_INFO("Listed room {} on socket {}: game={:x}, region={}, open_slots={}", mRoomNumber, mSocketHandle, gameId,
+        region, openSlots);
+    
+    return true;
+}
+
+bool ClientHandler::handleUpdateRoomListing(const FrameView& frame)
+{
+    // Parse the message
+    auto [gameId, region, openSlots] = Protocol::UpdateRoomListing::decode(frame);
+    
+    // No response, a connection without a room has nothing to list
+    if (!mHasRoom) {
+        SPDLOG_WARN("Room listing update without a room on socket {}", mSocketHandle);
+        return true;
+    }
+    
+    mContext.roomManager.setListing(mRoomNumber, RoomListing{gameId, region, openSlots});
+    SPDLOG_INFO("Updated listing of room {} on socket {}: game={:x}, region={}, open_slots={}", mRoomNumber, mSocketHandle,
+        gameId, region, openSlots);
+    
+    return true;
+}
 
-    mSocketHandleSendRoomNumber = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
-      
-    // Set socket to be nonblocking.
-    int on = 1;
-    if (ioctl(mSocketHandleSendRoomNumber, FIONBIO, reinterpret_cast<char*>(&on)) < 0)
+bool ClientHandler::handleQueryRooms(const FrameView& frame)
+{
+    using Response = Protocol::QueryRoomsResponse;
+    
+    // Parse the message
+    auto [gameId, region, afterRoomNumber, maxRooms] = Protocol::QueryRooms::decode(frame);
+    
+    // Pages are limited to what fits in a single response
+    uint32_t pageSize = std::min(maxRooms, Response::getMaxRecords(SEND_BUFFER_SIZE));
+    mContext.roomManager.queryRooms(gameId, region, afterRoomNumber, pageSize, mQueryResults);
+    
+    uint32_t responseSize = Response::encodeHeader(mSendBuffer.data(), mQueryResults.size());
+    for (uint32_t roomIndex = 0; roomIndex < mQueryResults.size(); ++roomIndex) {
+        const ListedRoom& room = mQueryResults[roomIndex];
+        Response::encodeRecord(mSendBuffer.data(), roomIndex, room.roomNumber, room.region, room.openSlots);
+    }
+    
+    SPDLOG_INFO("Room query on socket {}: game={:x}, region={}, after={}, found={}", mSocketHandle, gameId, region,
+        afterRoomNumber, mQueryResults.size());
+    
+    if (mContext.transport.send(mSocketHandle, mSendBuffer.data(), responseSize) < 0)
     {
-        SPDLOG_ERROR("ioctl() failed");
-        close(mSocketHandleSendRoomNumber);
+        SPDLOG_ERROR("Unable to send room query response");
         return false;
     }
     
-    sockaddr_in6 server_addr;
-    server_addr.sin6_family = AF_INET6;
-    inet_pton(AF_INET6, ipAddress, &server_addr.sin6_addr);
-    server_addr.sin6_port = htons(netplayServerPort); 
+    return true;
+}
+
+bool ClientHandler::handleRegisterNpServerRelay(const FrameView&)
+{
+    uint32_t roomNumber = 0;
+    uint16_t relayPort = 0;
+    uint32_t token = 0;
+    registerNpServerRelay(roomNumber, relayPort, token);
+    
+    // The host can't accept connections, so the response goes back on this connection
+    static_assert(Protocol::RegisterNpServerRelayResponse::SIZE <= SEND_BUFFER_SIZE, "Send buffer is too small");
+    uint32_t responseSize = Protocol::RegisterNpServerRelayResponse::encode(mSendBuffer.data(), roomNumber, relayPort, token);
+    
+    if (mContext.transport.send(mSocketHandle, mSendBuffer.data(), responseSize) < 0)
+    {
+        SPDLOG_ERROR("Unable to send relay registration response");
+        return false;
+    }
     
-    if (connect(mSocketHandleSendRoomNumber, reinterpret_cast<sockaddr*>(&server_addr), sizeof(server_addr)) < 0) {
+    return true;
+}
 
-       if (errno != EWOULDBLOCK && errno != EINPROGRESS)
-       {
-           SPDLOG_ERROR("connect() failed on socket {} address: {}:{}, error={}", mSocketHandle, ipAddress, netplayServerPort, strerror(errno));
-           return false;
-       }
+bool ClientHandler::handleInitRegisterNpServerRelay(const FrameView& frame)
+{
+    // Parse the message
+    auto [netplayVersion] = Protocol::InitRegisterNpServerRelay::decode(frame);
+    bool supportedVersion = startSession(netplayVersion);
+    
+    uint32_t roomNumber = 0;
+    uint16_t relayPort = 0;
+    uint32_t token = 0;
+    if (supportedVersion) {
+        registerNpServerRelay(roomNumber, relayPort, token);
+    }
+    
+    static_assert(Protocol::InitRegisterNpServerRelayResponse::SIZE <= SEND_BUFFER_SIZE, "Send buffer is too small");
+    uint32_t responseSize = Protocol::InitRegisterNpServerRelayResponse::encode(mSendBuffer.data(), supportedVersion ? 1 : 0,
+        roomNumber, relayPort, token);
+    
+    if (mContext.transport.send(mSocketHandle, mSendBuffer.data(), responseSize) < 0)
+    {
+        SPDLOG_ERROR("Unable to send combined relay registration response");
+        return false;
     }
+    
+    return supportedVersion;
+}
 
-    int sendBufferOffset = 0;
-    uint32_t messageId = htonl(REGISTER_NP_SERVER_RESPONSE);
-    std::copy_n(reinterpret_cast<char*>(&messageId), sizeof(uint32_t), mRegistrationResponse.data() + sendBufferOffset);
-    sendBufferOffset += sizeof(uint32_t);
+void ClientHandler::registerNpServerRelay(uint32_t& roomNumber, uint16_t& relayPort, uint32_t& token)
+{
+    // Without a free relay port the room number is 0, the host can fall back to a direct registration
+    if (mContext.relay != nullptr && !mHasRoom && mContext.relay->reserveSession(relayPort)) {
+        // Joiners are sent to the relay, by default at the address the host reached us on
+        std::string relayAddress = mContext.relay->getPublicAddress();
+        if (relayAddress.empty()) {
+            sockaddr_in6 address;
+            char ipAddress[INET6_ADDRSTRLEN] = {};
+            if (mContext.transport.getLocalAddress(mSocketHandle, address)) {
+                inet_ntop(AF_INET6, &address.sin6_addr, ipAddress, sizeof(ipAddress));
+            }
+            relayAddress = ipAddress;
+        }
+        
+        mRoomNumber = mContext.roomManager.createRoom(relayAddress, relayPort);
+        mHasRoom = true;
+        mRelayPort = relayPort;
+        roomNumber = mRoomNumber;
+        token = mContext.relay->openSession(relayPort, mRoomNumber);
+        SPDLOG_INFO("Created relayed room {} on socket {}: {}:{}", mRoomNumber, mSocketHandle, relayAddress, relayPort);
+        
+        uint64_t nowMicroseconds = MonotonicClock::nowMicroseconds();
+        mTrace.mark(ConnectionTrace::REGISTERED, nowMicroseconds);
+        mContext.tracer.record(TracePhase::REGISTER_NP_SERVER, mTrace.since(ConnectionTrace::INIT_SESSION, nowMicroseconds),
+            mSocketHandle, mRoomNumber);
+    } else {
+        SPDLOG_WARN("No relay port available for socket {}", mSocketHandle);
+    }
+}
 
-    uint32_t roomNumber = htonl(mRoomNumber);
-    std::copy_n(reinterpret_cast<char*>(&roomNumber), sizeof(uint32_t), mRegistrationResponse.data() + sendBufferOffset);
+bool ClientHandler::handleRegisterNpServers(const FrameView& frame)
+{
+    using Request = Protocol::RegisterNpServers;
+    using Response = Protocol::RegisterNpServersResponse;
+    
+    int recordCount = Request::getRecordCount(frame);
+    if (recordCount < 0) {
+        SPDLOG_ERROR("Malformed REGISTER_NP_SERVERS of {} bytes on socket {}", frame.size(), mSocketHandle);
+        return false;
+    }
+    
+    std::string ipAddress;
+    if (!getPeerIpAddress(ipAddress)) {
+        return false;
+    }
+    
+    // Room numbers go back in the order of the ports, there is no room number socket per room
+    static_assert(Response::getSize(Request::getMaxRecords(RECEIVE_BUFFER_SIZE)) <= SEND_BUFFER_SIZE, "Send buffer is too small");
+    uint32_t responseSize = Response::encodeHeader(mSendBuffer.data(), recordCount);
+    uint32_t createdRooms = 0;
+    
+    for (int recordIndex = 0; recordIndex < recordCount; ++recordIndex) {
+        auto [netplayServerPort] = Request::decodeRecord(frame, recordIndex);
+        
+        uint32_t roomNumber = 0;
+        if (mHostedRooms.size() < mContext.maxRoomsPerConnection) {
+            roomNumber = mContext.roomManager.createRoom(ipAddress, netplayServerPort);
+            mHostedRooms.push_back(roomNumber);
+            ++createdRooms;
+        }
+        
+        Response::encodeRecord(mSendBuffer.data(), recordIndex, roomNumber);
+    }
+    
+    SPDLOG_INFO("Created {} of {} rooms on socket {}: {}, hosted rooms={}", createdRooms, recordCount, mSocketHandle,
+        ipAddress, mHostedRooms.size());
+    
+    if (mContext.transport.send(mSocketHandle, mSendBuffer.data(), responseSize) < 0)
+    {
+        SPDLOG_ERROR("Unable to send batch registration response");
+        return false;
+    }
+    
+    return true;
+}
 
+bool ClientHandler::handleRenewNpServers(const FrameView& frame)
+{
+    using Request = Protocol::RenewNpServers;
+    using Response = Protocol::RenewNpServersResponse;
+    
+    int recordCount = Request::getRecordCount(frame);
+    if (recordCount < 0) {
+        SPDLOG_ERROR("Malformed RENEW_NP_SERVERS of {} bytes on socket {}", frame.size(), mSocketHandle);
+        return false;
+    }
+    
+    std::string ipAddress;
+    if (!getPeerIpAddress(ipAddress)) {
+        return false;
+    }
+    
+    static_assert(Response::getSize(Request::getMaxRecords(RECEIVE_BUFFER_SIZE)) <= SEND_BUFFER_SIZE, "Send buffer is too small");
+    uint32_t responseSize = Response::encodeHeader(mSendBuffer.data(), recordCount);
+    uint32_t renewedRooms = 0;
+    
+    // Like registering again, the room number is kept and subscribers are told about the new address
+    for (int recordIndex = 0; recordIndex < recordCount; ++recordIndex) {
+        auto [roomNumber, netplayServerPort] = Request::decodeRecord(frame, recordIndex);
+        
+        bool hosted = std::find(mHostedRooms.begin(), mHostedRooms.end(), roomNumber) != mHostedRooms.end();
+        if (hosted) {
+            mContext.roomManager.updateRoom(roomNumber, ipAddress, netplayServerPort);
+            ++renewedRooms;
+        }
+        
+        Response::encodeRecord(mSendBuffer.data(), recordIndex, hosted ? 1 : 0);
+    }
+    
+    SPDLOG_INFO("Renewed {} of {} rooms on socket {}: {}", renewedRooms, recordCount, mSocketHandle, ipAddress);
+    
+    if (mContext.transport.send(mSocketHandle, mSendBuffer.data(), responseSize) < 0)
+    {
+        SPDLOG_ERROR("Unable to send batch renewal response");
+        return false;
+    }
+    
     return true;
 }
 
-bool ClientHandler::handleNpServerGameStarted()
+bool ClientHandler::handleCloseNpServers(const FrameView& frame)
 {
-    // No response, just remove the room and close the connection
-    mRoomManager.removeRoom(mRoomNumber);
+    using Request = Protocol::CloseNpServers;
     
-    return false;
+    int recordCount = Request::getRecordCount(frame);
+    if (recordCount < 0) {
+        SPDLOG_ERROR("Malformed CLOSE_NP_SERVERS of {} bytes on socket {}", frame.size(), mSocketHandle);
+        return false;
+    }
+    
+    // No response, rooms that don't belong to this connection are skipped and the connection stays open
+    uint32_t closedRooms = 0;
+    for (int recordIndex = 0; recordIndex < recordCount; ++recordIndex) {
+        auto [roomNumber, reason] = Request::decodeRecord(frame, recordIndex);
+        
+        if (reason != RoomEvent::GAME_STARTED && reason != RoomEvent::ROOM_REMOVED) {
+            SPDLOG_ERROR("Invalid close reason {} for room {} on socket {}", reason, roomNumber, mSocketHandle);
+            return false;
+        }
+        
+        auto roomIter = std::find(mHostedRooms.begin(), mHostedRooms.end(), roomNumber);
+        if (roomIter != mHostedRooms.end()) {
+            *roomIter = mHostedRooms.back();
+            mHostedRooms.pop_back();
+            mContext.roomManager.removeRoom(roomNumber, static_cast<RoomEvent::Type>(reason));
+            ++closedRooms;
+        }
+    }
+    
+    SPDLOG_INFO("Closed {} of {} rooms on socket {}, hosted rooms={}", closedRooms, recordCount, mSocketHandle, mHostedRooms.size());
+    
+    return true;
 }
 
-bool ClientHandler::handleNpClientRequestRegistration()
+bool ClientHandler::getPeerIpAddress(std::string& ipAddress) const
 {
-    if (!mHasBeenInit) {
+    sockaddr_in6 address;
+    if (!mContext.transport.getPeerAddress(mSocketHandle, address)) {
+        SPDLOG_ERROR("getpeername() failed on socket {}, errno={}", mSocketHandle, errno);
         return false;
     }
+    
+    char addressString[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6, &address.sin6_addr, addressString, sizeof(addressString));
+    ipAddress = addressString;
+    return true;
+}
 
+bool ClientHandler::handleNpServerGameStarted(const FrameView&)
+{
+    // No response, just remove the room and close the connection
+    if (mHasRoom) {
+        mContext.tracer.record(TracePhase::GAME_START, mTrace.since(ConnectionTrace::REGISTERED, MonotonicClock::nowMicroseconds()),
+            mSocketHandle, mRoomNumber);
+        mContext.roomManager.removeRoom(mRoomNumber, RoomEvent::GAME_STARTED);
+        mHasRoom = false;
+        
+        // The relay carries the game that just started, it lets the session go once the game is over
+        if (mRelayPort != 0 && mContext.relay != nullptr) {
+            mContext.relay->releaseSessionWhenIdle(mRelayPort);
+        }
+    }
+    
+    return false;
+}
+
+bool ClientHandler::handleNpClientRequestRegistration(const FrameView& frame)
+{
+    // Lookups are timed on their own, connections can stay open for many of them
+    uint64_t startMicroseconds = MonotonicClock::nowMicroseconds();
     bool sendSuccess = true;
 
     // Parse the message
-    char* receiveBufferOffset = mReceiveBuffer.data();
-    receiveBufferOffset += MESSAGE_ID_SIZE_BYTES; // Skip the message id
-    uint32_t roomId = ntohl(*reinterpret_cast<uint32_t*>(receiveBufferOffset));
-    
-    // Send the response
-    int sendBufferOffset = 0;
-    uint32_t messageId = htonl(NP_CLIENT_REQUEST_REGISTRATION_RESPONSE);
-    std::copy_n(reinterpret_cast<char*>(&messageId), sizeof(uint32_t), mSendBuffer.data() + sendBufferOffset);
-    sendBufferOffset += sizeof(uint32_t);
+    auto [roomId] = Protocol::NpClientRequestRegistration::decode(frame);
     
-    // Get IP and port
-    auto roomData = mRoomManager.getRoom(roomId);
+    // The response is serialized by the room, so it's sent as is
+    const RoomManager::LookupResponse* response = mContext.roomManager.findLookupResponse(roomId);
 
-    char ipAddress[INET6_ADDRSTRLEN];
-    std::fill(ipAddress, ipAddress + INET6_ADDRSTRLEN, 0);
-    roomData.first.copy(ipAddress, INET6_ADDRSTRLEN);
-    std::copy_n(ipAddress, sizeof(ipAddress), mSendBuffer.data() + sendBufferOffset);
-    sendBufferOffset += sizeof(ipAddress);
+    SPDLOG_ERROR("Request for room data on socket {}, room={}, found={}", mSocketHandle, roomId, response != nullptr);
     
-    int32_t port = htonl(roomData.second);
-    std::copy_n(reinterpret_cast<char*>(&port), sizeof(port), mSendBuffer.data() + sendBufferOffset);
-    sendBufferOffset += sizeof(port);
-
-    SPDLOG_ERROR("Request for room data on socket {}, room={}, ip={}, port={}", mSocketHandle, roomId, ipAddress, roomData.second);
+    if (response == nullptr) {
+        response = &RoomManager::getMissingRoomResponse();
+    }
 
-    
-    int sentBytes = send(mSocketHandle, mSendBuffer.data(), sendBufferOffset, 0);
+    // Send the response
+    int sentBytes = mContext.transport.send(mSocketHandle, response->data(), response->size());
 
     if (sentBytes < 0)
     {
         sendSuccess = false;
         SPDLOG_ERROR("Unable to send registration data request response");
     }
+    else
+    {
+        mContext.tracer.record(TracePhase::LOOKUP, MonotonicClock::nowMicroseconds() - startMicroseconds, mSocketHandle, roomId);
+    }
     
     return sendSuccess;
 }
 
-void ClientHandler::sendNetplayRoomIfConnected()
+bool ClientHandler::handleInitNpClientRequestRegistration(const FrameView& frame)
 {
-    std::unique_lock<std::mutex> lock(mClientRoomMutex);
+    using Response = Protocol::InitNpClientRequestRegistrationResponse;
     
-    if (mSocketHandleSendRoomNumber != -1 && !mRoomNumberSent) {
-        
-        sockaddr_storage addrStorage;
-        socklen_t len = sizeof(sockaddr_storage);
-        int returnCode = getpeername(mSocketHandleSendRoomNumber, reinterpret_cast<sockaddr*>(&addrStorage), &len);
-
-        // Send the response if we are connected
-        if (returnCode == 0) {
-            int sentBytes = send(mSocketHandleSendRoomNumber, mRegistrationResponse.data() + mRoomNumberSentBytes,
-                mRegistrationResponse.size() - mRoomNumberSentBytes, 0);
+    uint64_t startMicroseconds = MonotonicClock::nowMicroseconds();
+    
+    // Parse the message
+    auto [netplayVersion, roomId] = Protocol::InitNpClientRequestRegistration::decode(frame);
+    bool supportedVersion = startSession(netplayVersion);
+    
+    const RoomManager::LookupResponse* response = supportedVersion ? mContext.roomManager.findLookupResponse(roomId) : nullptr;
+    
+    SPDLOG_ERROR("Combined request for room data on socket {}, room={}, found={}", mSocketHandle, roomId, response != nullptr);
+    
+    if (response == nullptr) {
+        response = &RoomManager::getMissingRoomResponse();
+    }
+    
+    // Address and port are copied from the serialized lookup response of the room
+    static_assert(Response::SIZE <= SEND_BUFFER_SIZE, "Send buffer is too small");
+    Protocol::Uint32Field::encode(mSendBuffer.data(), Response::ID);
+    Protocol::Uint32Field::encode(mSendBuffer.data() + Response::getFieldOffset<0>(), supportedVersion ? 1 : 0);
+    std::memcpy(mSendBuffer.data() + Response::getFieldOffset<1>(),
+        response->data() + Protocol::NpClientRequestRegistrationResponse::getFieldOffset<0>(), Response::SIZE - Response::getFieldOffset<1>());
+    
+    if (mContext.transport.send(mSocketHandle, mSendBuffer.data(), Response::SIZE) < 0)
+    {
+        SPDLOG_ERROR("Unable to send combined registration data request response");
+        return false;
+    }
+    
+    mContext.tracer.record(TracePhase::LOOKUP, MonotonicClock::nowMicroseconds() - startMicroseconds, mSocketHandle, roomId);
+    return supportedVersion;
+}
+
+bool ClientHandler::handleSubscribeRoom(const FrameView& frame)
+{
+    // Parse the message
+    auto [roomNumber] = Protocol::SubscribeRoom::decode(frame);
+    
+    // A connection follows a single room
+    if (mHasSubscription) {
+        mContext.roomManager.unsubscribe(mSubscribedRoom, mSocketHandle);
+        mHasSubscription = false;
+    }
+    
+    // Reply with the current state, later changes are pushed. There is nothing to follow if the room doesn't exist.
+    auto roomData = mContext.roomManager.getRoom(roomNumber);
+    RoomEvent event{roomData.second == -1 ? RoomEvent::ROOM_REMOVED : RoomEvent::ROOM_EXISTS, roomNumber,
+        roomData.first, roomData.second};
+    
+    if (event.type == RoomEvent::ROOM_EXISTS) {
+        mContext.roomManager.subscribe(roomNumber, mSocketHandle);
+        mSubscribedRoom = roomNumber;
+        mHasSubscription = true;
+    }
+    
+    SPDLOG_INFO("Subscription to room {} on socket {}, exists={}", roomNumber, mSocketHandle, mHasSubscription);
+    
+    static_assert(Protocol::RoomEventPush::SIZE <= SEND_BUFFER_SIZE, "Send buffer is too small");
+    uint32_t responseSize = encodeRoomEvent(event, mSendBuffer.data());
+    
+    if (mContext.transport.send(mSocketHandle, mSendBuffer.data(), responseSize) < 0)
+    {
+        SPDLOG_ERROR("Unable to send subscription response");
+        return false;
+    }
+    
+    return true;
+}
+
+bool ClientHandler::sendRoomEvents(const char* data, uint32_t length)
+{
+    // Events are tiny, a subscriber whose socket buffer is full is not reading them
+    ssize_t sentBytes = mContext.transport.send(mSocketHandle, data, length);
+    if (sentBytes != static_cast<ssize_t>(length)) {
+        SPDLOG_ERROR("Unable to push room events to socket {}, sent {} of {} bytes", mSocketHandle, sentBytes, length);
+        return false;
+    }
+    
+    return true;
+}
+
+uint32_t ClientHandler::encodeRoomEvent(const RoomEvent& event, char* buffer)
+{
+    return Protocol::RoomEventPush::encode(buffer, event.roomNumber, event.type,
+        Protocol::FixedStringField<INET6_ADDRSTRLEN>::fromString(event.ipAddress), event.port);
+}
+
+bool ClientHandler::resumeRoomNumberDelivery()
+{
+    mRoomNumberSocketWritable.resume();
+    return !mRoomNumberSocketWritable.isWaiting();
+}
+
+ConnectionTask ClientHandler::deliverRoomNumber()
+{
+    // The room number socket becomes writable once the connection to the netplay server completes or fails
+    co_await mRoomNumberSocketWritable.wait();
+    
+    int socketError = mContext.transport.getConnectError(mSocketHandleSendRoomNumber);
+    if (socketError != 0) {
+        SPDLOG_ERROR("Unable to connect to netplay server for room {}, errno={}, str={}", mRoomNumber, socketError, strerror(socketError));
+        mContext.transport.close(mSocketHandleSendRoomNumber);
+        mSocketHandleSendRoomNumber = -1;
+        co_return;
+    }
+    
+    uint64_t connectedMicroseconds = MonotonicClock::nowMicroseconds();
+    mTrace.mark(ConnectionTrace::CALLBACK_CONNECTED, connectedMicroseconds);
+    mContext.tracer.record(TracePhase::CALLBACK_CONNECT, mTrace.since(ConnectionTrace::REGISTERED, connectedMicroseconds),
+        mSocketHandle, mRoomNumber);
+    
+    // Send the response now that we are connected, waiting again whenever the socket is full
+    Protocol::RegisterNpServerResponse::Buffer registrationResponse;
+    Protocol::RegisterNpServerResponse::encode(registrationResponse.data(), mRoomNumber);
+    
+    uint32_t sentBytes = 0;
+    while (sentBytes < registrationResponse.size()) {
+        int result = mContext.transport.send(mSocketHandleSendRoomNumber, registrationResponse.data() + sentBytes,
+            registrationResponse.size() - sentBytes);
         
-            if (sentBytes < 0)
-            {
-                SPDLOG_ERROR("Unable to send registration response, errno={}, str={}", errno, strerror(errno));
-                close(mSocketHandleSendRoomNumber);
-                mSocketHandleSendRoomNumber = -1;
-            }
-            else
-            {
-                mRoomNumberSentBytes += sentBytes;
-                
-                if (mRoomNumberSentBytes == mRegistrationResponse.size()) {
-                    mRoomNumberSent = true;
-                    SPDLOG_ERROR("Sent room number {} to client {} through socket {}", mRoomNumber, mSocketHandle, mSocketHandleSendRoomNumber);
-                }
+        if (result < 0) {
+            if (errno == EWOULDBLOCK) {
+                co_await mRoomNumberSocketWritable.wait();
+                continue;
             }
-        }    
+            
+            SPDLOG_ERROR("Unable to send registration response, errno={}, str={}", errno, strerror(errno));
+            mContext.transport.close(mSocketHandleSendRoomNumber);
+            mSocketHandleSendRoomNumber = -1;
+            co_return;
+        }
+        
+        sentBytes += result;
     }
+    
+    uint64_t nowMicroseconds = MonotonicClock::nowMicroseconds();
+    mRoomNumberSent = true;
+    mContext.tracer.record(TracePhase::ROOM_NUMBER_SEND, mTrace.since(ConnectionTrace::CALLBACK_CONNECTED, nowMicroseconds),
+        mSocketHandle, mRoomNumber);
+    mContext.tracer.record(TracePhase::ROOM_NUMBER_DELIVERY, mTrace.since(ConnectionTrace::REGISTERED, nowMicroseconds),
+        mSocketHandle, mRoomNumber);
+    SPDLOG_ERROR("Sent room number {} to client {} through socket {}", mRoomNumber, mSocketHandle, mSocketHandleSendRoomNumber);
+    
+    // Nothing else is sent to the netplay server, so the socket doesn't hold a descriptor for the rest of the connection
+    mContext.transport.close(mSocketHandleSendRoomNumber);
+    mSocketHandleSendRoomNumber = -1;
 }
 
+int ClientHandler::getRoomNumberSocket() const
+{
+    return mSocketHandleSendRoomNumber;
+}
 
+bool ClientHandler::isRoomNumberSent() const
+{
+    return mRoomNumberSent;
+}
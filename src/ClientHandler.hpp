@@ -22,31 +22,36 @@
 #pragma once
 
 #include <array>
-#include <unordered_map>
-#include <mutex>
+#include <cstdint>
+#include <string>
+#include <vector>
 
-#include "RoomManager.hpp"
+#include "ClientContext.hpp"
+#include "Coroutine.hpp"
+#include "Protocol.hpp"
+#include "RequestTracer.hpp"
+#include "RingBuffer.hpp"
 
 class ClientHandler
 {
 public:
     
+    // Size of the receive ring borrowed from the buffer pool, also the largest frame a client can send.
+    // Must be a power of two.
+    static const int RECEIVE_BUFFER_SIZE = 256;
+    
     /**
      * Constructor
-     * @param roomManager Room manager
+     * @param context Room manager, buffer pool and tracer shared by all clients of the event loop
      * @param socketHandle Socket handle associated with this client
      */
-    ClientHandler(RoomManager& roomManager, int socketHandle);
-    
-    /**
-     * Copy constructor
-     */
-    ClientHandler ( const ClientHandler & _clientHandler);
+    ClientHandler(ClientContext& context, int socketHandle);
     
     /**
-     * Move constructor
+     * Client handlers own their sockets and borrowed buffers, so they are never copied or moved
      */
-    ClientHandler ( const ClientHandler && _clientHandler);
+    ClientHandler ( const ClientHandler & _clientHandler) = delete;
+    ClientHandler& operator=( const ClientHandler & _clientHandler) = delete;
     
     /**
      * Destructor
@@ -54,69 +59,306 @@ public:
     ~ClientHandler();
     
     /**
-     * Process any data available in the stream
+     * Process the data available in the stream, up to the byte and message budgets of the client context
      * @return true if the connection needs to be closed
      */
     bool processStream();
     
     /**
-     * If a netplay server has registered with us, this will send them the room number
-     * if a connection is present
+     * @return true if the last processStream() stopped because its budget ran out, so received frames or
+     * data may be waiting without the socket becoming readable again
+     */
+    bool hasDeferredWork() const;
+    
+    /**
+     * Resume the delivery of the room number to the netplay server, called when the room number socket
+     * is writable
+     * @return true if the delivery is over, the room number socket is closed then
+     */
+    bool resumeRoomNumberDelivery();
+    
+    /**
+     * @return Socket used to send the room number to the netplay server, -1 if there is none
+     */
+    int getRoomNumberSocket() const;
+    
+    /**
+     * @return true if the room number has been fully sent
+     */
+    bool isRoomNumberSent() const;
+    
+    /**
+     * Send room events to this subscriber
+     * @param data Encoded room events
+     * @param length Length of the encoded room events
+     * @return false if the events could not be sent completely and the connection needs to be closed
+     */
+    bool sendRoomEvents(const char* data, uint32_t length);
+    
+    /**
+     * Encode a room event
+     * @param event Room event
+     * @param buffer Destination, must hold at least Protocol::RoomEventPush::SIZE bytes
+     * @return Number of bytes written
      */
-    void sendNetplayRoomIfConnected();
+    static uint32_t encodeRoomEvent(const RoomEvent& event, char* buffer);
 	
 private:
     
+    /**
+     * State of the frame at the start of the receive ring
+     */
+    enum FrameStatus {
+        FRAME_INCOMPLETE,
+        FRAME_COMPLETE,
+        FRAME_UNKNOWN_MESSAGE,
+        FRAME_TOO_LARGE
+    };
+    
+    /**
+     * Frame at the start of the receive ring
+     */
+    struct ReceivedFrame
+    {
+        // Frame state
+        FrameStatus status;
+        
+        // Message id, valid unless the frame is incomplete
+        uint32_t messageId;
+        
+        // Frame size including the message id, valid once the frame header is complete
+        uint32_t size;
+    };
+    
+    /**
+     * Awaiter used by the connection flow to get the next frame. The flow only suspends if the frame
+     * is incomplete, processStream() resumes it once the frame is complete or invalid.
+     */
+    struct FrameAwaiter
+    {
+        // Client the frame is received by
+        ClientHandler& client;
+        
+        // Frame at the start of the receive ring
+        ReceivedFrame received;
+        
+        bool await_ready()
+        {
+            // A complete frame also waits for the next turn once the message budget is used up
+            received = client.peekFrame();
+            return received.status != FRAME_INCOMPLETE && client.mMessageBudget > 0;
+        }
+        
+        void await_suspend(std::coroutine_handle<> waiter)
+        {
+            client.mFrameReady.suspend(waiter);
+        }
+        
+        ReceivedFrame await_resume()
+        {
+            if (received.status == FRAME_INCOMPLETE) {
+                received = client.peekFrame();
+            }
+            --client.mMessageBudget;
+            return received;
+        }
+    };
+    
+    /**
+     * Connection flow: handshake, then every request until the connection is closed
+     */
+    ConnectionTask serve();
+    
+    /**
+     * Room number delivery flow: wait for the connection to the netplay server, then send the room number
+     */
+    ConnectionTask deliverRoomNumber();
+    
+    /**
+     * Gets the frame at the start of the receive ring without consuming it
+     * @return Received frame
+     */
+    ReceivedFrame peekFrame() const;
+    
+    /**
+     * Resume the connection flow if the frame it waits for is complete and the message budget allows it
+     */
+    void resumeConnectionIfFrameReady();
+    
+    /**
+     * Wait for the next frame
+     * @return Awaiter that returns the frame
+     */
+    FrameAwaiter nextFrame();
+    
+    /**
+     * Check a received frame, logging the reason it's invalid
+     * @param received Received frame
+     * @return true if the frame is complete and can be processed
+     */
+    bool isValidFrame(const ReceivedFrame& received) const;
+    
     /**
      * Process a pending message
      * @param messageId Message id to process
+     * @param frame Complete frame of the message, including the message id
      * @return true if response was successfully sent
      */
-    bool processPendingMessage(int messageId);
+    bool processPendingMessage(uint32_t messageId, const FrameView& frame);
     
     /**
      * Handle a init session message
+     * @param frame Message frame
      * @return true if response was successfully sent
      */
-    bool handleInitSession();
+    bool handleInitSession(const FrameView& frame);
+    
+    /**
+     * Start the session, done by INIT_SESSION and the messages that combine it with a request
+     * @param netplayVersion Netplay version of the client
+     * @return true if the netplay version is supported
+     */
+    bool startSession(uint32_t netplayVersion);
     
     /**
      * Handle a register netplay server message
+     * @param frame Message frame
      * @return true if response was successfully sent
      */
-    bool handleRegisterNpServer();
+    bool handleRegisterNpServer(const FrameView& frame);
+    
+    /**
+     * Handle a combined init session and register netplay server message
+     * @param frame Message frame
+     * @return true if response was successfully sent
+     */
+    bool handleInitRegisterNpServer(const FrameView& frame);
+    
+    /**
+     * Create or update the room of this connection, and start sending the room number to the netplay server.
+     * A relayed room can't be registered again.
+     * @param netplayServerPort Port of the netplay server
+     * @return false if the connection needs to be closed
+     */
+    bool registerNpServer(uint32_t netplayServerPort);
+    
+    /**
+     * Handle a register listed netplay server message
+     * @param frame Message frame
+     * @return true if response was successfully sent
+     */
+    bool handleRegisterListedNpServer(const FrameView& frame);
+    
+    /**
+     * Handle an update room listing message
+     * @param frame Message frame
+     * @return true, there is no response
+     */
+    bool handleUpdateRoomListing(const FrameView& frame);
+    
+    /**
+     * Handle a query rooms message
+     * @param frame Message frame
+     * @return true if response was successfully sent
+     */
+    bool handleQueryRooms(const FrameView& frame);
+    
+    /**
+     * Handle a register netplay server through the relay message
+     * @param frame Message frame
+     * @return true if response was successfully sent
+     */
+    bool handleRegisterNpServerRelay(const FrameView& frame);
+    
+    /**
+     * Handle a combined init session and register netplay server through the relay message
+     * @param frame Message frame
+     * @return true if response was successfully sent
+     */
+    bool handleInitRegisterNpServerRelay(const FrameView& frame);
+    
+    /**
+     * Create a relayed room for this connection
+     * @param roomNumber Set to the room number, 0 if no relay port is available
+     * @param relayPort Set to the relay port, 0 if no relay port is available
+     * @param token Set to the host token
+     */
+    void registerNpServerRelay(uint32_t& roomNumber, uint16_t& relayPort, uint32_t& token);
+    
+    /**
+     * Handle a register netplay servers message, which creates a room for every record
+     * @param frame Message frame
+     * @return true if response was successfully sent
+     */
+    bool handleRegisterNpServers(const FrameView& frame);
+    
+    /**
+     * Handle a renew netplay servers message, which changes the port of rooms registered by this connection
+     * @param frame Message frame
+     * @return true if response was successfully sent
+     */
+    bool handleRenewNpServers(const FrameView& frame);
+    
+    /**
+     * Handle a close netplay servers message, which removes rooms registered by this connection
+     * @param frame Message frame
+     * @return false if the message is malformed and the connection needs to be closed
+     */
+    bool handleCloseNpServers(const FrameView& frame);
+    
+    /**
+     * Gets the address rooms registered by this connection are reached at
+     * @param ipAddress Set to the address of the peer
+     * @return false if the address is not available
+     */
+    bool getPeerIpAddress(std::string& ipAddress) const;
     
     /**
      * Handle a netplay server game started message
+     * @param frame Message frame
      * @return true if response was successfully sent
      */
-    bool handleNpServerGameStarted();
+    bool handleNpServerGameStarted(const FrameView& frame);
     
     /**
      * Handle a netplay client request registration message
+     * @param frame Message frame
      * @return true if response was successfully sent
      */
-    bool handleNpClientRequestRegistration();
-    
-    // Message Ids
-    enum MessageIds {
-        INIT_SESSION = 0,
-        REGISTER_NP_SERVER = 1,
-        NP_SERVER_GAME_STARTED = 2,
-        NP_CLIENT_REQUEST_REGISTRATION = 3,
-        INIT_SESSION_RESPONSE = 100,
-        REGISTER_NP_SERVER_RESPONSE = 101,
-        NP_CLIENT_REQUEST_REGISTRATION_RESPONSE = 103
-    };
+    bool handleNpClientRequestRegistration(const FrameView& frame);
     
-    // Size of message ID in all messages
-    static const int MESSAGE_ID_SIZE_BYTES = 4;
+    /**
+     * Handle a combined init session and netplay client request registration message
+     * @param frame Message frame
+     * @return true if response was successfully sent
+     */
+    bool handleInitNpClientRequestRegistration(const FrameView& frame);
+    
+    /**
+     * Handle a subscribe room message
+     * @param frame Message frame
+     * @return true if response was successfully sent
+     */
+    bool handleSubscribeRoom(const FrameView& frame);
     
-    // Netplay version
-    static const uint32_t NETPLAY_VERSION = 2;
+    // Size of the send buffer, large enough for any response. Batch responses are never larger than
+    // their request, which fits in the receive ring.
+    static const uint32_t SEND_BUFFER_SIZE = RECEIVE_BUFFER_SIZE;
     
-    // Map of message ids to size
-    static std::unordered_map<int,int> mMessageIdToSize;
+    // Buffer used for sending data, shared by all clients handled by the same thread
+    static thread_local std::array<char,SEND_BUFFER_SIZE> mSendBuffer;
+    
+    // Rooms found by a room query, shared by all clients handled by the same thread
+    static thread_local std::vector<ListedRoom> mQueryResults;
+    
+    // Resources shared by all clients of the event loop
+    ClientContext& mContext;
+    
+    // Timestamps of this connection's milestones
+    ConnectionTrace mTrace;
+    
+    // Ring used for receiving data, its storage is only borrowed from the pool while data is pending
+    RingBuffer mReceiveBuffer;
     
     // Socket handle associated with this client
     int mSocketHandle;
@@ -124,36 +366,47 @@ private:
     // Socket handle used to send the room number
     int mSocketHandleSendRoomNumber;
     
-    // Buffer used for receiving data
-    std::array<char,100> mReceiveBuffer;
-    
-    // Buffer used for sending data
-    std::array<char,100> mSendBuffer;
+    // Room number
+    uint32_t mRoomNumber;
     
-    // Buffer used for sending registration response data
-    std::array<char,8> mRegistrationResponse;
+    // UDP relay port of the room, 0 if the room isn't relayed
+    uint16_t mRelayPort;
     
-    // Current offset into the buffer for receiving data
-    int mCurrentBufferOffset;
+    // Rooms registered with REGISTER_NP_SERVERS, removed together when the connection closes
+    std::vector<uint32_t> mHostedRooms;
     
-    // The message size for the current message being processed
-    int mCurrentMessageSize;
+    // Id of this connection in the traffic capture, 0 when not capturing
+    uint32_t mCaptureConnectionId;
     
-    // Room manager
-    RoomManager& mRoomManager;
+    // Room this connection is subscribed to
+    uint32_t mSubscribedRoom;
     
-    // Room number
-    uint32_t mRoomNumber;
+    // Messages this connection can still process in the current processStream() call
+    uint32_t mMessageBudget;
     
     // True if room number has been sent
     bool mRoomNumberSent;
     
-    // Current byte offset of registration response message
-    int mRoomNumberSentBytes;
+    // True if a room has been created for this client
+    bool mHasRoom;
+    
+    // True if this connection is subscribed to mSubscribedRoom
+    bool mHasSubscription;
+    
+    // True if the last processStream() ran out of budget
+    bool mWorkDeferred;
+    
+    // Where the connection flow waits for a complete frame
+    ResumePoint mFrameReady;
+    
+    // Where the room number delivery flow waits for the room number socket to be writable
+    ResumePoint mRoomNumberSocketWritable;
+    
+    // Flows are declared last so that they are destroyed before anything they use
     
-    // Mutex for protecting client room and connection
-    std::mutex mClientRoomMutex;
+    // Connection flow
+    ConnectionTask mConnection;
     
-    // True if the session has been initialized
-    bool mHasBeenInit;
+    // Room number delivery flow, only started once a netplay server registers
+    ConnectionTask mRoomNumberDelivery;
 };
\ No newline at end of file
@@ -0,0 +1,106 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+#include "Coroutine.hpp"
+
+#include <array>
+#include <new>
+
+#include "BufferPool.hpp"
+
+namespace
+{
+    // Frame sizes of the pools, a frame is taken from the smallest pool it fits in
+    const std::array<size_t, 3> FRAME_SIZE_CLASSES = {256, 512, 1024};
+    
+    // Frames allocated at once when a pool runs out
+    const size_t FRAMES_PER_SLAB = 64;
+    
+    /**
+     * Pools of the calling thread
+     */
+    struct FramePools
+    {
+        BufferPool small{FRAME_SIZE_CLASSES[0], FRAMES_PER_SLAB};
+        BufferPool medium{FRAME_SIZE_CLASSES[1], FRAMES_PER_SLAB};
+        BufferPool large{FRAME_SIZE_CLASSES[2], FRAMES_PER_SLAB};
+        
+        // Frames that didn't fit in any pool
+        size_t heapFrames = 0;
+        
+        /**
+         * Gets the pool a frame is taken from
+         * @param size Size of the frame
+         * @return Pool, nullptr if the frame is too large for all of them
+         */
+        BufferPool* getPool(size_t size)
+        {
+            if (size <= FRAME_SIZE_CLASSES[0]) {
+                return &small;
+            }
+            if (size <= FRAME_SIZE_CLASSES[1]) {
+                return &medium;
+            }
+            if (size <= FRAME_SIZE_CLASSES[2]) {
+                return &large;
+            }
+            return nullptr;
+        }
+    };
+    
+    // Coroutines are created and destroyed by the thread that owns the connections
+    thread_local FramePools framePools;
+}
+
+void* CoroutineFramePool::allocate(size_t size)
+{
+    BufferPool* pool = framePools.getPool(size);
+    if (pool == nullptr) {
+        ++framePools.heapFrames;
+        return ::operator new(size);
+    }
+    
+    return pool->acquire();
+}
+
+void CoroutineFramePool::deallocate(void* frame, size_t size)
+{
+    BufferPool* pool = framePools.getPool(size);
+    if (pool == nullptr) {
+        --framePools.heapFrames;
+        ::operator delete(frame);
+        return;
+    }
+    
+    pool->release(static_cast<char*>(frame));
+}
+
+size_t CoroutineFramePool::getFramesInUse()
+{
+    return framePools.small.getBuffersInUse() + framePools.medium.getBuffersInUse() +
+        framePools.large.getBuffersInUse() + framePools.heapFrames;
+}
+
+size_t CoroutineFramePool::getAllocatedBytes()
+{
+    return framePools.small.getAllocatedBytes() + framePools.medium.getAllocatedBytes() +
+        framePools.large.getAllocatedBytes();
+}
@@ -0,0 +1,249 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+#pragma once
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <utility>
+
+/**
+ * Allocator for coroutine frames. Frames are taken from per size class buffer pools owned by the
+ * calling thread, so starting a connection flow doesn't go through malloc. Frames larger than the
+ * largest size class come from the heap.
+ */
+namespace CoroutineFramePool
+{
+    /**
+     * Allocate a coroutine frame
+     * @param size Size of the frame
+     * @return Frame memory
+     */
+    void* allocate(size_t size);
+    
+    /**
+     * Free a coroutine frame
+     * @param frame Frame returned by allocate()
+     * @param size Size passed to allocate()
+     */
+    void deallocate(void* frame, size_t size);
+    
+    /**
+     * @return Number of frames currently allocated by the calling thread
+     */
+    size_t getFramesInUse();
+    
+    /**
+     * @return Total number of bytes allocated by the pools of the calling thread
+     */
+    size_t getAllocatedBytes();
+}
+
+/**
+ * Coroutine that runs a connection flow. It starts running as soon as it's created and runs until its
+ * first suspension point. It is resumed directly by the event loop through the handle stored by the
+ * awaiter it's suspended on. The frame is kept once the flow ends so that its owner can check done(),
+ * and it's destroyed with the ConnectionTask.
+ */
+class ConnectionTask
+{
+public:
+    
+    struct promise_type
+    {
+        ConnectionTask get_return_object()
+        {
+            return ConnectionTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+        
+        std::suspend_always final_suspend() noexcept
+        {
+            return {};
+        }
+        
+        void return_void()
+        {
+        }
+        
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+        
+        static void* operator new(size_t size)
+        {
+            return CoroutineFramePool::allocate(size);
+        }
+        
+        static void operator delete(void* frame, size_t size)
+        {
+            CoroutineFramePool::deallocate(frame, size);
+        }
+    };
+    
+    /**
+     * Constructor, no flow
+     */
+    ConnectionTask() :
+        mHandle(nullptr)
+    {
+    }
+    
+    ConnectionTask(const ConnectionTask&) = delete;
+    ConnectionTask& operator=(const ConnectionTask&) = delete;
+    
+    ConnectionTask(ConnectionTask&& other) noexcept :
+        mHandle(std::exchange(other.mHandle, nullptr))
+    {
+    }
+    
+    ConnectionTask& operator=(ConnectionTask&& other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            mHandle = std::exchange(other.mHandle, nullptr);
+        }
+        return *this;
+    }
+    
+    /**
+     * Destructor, destroys the flow even if it's suspended
+     */
+    ~ConnectionTask()
+    {
+        reset();
+    }
+    
+    /**
+     * @return true if there is a flow and it has ended
+     */
+    bool done() const
+    {
+        return mHandle && mHandle.done();
+    }
+    
+    /**
+     * @return true if there is a flow, ended or not
+     */
+    bool valid() const
+    {
+        return static_cast<bool>(mHandle);
+    }
+    
+private:
+    
+    explicit ConnectionTask(std::coroutine_handle<promise_type> handle) :
+        mHandle(handle)
+    {
+    }
+    
+    /**
+     * Destroy the flow
+     */
+    void reset()
+    {
+        if (mHandle) {
+            mHandle.destroy();
+            mHandle = nullptr;
+        }
+    }
+    
+    // Coroutine handle, null when there is no flow
+    std::coroutine_handle<promise_type> mHandle;
+};
+
+/**
+ * Point where a flow waits for the event loop. The flow suspends until resume() is called by the
+ * event loop, unless the awaited condition already holds.
+ */
+class ResumePoint
+{
+public:
+    
+    /**
+     * Awaiter that always suspends the calling flow at a resume point
+     */
+    struct Awaiter
+    {
+        // Resume point to suspend at
+        ResumePoint& resumePoint;
+        
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+        
+        void await_suspend(std::coroutine_handle<> waiter) noexcept
+        {
+            resumePoint.suspend(waiter);
+        }
+        
+        void await_resume() const noexcept
+        {
+        }
+    };
+    
+    /**
+     * @return Awaiter that suspends the calling flow until resume() is called
+     */
+    Awaiter wait()
+    {
+        return Awaiter{*this};
+    }
+    
+    /**
+     * @return true if a flow is suspended here
+     */
+    bool isWaiting() const
+    {
+        return static_cast<bool>(mWaiter);
+    }
+    
+    /**
+     * Resume the flow suspended here, if any. The flow runs until its next suspension point or its end.
+     */
+    void resume()
+    {
+        if (mWaiter) {
+            std::exchange(mWaiter, nullptr).resume();
+        }
+    }
+    
+    /**
+     * Suspend the calling flow here
+     * @param waiter Handle of the calling flow
+     */
+    void suspend(std::coroutine_handle<> waiter)
+    {
+        mWaiter = waiter;
+    }
+    
+private:
+    
+    // Flow suspended here
+    std::coroutine_handle<> mWaiter;
+};
@@ -0,0 +1,117 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+#include "LatencyHistogram.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+void LatencyHistogram::record(uint64_t value)
+{
+    ++mCounts[getBucketIndex(value)];
+    ++mTotalCount;
+    mTotalSum += value;
+    mMax = std::max(mMax, value);
+}
+
+uint64_t LatencyHistogram::getPercentile(double percentile) const
+{
+    if (mTotalCount == 0) {
+        return 0;
+    }
+    
+    percentile = std::min(std::max(percentile, 0.0), 100.0);
+    uint64_t targetCount = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(percentile / 100.0 * mTotalCount)));
+    
+    uint64_t currentCount = 0;
+    for (int bucketIndex = 0; bucketIndex < BUCKET_COUNT; ++bucketIndex) {
+        currentCount += mCounts[bucketIndex];
+        if (currentCount >= targetCount) {
+            return std::min(getBucketUpperBound(bucketIndex), mMax);
+        }
+    }
+    
+    return mMax;
+}
+
+uint64_t LatencyHistogram::getCount() const
+{
+    return mTotalCount;
+}
+
+uint64_t LatencyHistogram::getMax() const
+{
+    return mMax;
+}
+
+double LatencyHistogram::getMean() const
+{
+    return mTotalCount == 0 ? 0.0 : static_cast<double>(mTotalSum) / mTotalCount;
+}
+
+void LatencyHistogram::add(const LatencyHistogram& other)
+{
+    for (int bucketIndex = 0; bucketIndex < BUCKET_COUNT; ++bucketIndex) {
+        mCounts[bucketIndex] += other.mCounts[bucketIndex];
+    }
+    
+    mTotalCount += other.mTotalCount;
+    mTotalSum += other.mTotalSum;
+    mMax = std::max(mMax, other.mMax);
+}
+
+void LatencyHistogram::reset()
+{
+    mCounts.fill(0);
+    mTotalCount = 0;
+    mTotalSum = 0;
+    mMax = 0;
+}
+
+int LatencyHistogram::getBucketIndex(uint64_t value)
+{
+    // Small values get one bucket each
+    if (value < SUB_BUCKET_COUNT) {
+        return static_cast<int>(value);
+    }
+    
+    // Larger values are grouped by their most significant bit, then by the next SUB_BUCKET_BITS bits
+    int mostSignificantBit = 63 - __builtin_clzll(value);
+    int shift = mostSignificantBit - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKET_COUNT + static_cast<int>((value >> shift) & (SUB_BUCKET_COUNT - 1));
+}
+
+uint64_t LatencyHistogram::getBucketUpperBound(int bucketIndex)
+{
+    if (bucketIndex < SUB_BUCKET_COUNT) {
+        return static_cast<uint64_t>(bucketIndex);
+    }
+    
+    int shift = bucketIndex / SUB_BUCKET_COUNT - 1;
+    uint64_t subBucket = bucketIndex % SUB_BUCKET_COUNT;
+    uint64_t lowerBound = (SUB_BUCKET_COUNT + subBucket) << shift;
+    return lowerBound + ((1ULL << shift) - 1);
+}
@@ -0,0 +1,116 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+/**
+ * Log-linear histogram in the style of HdrHistogram. Values are grouped by power of two and each
+ * group is split into linear sub buckets, so the relative error of any reported value is bounded
+ * by 1/SUB_BUCKET_COUNT while recording stays a couple of shifts and an increment.
+ */
+class LatencyHistogram
+{
+public:
+    
+    /**
+     * Constructor
+     */
+    LatencyHistogram();
+    
+    /**
+     * Record a value
+     * @param value Value to record
+     */
+    void record(uint64_t value);
+    
+    /**
+     * Gets the value at the given percentile
+     * @param percentile Percentile between 0 and 100
+     * @return Upper bound of the bucket containing the percentile, 0 if no values were recorded
+     */
+    uint64_t getPercentile(double percentile) const;
+    
+    /**
+     * @return Number of recorded values
+     */
+    uint64_t getCount() const;
+    
+    /**
+     * @return Largest recorded value
+     */
+    uint64_t getMax() const;
+    
+    /**
+     * @return Average of all recorded values
+     */
+    double getMean() const;
+    
+    /**
+     * Add all values recorded in another histogram
+     * @param other Histogram to add
+     */
+    void add(const LatencyHistogram& other);
+    
+    /**
+     * Remove all recorded values
+     */
+    void reset();
+	
+private:
+    
+    // Number of bits used for sub buckets
+    static const int SUB_BUCKET_BITS = 4;
+    
+    // Number of linear sub buckets in each power of two
+    static const int SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+    
+    // Total number of buckets needed to cover every 64 bit value
+    static const int BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT;
+    
+    /**
+     * Gets the bucket a value is recorded in
+     * @param value Value
+     * @return Bucket index
+     */
+    static int getBucketIndex(uint64_t value);
+    
+    /**
+     * Gets the largest value recorded in a bucket
+     * @param bucketIndex Bucket index
+     * @return Largest value of the bucket
+     */
+    static uint64_t getBucketUpperBound(int bucketIndex);
+    
+    // Count of values per bucket
+    std::array<uint64_t, BUCKET_COUNT> mCounts;
+    
+    // Number of recorded values
+    uint64_t mTotalCount;
+    
+    // Sum of all recorded values
+    uint64_t mTotalSum;
+    
+    // Largest recorded value
+    uint64_t mMax;
+};
@@ -0,0 +1,268 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+
+#include "MemoryTransport.hpp"
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+namespace
+{
+    // Range of local ports given to connecting ends
+    const uint16_t FIRST_EPHEMERAL_PORT = 32768;
+    const uint16_t LAST_EPHEMERAL_PORT = 60999;
+}
+
+MemoryTransport::MemoryTransport() :
+    mNextEphemeralPort(FIRST_EPHEMERAL_PORT)
+{
+    
+}
+
+void MemoryTransport::openConnection(int& clientHandle, int& serverHandle)
+{
+    createConnection(makeLoopbackAddress(mNextEphemeralPort), makeLoopbackAddress(SERVER_PORT), clientHandle, serverHandle);
+    mNextEphemeralPort = mNextEphemeralPort == LAST_EPHEMERAL_PORT ? FIRST_EPHEMERAL_PORT : mNextEphemeralPort + 1;
+}
+
+void MemoryTransport::listen(uint16_t port)
+{
+    mListeners[port];
+}
+
+int MemoryTransport::accept(uint16_t port)
+{
+    auto listener = mListeners.find(port);
+    if (listener == mListeners.end() || listener->second.empty()) {
+        return -1;
+    }
+    
+    int handle = listener->second.front();
+    listener->second.pop_front();
+    return handle;
+}
+
+size_t MemoryTransport::getReceivableBytes(int handle) const
+{
+    const Endpoint& endpoint = mEndpoints[handle];
+    return endpoint.received.size() - endpoint.readOffset;
+}
+
+size_t MemoryTransport::getOpenHandles() const
+{
+    return mEndpoints.size() - mFreeHandles.size();
+}
+
+ssize_t MemoryTransport::receive(int handle, const iovec* segments, int numberOfSegments)
+{
+    Endpoint* endpoint = getEndpoint(handle);
+    if (endpoint == nullptr) {
+        return -1;
+    }
+    
+    size_t available = endpoint->received.size() - endpoint->readOffset;
+    if (available == 0) {
+        if (endpoint->peer == -1) {
+            // Peer closed and everything it sent was read
+            return 0;
+        }
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+    
+    size_t receivedBytes = 0;
+    for (int segmentIndex = 0; segmentIndex < numberOfSegments && receivedBytes < available; ++segmentIndex) {
+        size_t copyBytes = std::min(segments[segmentIndex].iov_len, available - receivedBytes);
+        memcpy(segments[segmentIndex].iov_base, endpoint->received.data() + endpoint->readOffset + receivedBytes, copyBytes);
+        receivedBytes += copyBytes;
+    }
+    
+    endpoint->readOffset += receivedBytes;
+    
+    // Keep the capacity, the next message reuses it
+    if (endpoint->readOffset == endpoint->received.size()) {
+        endpoint->received.clear();
+        endpoint->readOffset = 0;
+    }
+    
+    return receivedBytes;
+}
+
+ssize_t MemoryTransport::send(int handle, const char* data, size_t length)
+{
+    Endpoint* endpoint = getEndpoint(handle);
+    if (endpoint == nullptr) {
+        return -1;
+    }
+    
+    if (endpoint->peer == -1) {
+        errno = endpoint->connectError != 0 ? endpoint->connectError : EPIPE;
+        return -1;
+    }
+    
+    Endpoint& peer = mEndpoints[endpoint->peer];
+    size_t bufferedBytes = peer.received.size() - peer.readOffset;
+    size_t sentBytes = std::min(length, MAX_BUFFERED_BYTES - bufferedBytes);
+    if (sentBytes == 0) {
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+    
+    // Drop the part that was already read before appending
+    if (peer.readOffset != 0) {
+        peer.received.erase(peer.received.begin(), peer.received.begin() + peer.readOffset);
+        peer.readOffset = 0;
+    }
+    
+    peer.received.insert(peer.received.end(), data, data + sentBytes);
+    return sentBytes;
+}
+
+int MemoryTransport::connect(const sockaddr_in6& address)
+{
+    uint16_t port = ntohs(address.sin6_port);
+    sockaddr_in6 localAddress = makeLoopbackAddress(mNextEphemeralPort);
+    mNextEphemeralPort = mNextEphemeralPort == LAST_EPHEMERAL_PORT ? FIRST_EPHEMERAL_PORT : mNextEphemeralPort + 1;
+    
+    auto listener = mListeners.find(port);
+    if (listener == mListeners.end()) {
+        // Like a nonblocking connect, the failure is reported once the handle is writable
+        int handle = allocateHandle();
+        mEndpoints[handle].connectError = ECONNREFUSED;
+        mEndpoints[handle].localAddress = localAddress;
+        return handle;
+    }
+    
+    int clientHandle = -1;
+    int serverHandle = -1;
+    createConnection(localAddress, address, clientHandle, serverHandle);
+    listener->second.push_back(serverHandle);
+    return clientHandle;
+}
+
+int MemoryTransport::getConnectError(int handle)
+{
+    Endpoint* endpoint = getEndpoint(handle);
+    if (endpoint == nullptr) {
+        return EBADF;
+    }
+    
+    return endpoint->connectError;
+}
+
+bool MemoryTransport::getPeerAddress(int handle, sockaddr_in6& address)
+{
+    Endpoint* endpoint = getEndpoint(handle);
+    if (endpoint == nullptr) {
+        return false;
+    }
+    
+    if (endpoint->connectError != 0) {
+        errno = ENOTCONN;
+        return false;
+    }
+    
+    address = endpoint->peerAddress;
+    return true;
+}
+
+bool MemoryTransport::getLocalAddress(int handle, sockaddr_in6& address)
+{
+    Endpoint* endpoint = getEndpoint(handle);
+    if (endpoint == nullptr) {
+        return false;
+    }
+    
+    address = endpoint->localAddress;
+    return true;
+}
+
+void MemoryTransport::close(int handle)
+{
+    Endpoint* endpoint = getEndpoint(handle);
+    if (endpoint == nullptr) {
+        return;
+    }
+    
+    // The peer still receives what was sent before the close, then end of stream
+    if (endpoint->peer != -1) {
+        mEndpoints[endpoint->peer].peer = -1;
+    }
+    
+    // Handles are reused, so give the buffer back
+    *endpoint = Endpoint();
+    mFreeHandles.push_back(handle);
+}
+
+int MemoryTransport::allocateHandle()
+{
+    int handle;
+    if (!mFreeHandles.empty()) {
+        handle = mFreeHandles.back();
+        mFreeHandles.pop_back();
+    } else {
+        handle = static_cast<int>(mEndpoints.size());
+        mEndpoints.emplace_back();
+    }
+    
+    mEndpoints[handle].open = true;
+    return handle;
+}
+
+void MemoryTransport::createConnection(const sockaddr_in6& clientAddress, const sockaddr_in6& serverAddress,
+    int& clientHandle, int& serverHandle)
+{
+    clientHandle = allocateHandle();
+    serverHandle = allocateHandle();
+    
+    Endpoint& client = mEndpoints[clientHandle];
+    client.peer = serverHandle;
+    client.localAddress = clientAddress;
+    client.peerAddress = serverAddress;
+    
+    Endpoint& server = mEndpoints[serverHandle];
+    server.peer = clientHandle;
+    server.localAddress = serverAddress;
+    server.peerAddress = clientAddress;
+}
+
+MemoryTransport::Endpoint* MemoryTransport::getEndpoint(int handle)
+{
+    if (handle < 0 || handle >= static_cast<int>(mEndpoints.size()) || !mEndpoints[handle].open) {
+        errno = EBADF;
+        return nullptr;
+    }
+    
+    return &mEndpoints[handle];
+}
+
+sockaddr_in6 MemoryTransport::makeLoopbackAddress(uint16_t port)
+{
+    sockaddr_in6 address = {};
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = in6addr_loopback;
+    address.sin6_port = htons(port);
+    return address;
+}
@@ -0,0 +1,172 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+#include "Transport.hpp"
+
+/**
+ * Transport made of in-process byte pipes, so the connection handlers can be driven without the kernel
+ * network stack. Both ends of every connection live in this object: a simulated client writes to its end
+ * with send() and reads the responses with receive(). Every connection is on the loopback address, and
+ * connect() only succeeds for ports that listen() was called on. Handles are indexes and are reused once
+ * closed. This class is not thread safe.
+ */
+class MemoryTransport : public Transport
+{
+public:
+    
+    // Bytes a connection end holds before sends to it fail with EWOULDBLOCK, like a socket buffer
+    static const size_t MAX_BUFFERED_BYTES = 64 * 1024;
+    
+    // Local port of the server end of connections opened with openConnection()
+    static const uint16_t SERVER_PORT = 37520;
+    
+    /**
+     * Constructor
+     */
+    MemoryTransport();
+    
+    MemoryTransport(const MemoryTransport&) = delete;
+    MemoryTransport& operator=(const MemoryTransport&) = delete;
+    
+    /**
+     * Open a connection as if a client had connected to the server and the server had accepted it
+     * @param clientHandle End used by the simulated client
+     * @param serverHandle End given to the connection handler
+     */
+    void openConnection(int& clientHandle, int& serverHandle);
+    
+    /**
+     * Let connect() succeed for a port, the connections are taken with accept()
+     * @param port Port to listen on
+     */
+    void listen(uint16_t port);
+    
+    /**
+     * Take the next connection made to a listening port
+     * @param port Listening port
+     * @return Handle of the accepted end, -1 if no connection is pending
+     */
+    int accept(uint16_t port);
+    
+    /**
+     * @param handle Connection end
+     * @return Number of bytes waiting to be received
+     */
+    size_t getReceivableBytes(int handle) const;
+    
+    /**
+     * @return Number of connection ends that are open
+     */
+    size_t getOpenHandles() const;
+    
+    ssize_t receive(int handle, const iovec* segments, int numberOfSegments) override;
+    
+    ssize_t send(int handle, const char* data, size_t length) override;
+    
+    int connect(const sockaddr_in6& address) override;
+    
+    int getConnectError(int handle) override;
+    
+    bool getPeerAddress(int handle, sockaddr_in6& address) override;
+    
+    bool getLocalAddress(int handle, sockaddr_in6& address) override;
+    
+    void close(int handle) override;
+	
+private:
+    
+    /**
+     * One end of a connection
+     */
+    struct Endpoint
+    {
+        // Data received from the peer, the unread part starts at readOffset
+        std::vector<char> received;
+        
+        // Offset of the first unread byte in received
+        size_t readOffset = 0;
+        
+        // Other end of the connection, -1 once it's closed
+        int peer = -1;
+        
+        // Result of connect(), 0 when connected
+        int connectError = 0;
+        
+        // True while the handle is in use
+        bool open = false;
+        
+        // Local address
+        sockaddr_in6 localAddress = {};
+        
+        // Address of the peer
+        sockaddr_in6 peerAddress = {};
+    };
+    
+    /**
+     * Take an unused handle
+     * @return Handle of a cleared, open endpoint
+     */
+    int allocateHandle();
+    
+    /**
+     * Create both ends of a connection
+     * @param clientAddress Address of the connecting end
+     * @param serverAddress Address of the accepting end
+     * @param clientHandle Connecting end
+     * @param serverHandle Accepting end
+     */
+    void createConnection(const sockaddr_in6& clientAddress, const sockaddr_in6& serverAddress,
+        int& clientHandle, int& serverHandle);
+    
+    /**
+     * Get an open endpoint
+     * @param handle Handle of the endpoint
+     * @return Endpoint, nullptr with errno set to EBADF if the handle isn't open
+     */
+    Endpoint* getEndpoint(int handle);
+    
+    /**
+     * Build a loopback address
+     * @param port Port of the address
+     * @return Address
+     */
+    static sockaddr_in6 makeLoopbackAddress(uint16_t port);
+    
+    // Connection ends, indexed by handle
+    std::vector<Endpoint> mEndpoints;
+    
+    // Handles of closed endpoints, reused before the endpoint list grows
+    std::vector<int> mFreeHandles;
+    
+    // Connections waiting to be accepted, by listening port
+    std::unordered_map<uint16_t, std::deque<int>> mListeners;
+    
+    // Next local port given to connecting ends
+    uint16_t mNextEphemeralPort;
+};
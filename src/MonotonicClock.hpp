@@ -0,0 +1,51 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+#pragma once
+
+#include <time.h>
+
+#include <cstdint>
+
+/**
+ * Cheap monotonic timestamps. clock_gettime(CLOCK_MONOTONIC) is served from the vDSO without a
+ * system call, so it's safe to call several times per message.
+ */
+namespace MonotonicClock
+{
+    /**
+     * @return Current monotonic time in nanoseconds
+     */
+    inline uint64_t nowNanoseconds()
+    {
+        timespec time;
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        return static_cast<uint64_t>(time.tv_sec) * 1000000000ULL + static_cast<uint64_t>(time.tv_nsec);
+    }
+    
+    /**
+     * @return Current monotonic time in microseconds
+     */
+    inline uint64_t nowMicroseconds()
+    {
+        return nowNanoseconds() / 1000ULL;
+    }
+}
@@ -0,0 +1,107 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+/**
+ * Lock-free multiple producer, single consumer queue. Any thread can push, only the thread
+ * that owns the queue can pop. Producers never wait on each other or on the consumer, a push
+ * is a single atomic exchange.
+ */
+template <typename T>
+class MpscQueue
+{
+public:
+    
+    /**
+     * Constructor
+     */
+    MpscQueue() :
+        mHead(new Node()),
+        mTail(mHead.load(std::memory_order_relaxed))
+    {
+    }
+    
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+    
+    /**
+     * Destructor, discards any item that was not popped
+     */
+    ~MpscQueue()
+    {
+        T value;
+        while (pop(value)) {
+        }
+        delete mTail;
+    }
+    
+    /**
+     * Push an item, can be called from any thread
+     * @param value Item to push
+     */
+    void push(T value)
+    {
+        Node* node = new Node();
+        node->value = std::move(value);
+        
+        Node* previous = mHead.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+    }
+    
+    /**
+     * Pop an item, must only be called from the consumer thread
+     * @param value Popped item
+     * @return true if an item was popped, false if the queue was empty
+     */
+    bool pop(T& value)
+    {
+        Node* tail = mTail;
+        Node* next = tail->next.load(std::memory_order_acquire);
+        
+        if (next == nullptr) {
+            return false;
+        }
+        
+        value = std::move(next->value);
+        mTail = next;
+        delete tail;
+        
+        return true;
+    }
+	
+private:
+    
+    struct Node
+    {
+        std::atomic<Node*> next{nullptr};
+        T value{};
+    };
+    
+    // Most recently pushed node, written by producers
+    std::atomic<Node*> mHead;
+    
+    // Stub node before the oldest item, only touched by the consumer
+    Node* mTail;
+};
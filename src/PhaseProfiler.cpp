@@ -0,0 +1,225 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "spdlog/spdlog.h"
+
+#include "MonotonicClock.hpp"
+#include "PhaseProfiler.hpp"
+
+PhaseProfiler::PhaseProfiler() :
+    mHardwareCounters(false),
+    mDepth(1),
+    mUntrackedDepth(0)
+{
+    mCounterFds.fill(-1);
+    mCounterNames.fill("");
+    mPhaseStack[0] = ProfilePhase::EVENT_LOOP;
+    
+    // Kernel time is where poll() and the syscalls of every phase spend theirs, but counting it needs
+    // perf_event_paranoid <= 1 or CAP_PERFMON, so fall back to user space only
+    const std::array<uint64_t, COUNTER_COUNT> hardwareConfigs = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES};
+    const std::array<uint64_t, COUNTER_COUNT> softwareConfigs = {PERF_COUNT_SW_TASK_CLOCK, PERF_COUNT_SW_CONTEXT_SWITCHES,
+        PERF_COUNT_SW_PAGE_FAULTS};
+    bool excludeKernel = false;
+    
+    if (openCounters(PERF_TYPE_HARDWARE, hardwareConfigs, excludeKernel) ||
+        openCounters(PERF_TYPE_HARDWARE, hardwareConfigs, excludeKernel = true)) {
+        mHardwareCounters = true;
+        mCounterNames = {"cycles", "instructions", "cache_misses"};
+    } else if (openCounters(PERF_TYPE_SOFTWARE, softwareConfigs, excludeKernel = false) ||
+        openCounters(PERF_TYPE_SOFTWARE, softwareConfigs, excludeKernel = true)) {
+        mCounterNames = {"cpu_ns", "context_switches", "page_faults"};
+    } else {
+        SPDLOG_ERROR("perf_event_open() failed, errno={}, only wall time is profiled", errno);
+    }
+    
+    if (mCounterFds[0] >= 0) {
+        SPDLOG_INFO("Phase profiling with {} counters{}", mHardwareCounters ? "hardware" : "software",
+            excludeKernel ? ", user space only" : "");
+        ioctl(mCounterFds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(mCounterFds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    
+    readSample(mLastSample);
+}
+
+PhaseProfiler::~PhaseProfiler()
+{
+    closeCounters();
+}
+
+bool PhaseProfiler::openCounters(uint32_t type, const std::array<uint64_t, COUNTER_COUNT>& configs, bool excludeKernel)
+{
+    for (int counterIndex = 0; counterIndex < COUNTER_COUNT; ++counterIndex) {
+        perf_event_attr attributes = {};
+        attributes.size = sizeof(attributes);
+        attributes.type = type;
+        attributes.config = configs[counterIndex];
+        attributes.read_format = PERF_FORMAT_GROUP;
+        attributes.exclude_kernel = excludeKernel ? 1 : 0;
+        attributes.exclude_hv = 1;
+        
+        // The group is enabled at once through its leader, so every counter covers the same time
+        attributes.disabled = counterIndex == 0 ? 1 : 0;
+        
+        // This thread on any CPU
+        int groupFd = counterIndex == 0 ? -1 : mCounterFds[0];
+        mCounterFds[counterIndex] = static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, groupFd,
+            PERF_FLAG_FD_CLOEXEC));
+        
+        if (mCounterFds[counterIndex] < 0) {
+            int openError = errno;
+            closeCounters();
+            errno = openError;
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+void PhaseProfiler::closeCounters()
+{
+    for (int& counterFd : mCounterFds) {
+        if (counterFd >= 0) {
+            close(counterFd);
+            counterFd = -1;
+        }
+    }
+}
+
+void PhaseProfiler::readSample(Sample& sample) const
+{
+    sample.nanoseconds = MonotonicClock::nowNanoseconds();
+    if (mCounterFds[0] < 0) {
+        return;
+    }
+    
+    // PERF_FORMAT_GROUP reads the number of counters followed by every value with a single syscall
+    std::array<uint64_t, COUNTER_COUNT + 1> values;
+    if (read(mCounterFds[0], values.data(), sizeof(values)) == static_cast<ssize_t>(sizeof(values))) {
+        for (int counterIndex = 0; counterIndex < COUNTER_COUNT; ++counterIndex) {
+            sample.counters[counterIndex] = values[counterIndex + 1];
+        }
+    }
+}
+
+void PhaseProfiler::chargeCurrentPhase()
+{
+    Sample sample;
+    readSample(sample);
+    
+    PhaseTotals& totals = mTotals[static_cast<int>(mPhaseStack[mDepth - 1])];
+    totals.nanoseconds += sample.nanoseconds - mLastSample.nanoseconds;
+    for (int counterIndex = 0; counterIndex < COUNTER_COUNT; ++counterIndex) {
+        totals.counters[counterIndex] += sample.counters[counterIndex] - mLastSample.counters[counterIndex];
+    }
+    
+    mLastSample = sample;
+}
+
+void PhaseProfiler::enter(ProfilePhase phase)
+{
+    if (mDepth == MAX_DEPTH) {
+        ++mUntrackedDepth;
+        return;
+    }
+    
+    chargeCurrentPhase();
+    mPhaseStack[mDepth++] = phase;
+    ++mTotals[static_cast<int>(phase)].calls;
+}
+
+void PhaseProfiler::leave()
+{
+    if (mUntrackedDepth > 0) {
+        --mUntrackedDepth;
+        return;
+    }
+    
+    // The event loop phase is never left
+    if (mDepth > 1) {
+        chargeCurrentPhase();
+        --mDepth;
+    }
+}
+
+void PhaseProfiler::dump()
+{
+    chargeCurrentPhase();
+    
+    uint64_t totalNanoseconds = 0;
+    uint64_t totalFirstCounter = 0;
+    for (const PhaseTotals& totals : mTotals) {
+        totalNanoseconds += totals.nanoseconds;
+        totalFirstCounter += totals.counters[0];
+    }
+    
+    for (int phaseIndex = 0; phaseIndex < static_cast<int>(ProfilePhase::COUNT); ++phaseIndex) {
+        const PhaseTotals& totals = mTotals[phaseIndex];
+        double wallShare = totalNanoseconds == 0 ? 0.0 : 100.0 * totals.nanoseconds / totalNanoseconds;
+        double counterShare = totalFirstCounter == 0 ? 0.0 : 100.0 * totals.counters[0] / totalFirstCounter;
+        double instructionsPerCycle = totals.counters[0] == 0 ? 0.0 :
+            static_cast<double>(totals.counters[1]) / totals.counters[0];
+        
+        if (mHardwareCounters) {
+            SPDLOG_INFO("Phase profile {}: calls={}, wall_ms={:.1f}, wall_share={:.1f}%, cycles={}, cycle_share={:.1f}%, "
+                "instructions={}, ipc={:.2f}, cache_misses={}", getPhaseName(static_cast<ProfilePhase>(phaseIndex)),
+                totals.calls, totals.nanoseconds / 1e6, wallShare, totals.counters[0], counterShare, totals.counters[1],
+                instructionsPerCycle, totals.counters[2]);
+        } else {
+            SPDLOG_INFO("Phase profile {}: calls={}, wall_ms={:.1f}, wall_share={:.1f}%, {}={}, {}_share={:.1f}%, {}={}, {}={}",
+                getPhaseName(static_cast<ProfilePhase>(phaseIndex)), totals.calls, totals.nanoseconds / 1e6, wallShare,
+                mCounterNames[0], totals.counters[0], mCounterNames[0], counterShare, mCounterNames[1], totals.counters[1],
+                mCounterNames[2], totals.counters[2]);
+        }
+    }
+    
+    mTotals = {};
+}
+
+const char* PhaseProfiler::getPhaseName(ProfilePhase phase)
+{
+    switch (phase) {
+        case ProfilePhase::EVENT_LOOP:
+            return "event_loop";
+        case ProfilePhase::POLL_WAIT:
+            return "poll_wait";
+        case ProfilePhase::ACCEPT:
+            return "accept";
+        case ProfilePhase::DECODE:
+            return "decode";
+        case ProfilePhase::HANDLER:
+            return "handler";
+        case ProfilePhase::ROOM_TABLE:
+            return "room_table";
+        default:
+            return "unknown";
+    }
+}
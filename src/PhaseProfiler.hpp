@@ -0,0 +1,219 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+/**
+ * Phases of the event loop that CPU usage is attributed to. Phases nest, a phase is only charged for what
+ * isn't spent in the phases nested in it.
+ */
+enum class ProfilePhase
+{
+    // Event loop work that isn't part of any other phase, like publishing room events and closing connections
+    EVENT_LOOP = 0,
+    // Waiting in poll(), including the kernel scanning the poll set
+    POLL_WAIT,
+    // Accepting new connections
+    ACCEPT,
+    // Receiving data and splitting it into frames in ClientHandler::processStream()
+    DECODE,
+    // Message handlers, including their sends
+    HANDLER,
+    // Room table operations of RoomManager
+    ROOM_TABLE,
+    COUNT
+};
+
+/**
+ * Reads CPU counters through perf_event_open() every time the event loop enters or leaves a phase, and sums
+ * them up per phase. Hardware counters are used when the CPU has them (cycles, instructions, cache misses),
+ * software ones otherwise (CPU time, context switches, page faults). Every phase change costs a read() of the
+ * counter group, so this is only enabled on request. Owned by the event loop thread.
+ */
+class PhaseProfiler
+{
+public:
+    
+    /**
+     * Constructor, opens the counters of the calling thread
+     */
+    PhaseProfiler();
+    
+    /**
+     * The profiler owns its counter descriptors, so it's never copied
+     */
+    PhaseProfiler(const PhaseProfiler& profiler) = delete;
+    PhaseProfiler& operator=(const PhaseProfiler& profiler) = delete;
+    
+    /**
+     * Destructor
+     */
+    ~PhaseProfiler();
+    
+    /**
+     * Start charging a phase nested in the current one
+     * @param phase Phase
+     */
+    void enter(ProfilePhase phase);
+    
+    /**
+     * Stop charging the current phase and go back to the phase it was nested in
+     */
+    void leave();
+    
+    /**
+     * Write the totals of every phase since the last dump to the log and reset them
+     */
+    void dump();
+	
+private:
+    
+    // Number of counters read together
+    static const int COUNTER_COUNT = 3;
+    
+    // Deepest nesting of phases that is tracked, deeper phases are charged to their parent
+    static const int MAX_DEPTH = 8;
+    
+    /**
+     * Counter values at one point in time
+     */
+    struct Sample
+    {
+        // Monotonic time in nanoseconds
+        uint64_t nanoseconds = 0;
+        
+        // Counter values
+        std::array<uint64_t, COUNTER_COUNT> counters = {};
+    };
+    
+    /**
+     * Totals of a phase
+     */
+    struct PhaseTotals
+    {
+        // Number of times the phase was entered
+        uint64_t calls = 0;
+        
+        // Wall time spent in the phase, in nanoseconds
+        uint64_t nanoseconds = 0;
+        
+        // Counter deltas
+        std::array<uint64_t, COUNTER_COUNT> counters = {};
+    };
+    
+    /**
+     * Open a group of counters
+     * @param type perf_event type
+     * @param configs perf_event config of every counter
+     * @param excludeKernel true to only count user space
+     * @return true if every counter was opened
+     */
+    bool openCounters(uint32_t type, const std::array<uint64_t, COUNTER_COUNT>& configs, bool excludeKernel);
+    
+    /**
+     * Close every counter
+     */
+    void closeCounters();
+    
+    /**
+     * Read the counters
+     * @param sample Set to the current values
+     */
+    void readSample(Sample& sample) const;
+    
+    /**
+     * Charge everything since the last sample to the current phase
+     */
+    void chargeCurrentPhase();
+    
+    /**
+     * @param phase Phase
+     * @return Name of the phase
+     */
+    static const char* getPhaseName(ProfilePhase phase);
+    
+    // Counter descriptors, the first one leads the group
+    std::array<int, COUNTER_COUNT> mCounterFds;
+    
+    // Names of the counters, used for logging
+    std::array<const char*, COUNTER_COUNT> mCounterNames;
+    
+    // True if the counters are hardware counters
+    bool mHardwareCounters;
+    
+    // Phases being charged, the last one is the current phase
+    std::array<ProfilePhase, MAX_DEPTH> mPhaseStack;
+    
+    // Number of phases in mPhaseStack
+    int mDepth;
+    
+    // Phases entered past MAX_DEPTH that haven't been left yet
+    int mUntrackedDepth;
+    
+    // Values at the last phase change
+    Sample mLastSample;
+    
+    // Totals of every phase since the last dump
+    std::array<PhaseTotals, static_cast<int>(ProfilePhase::COUNT)> mTotals;
+};
+
+/**
+ * Charges a phase for as long as it's in scope, does nothing without a profiler
+ */
+class ProfileScope
+{
+public:
+    
+    /**
+     * Constructor
+     * @param profiler Profiler, nullptr when profiling is disabled
+     * @param phase Phase entered until the scope ends
+     */
+    ProfileScope(PhaseProfiler* profiler, ProfilePhase phase) :
+        mProfiler(profiler)
+    {
+        if (mProfiler != nullptr) {
+            mProfiler->enter(phase);
+        }
+    }
+    
+    ProfileScope(const ProfileScope& scope) = delete;
+    ProfileScope& operator=(const ProfileScope& scope) = delete;
+    
+    /**
+     * Destructor
+     */
+    ~ProfileScope()
+    {
+        if (mProfiler != nullptr) {
+            mProfiler->leave();
+        }
+    }
+	
+private:
+    
+    // Profiler, nullptr when profiling is disabled
+    PhaseProfiler* mProfiler;
+};
@@ -0,0 +1,501 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+#pragma once
+
+#include <arpa/inet.h>
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <utility>
+
+#include "RingBuffer.hpp"
+
+/**
+ * Wire protocol. Every message layout is declared once as a Message type, encoders, decoders and the
+ * frame size table are generated from those declarations. All integers are big endian.
+ */
+namespace Protocol
+{
+    // Size of message ID in all messages
+    constexpr uint32_t MESSAGE_ID_SIZE_BYTES = 4;
+    
+    // Netplay version
+    constexpr uint32_t NETPLAY_VERSION = 2;
+    
+    // Frame size of messages framed as message id, uint32 payload length and payload
+    constexpr int VARIABLE_FRAME_SIZE = -1;
+    
+    // Frame size returned for unknown message ids
+    constexpr int UNKNOWN_FRAME_SIZE = 0;
+    
+    // Size of the header of a variable length frame
+    constexpr uint32_t VARIABLE_FRAME_HEADER_SIZE = 8;
+    
+    /**
+     * Unsigned 32 bit integer field
+     */
+    struct Uint32Field
+    {
+        using Type = uint32_t;
+        static constexpr uint32_t SIZE = sizeof(uint32_t);
+        
+        static void encode(char* buffer, Type value)
+        {
+            value = htonl(value);
+            std::memcpy(buffer, &value, SIZE);
+        }
+        
+        static Type decode(const FrameView& frame, uint32_t offset)
+        {
+            return frame.readUint32(offset);
+        }
+    };
+    
+    /**
+     * Unsigned 64 bit integer field
+     */
+    struct Uint64Field
+    {
+        using Type = uint64_t;
+        static constexpr uint32_t SIZE = sizeof(uint64_t);
+        
+        static void encode(char* buffer, Type value)
+        {
+            Uint32Field::encode(buffer, static_cast<uint32_t>(value >> 32));
+            Uint32Field::encode(buffer + Uint32Field::SIZE, static_cast<uint32_t>(value));
+        }
+        
+        static Type decode(const FrameView& frame, uint32_t offset)
+        {
+            return (static_cast<Type>(frame.readUint32(offset)) << 32) | frame.readUint32(offset + Uint32Field::SIZE);
+        }
+    };
+    
+    /**
+     * Signed 32 bit integer field
+     */
+    struct Int32Field
+    {
+        using Type = int32_t;
+        static constexpr uint32_t SIZE = sizeof(int32_t);
+        
+        static void encode(char* buffer, Type value)
+        {
+            Uint32Field::encode(buffer, static_cast<uint32_t>(value));
+        }
+        
+        static Type decode(const FrameView& frame, uint32_t offset)
+        {
+            return static_cast<Type>(frame.readUint32(offset));
+        }
+    };
+    
+    /**
+     * Fixed size, zero padded string field
+     */
+    template <uint32_t Length>
+    struct FixedStringField
+    {
+        using Type = std::array<char, Length>;
+        static constexpr uint32_t SIZE = Length;
+        
+        static void encode(char* buffer, const Type& value)
+        {
+            std::memcpy(buffer, value.data(), SIZE);
+        }
+        
+        static Type decode(const FrameView& frame, uint32_t offset)
+        {
+            Type value;
+            frame.copyTo(offset, SIZE, value.data());
+            return value;
+        }
+        
+        /**
+         * Convert a string to a field value, it's truncated so that it's always null terminated
+         * @param value String to convert
+         * @return Zero padded field value
+         */
+        static Type fromString(const std::string& value)
+        {
+            Type fieldValue{};
+            value.copy(fieldValue.data(), SIZE - 1);
+            return fieldValue;
+        }
+    };
+    
+    /**
+     * Fixed size message made of a message id followed by the given fields
+     */
+    template <uint32_t Id, typename... Fields>
+    struct Message
+    {
+        // Message id
+        static constexpr uint32_t ID = Id;
+        
+        // Size of the whole message, including the message id
+        static constexpr uint32_t SIZE = MESSAGE_ID_SIZE_BYTES + (0 + ... + Fields::SIZE);
+        
+        // Size of the frame, used by the frame decoder
+        static constexpr int FRAME_SIZE = static_cast<int>(SIZE);
+        
+        // Decoded field values
+        using Values = std::tuple<typename Fields::Type...>;
+        
+        // Buffer large enough for the whole message
+        using Buffer = std::array<char, SIZE>;
+        
+        /**
+         * Gets the offset of a field
+         * @return Offset of field Index from the start of the message
+         */
+        template <std::size_t Index>
+        static constexpr uint32_t getFieldOffset()
+        {
+            constexpr uint32_t sizes[] = {MESSAGE_ID_SIZE_BYTES, Fields::SIZE...};
+            uint32_t offset = 0;
+            for (std::size_t sizeIndex = 0; sizeIndex <= Index; ++sizeIndex) {
+                offset += sizes[sizeIndex];
+            }
+            return offset;
+        }
+        
+        /**
+         * Encode the message
+         * @param buffer Destination, must hold at least SIZE bytes
+         * @param values Value of every field
+         * @return Number of bytes written
+         */
+        static uint32_t encode(char* buffer, const typename Fields::Type&... values)
+        {
+            Uint32Field::encode(buffer, ID);
+            encodeFields(buffer, std::index_sequence_for<Fields...>(), values...);
+            return SIZE;
+        }
+        
+        /**
+         * Decode the fields of a message
+         * @param frame Complete frame, including the message id
+         * @return Value of every field
+         */
+        static Values decode(const FrameView& frame)
+        {
+            return decodeFields(frame, std::index_sequence_for<Fields...>());
+        }
+        
+    private:
+        
+        // The buffer is unused for messages without fields
+        template <std::size_t... Indexes>
+        static void encodeFields([[maybe_unused]] char* buffer, std::index_sequence<Indexes...>,
+            const typename Fields::Type&... values)
+        {
+            (Fields::encode(buffer + getFieldOffset<Indexes>(), values), ...);
+        }
+        
+        template <std::size_t... Indexes>
+        static Values decodeFields(const FrameView& frame, std::index_sequence<Indexes...>)
+        {
+            return Values(Fields::decode(frame, getFieldOffset<Indexes>())...);
+        }
+    };
+    
+    /**
+     * Variable length message made of a message id, the payload length and a list of records, every record is
+     * made of the given fields. The payload length is always a multiple of the record size.
+     */
+    template <uint32_t Id, typename... Fields>
+    struct ListMessage
+    {
+        // Message id
+        static constexpr uint32_t ID = Id;
+        
+        // Size of a record
+        static constexpr uint32_t RECORD_SIZE = (0 + ... + Fields::SIZE);
+        
+        // Size of the frame, used by the frame decoder
+        static constexpr int FRAME_SIZE = VARIABLE_FRAME_SIZE;
+        
+        // Decoded field values of a record
+        using Values = std::tuple<typename Fields::Type...>;
+        
+        /**
+         * Gets the size of a message
+         * @param recordCount Number of records
+         * @return Size of the whole message, including the message id and payload length
+         */
+        static constexpr uint32_t getSize(uint32_t recordCount)
+        {
+            return VARIABLE_FRAME_HEADER_SIZE + recordCount * RECORD_SIZE;
+        }
+        
+        /**
+         * Gets the largest number of records that fit in a frame
+         * @param maxFrameSize Largest frame size
+         * @return Number of records
+         */
+        static constexpr uint32_t getMaxRecords(uint32_t maxFrameSize)
+        {
+            return (maxFrameSize - VARIABLE_FRAME_HEADER_SIZE) / RECORD_SIZE;
+        }
+        
+        /**
+         * Gets the offset of a field in a record
+         * @return Offset of field Index from the start of the record
+         */
+        template <std::size_t Index>
+        static constexpr uint32_t getFieldOffset()
+        {
+            constexpr uint32_t sizes[] = {Fields::SIZE...};
+            uint32_t offset = 0;
+            for (std::size_t sizeIndex = 0; sizeIndex < Index; ++sizeIndex) {
+                offset += sizes[sizeIndex];
+            }
+            return offset;
+        }
+        
+        /**
+         * Gets the number of records of a frame
+         * @param frame Complete frame, including the message id
+         * @return Number of records, -1 if the payload isn't made of whole records
+         */
+        static int getRecordCount(const FrameView& frame)
+        {
+            uint32_t payloadSize = frame.size() - VARIABLE_FRAME_HEADER_SIZE;
+            return payloadSize % RECORD_SIZE == 0 ? static_cast<int>(payloadSize / RECORD_SIZE) : -1;
+        }
+        
+        /**
+         * Encode the message id and payload length, the records are encoded with encodeRecord()
+         * @param buffer Destination, must hold at least getSize(recordCount) bytes
+         * @param recordCount Number of records
+         * @return Size of the whole message
+         */
+        static uint32_t encodeHeader(char* buffer, uint32_t recordCount)
+        {
+            Uint32Field::encode(buffer, ID);
+            Uint32Field::encode(buffer + MESSAGE_ID_SIZE_BYTES, recordCount * RECORD_SIZE);
+            return getSize(recordCount);
+        }
+        
+        /**
+         * Encode a record
+         * @param buffer Start of the message, must hold at least getSize(recordIndex + 1) bytes
+         * @param recordIndex Index of the record
+         * @param values Value of every field
+         */
+        static void encodeRecord(char* buffer, uint32_t recordIndex, const typename Fields::Type&... values)
+        {
+            encodeFields(buffer + getSize(recordIndex), std::index_sequence_for<Fields...>(), values...);
+        }
+        
+        /**
+         * Decode the fields of a record
+         * @param frame Complete frame, including the message id
+         * @param recordIndex Index of the record, must be less than getRecordCount(frame)
+         * @return Value of every field
+         */
+        static Values decodeRecord(const FrameView& frame, uint32_t recordIndex)
+        {
+            return decodeFields(frame, getSize(recordIndex), std::index_sequence_for<Fields...>());
+        }
+        
+    private:
+        
+        template <std::size_t... Indexes>
+        static void encodeFields(char* buffer, std::index_sequence<Indexes...>, const typename Fields::Type&... values)
+        {
+            (Fields::encode(buffer + getFieldOffset<Indexes>(), values), ...);
+        }
+        
+        template <std::size_t... Indexes>
+        static Values decodeFields(const FrameView& frame, uint32_t recordOffset, std::index_sequence<Indexes...>)
+        {
+            return Values(Fields::decode(frame, recordOffset + getFieldOffset<Indexes>())...);
+        }
+    };
+    
+    /**
+     * List of messages that can be received, generates the frame size table
+     */
+    template <typename... Messages>
+    struct MessageList
+    {
+        /**
+         * Gets the frame size of a message
+         * @param messageId Message id
+         * @return Frame size, VARIABLE_FRAME_SIZE for variable length frames, UNKNOWN_FRAME_SIZE for unknown ids
+         */
+        static constexpr int getFrameSize(uint32_t messageId)
+        {
+            int frameSize = UNKNOWN_FRAME_SIZE;
+            static_cast<void>(((messageId == Messages::ID ? (frameSize = Messages::FRAME_SIZE, true) : false) || ...));
+            return frameSize;
+        }
+    };
+    
+    // Client to server: start a session, netplay version
+    using InitSession = Message<0, Uint32Field>;
+    
+    // Client to server: register a netplay server, port of the netplay server
+    using RegisterNpServer = Message<1, Uint32Field>;
+    
+    // Client to server: the game started, the room can be removed
+    using NpServerGameStarted = Message<2>;
+    
+    // Client to server: get the address of a room, room number
+    using NpClientRequestRegistration = Message<3, Uint32Field>;
+    
+    // Client to server: register a netplay server that is reached through the UDP relay
+    using RegisterNpServerRelay = Message<4>;
+    
+    // Client to server: push the events of a room to this connection, room number
+    using SubscribeRoom = Message<5, Uint32Field>;
+    
+    // Client to server: INIT_SESSION and REGISTER_NP_SERVER in one message, netplay version, port of the netplay server
+    using InitRegisterNpServer = Message<6, Uint32Field, Uint32Field>;
+    
+    // Client to server: INIT_SESSION and NP_CLIENT_REQUEST_REGISTRATION in one message, netplay version, room number
+    using InitNpClientRequestRegistration = Message<7, Uint32Field, Uint32Field>;
+    
+    // Client to server: INIT_SESSION and REGISTER_NP_SERVER_RELAY in one message, netplay version
+    using InitRegisterNpServerRelay = Message<8, Uint32Field>;
+    
+    // Client to server: register a netplay server for every record, port of the netplay server. The room
+    // numbers are only sent back on this connection, there is no room number socket.
+    using RegisterNpServers = ListMessage<9, Uint32Field>;
+    
+    // Client to server: change the port of rooms registered by this connection, room number, port of the netplay server
+    using RenewNpServers = ListMessage<10, Uint32Field, Uint32Field>;
+    
+    // Client to server: remove rooms registered by this connection, room number, RoomEvent::Type pushed to
+    // subscribers. There is no response.
+    using CloseNpServers = ListMessage<11, Uint32Field, Uint32Field>;
+    
+    // Client to server: register a netplay server listed in the room directory, port of the netplay server,
+    // game id, region, open slots. Answered like REGISTER_NP_SERVER.
+    using RegisterListedNpServer = Message<12, Uint32Field, Uint64Field, Uint32Field, Uint32Field>;
+    
+    // Client to server: change the directory listing of the room of this connection, game id, region, open slots.
+    // There is no response.
+    using UpdateRoomListing = Message<13, Uint64Field, Uint32Field, Uint32Field>;
+    
+    // Client to server: find listed rooms with open slots, game id, region or ANY_REGION, room number the page
+    // starts after or 0 for the first page, maximum number of rooms
+    using QueryRooms = Message<14, Uint64Field, Uint32Field, Uint32Field, Uint32Field>;
+    
+    // Region that matches every region in QUERY_ROOMS
+    constexpr uint32_t ANY_REGION = 0xFFFFFFFF;
+    
+    // Server to client: 1 if the netplay version is supported, 0 otherwise
+    using InitSessionResponse = Message<100, Uint32Field>;
+    
+    // Server to netplay server: room number
+    using RegisterNpServerResponse = Message<101, Uint32Field>;
+    
+    // Server to client: IP address of the room, port of the room or -1 if the room doesn't exist
+    using NpClientRequestRegistrationResponse = Message<103, FixedStringField<INET6_ADDRSTRLEN>, Int32Field>;
+    
+    // Server to netplay server: room number, relay UDP port or 0 if no relay is available, host token
+    using RegisterNpServerRelayResponse = Message<104, Uint32Field, Uint32Field, Uint32Field>;
+    
+    // Server to subscriber: room number, RoomEvent::Type, IP address of the room, port of the room or -1 once it's gone
+    using RoomEventPush = Message<105, Uint32Field, Uint32Field, FixedStringField<INET6_ADDRSTRLEN>, Int32Field>;
+    
+    // Server to client: the server is full and closes the connection, seconds to wait before retrying
+    using ServerBusy = Message<106, Uint32Field>;
+    
+    // Server to netplay server: 1 if the netplay version is supported, 0 otherwise, room number or 0 if the version
+    // isn't supported. The room number is also sent to the netplay server like for REGISTER_NP_SERVER.
+    using InitRegisterNpServerResponse = Message<107, Uint32Field, Uint32Field>;
+    
+    // Server to client: 1 if the netplay version is supported, 0 otherwise, IP address of the room, port of the room
+    // or -1 if the room doesn't exist or the version isn't supported
+    using InitNpClientRequestRegistrationResponse = Message<108, Uint32Field, FixedStringField<INET6_ADDRSTRLEN>, Int32Field>;
+    
+    // Server to netplay server: 1 if the netplay version is supported, 0 otherwise, then the fields of
+    // REGISTER_NP_SERVER_RELAY_RESPONSE, which are 0 if the version isn't supported
+    using InitRegisterNpServerRelayResponse = Message<109, Uint32Field, Uint32Field, Uint32Field, Uint32Field>;
+    
+    // Server to host: room number for every record of REGISTER_NP_SERVERS, in the same order, or 0 if the
+    // connection has reached its room limit
+    using RegisterNpServersResponse = ListMessage<110, Uint32Field>;
+    
+    // Server to host: 1 for every record of RENEW_NP_SERVERS that was applied, 0 if the room doesn't belong
+    // to this connection
+    using RenewNpServersResponse = ListMessage<111, Uint32Field>;
+    
+    // Server to client: a page of rooms in increasing room number order, room number, region, open slots. A page
+    // with fewer rooms than asked for is the last one.
+    using QueryRoomsResponse = ListMessage<112, Uint32Field, Uint32Field, Uint32Field>;
+    
+    // Every message a client can send
+    using InboundMessages = MessageList<InitSession, RegisterNpServer, NpServerGameStarted, NpClientRequestRegistration,
+        RegisterNpServerRelay, SubscribeRoom, InitRegisterNpServer, InitNpClientRequestRegistration, InitRegisterNpServerRelay,
+        RegisterNpServers, RenewNpServers, CloseNpServers, RegisterListedNpServer, UpdateRoomListing, QueryRooms>;
+    
+    // Size of the peer id that starts every relay datagram sent or received by the host
+    constexpr uint32_t RELAY_PEER_HEADER_SIZE = 4;
+    
+    // Peer id of relay datagrams that bind the host to its session
+    constexpr uint32_t RELAY_BIND_PEER_ID = 0;
+    
+    // Host to relay: bind the sender address as the host of the session, host token
+    using RelayBind = Message<RELAY_BIND_PEER_ID, Uint32Field>;
+    
+    // Sizes are part of the wire protocol, they must never change
+    static_assert(InitSession::SIZE == 8, "INIT_SESSION must be 8 bytes");
+    static_assert(RegisterNpServer::SIZE == 8, "REGISTER_NP_SERVER must be 8 bytes");
+    static_assert(NpServerGameStarted::SIZE == 4, "NP_SERVER_GAME_STARTED must be 4 bytes");
+    static_assert(NpClientRequestRegistration::SIZE == 8, "NP_CLIENT_REQUEST_REGISTRATION must be 8 bytes");
+    static_assert(InitSessionResponse::SIZE == 8, "INIT_SESSION_RESPONSE must be 8 bytes");
+    static_assert(RegisterNpServerResponse::SIZE == 8, "REGISTER_NP_SERVER_RESPONSE must be 8 bytes");
+    static_assert(NpClientRequestRegistrationResponse::SIZE == 54, "NP_CLIENT_REQUEST_REGISTRATION_RESPONSE must be 54 bytes");
+    static_assert(NpClientRequestRegistrationResponse::getFieldOffset<1>() == 50, "Port must follow the 46 byte address");
+    static_assert(RegisterNpServerRelayResponse::SIZE == 16, "REGISTER_NP_SERVER_RELAY_RESPONSE must be 16 bytes");
+    static_assert(RoomEventPush::SIZE == 62, "ROOM_EVENT must be 62 bytes");
+    static_assert(ServerBusy::SIZE == 8, "SERVER_BUSY must be 8 bytes, like the INIT_SESSION_RESPONSE it replaces");
+    static_assert(InitRegisterNpServer::SIZE == 12, "INIT_REGISTER_NP_SERVER must be 12 bytes");
+    static_assert(InitNpClientRequestRegistration::SIZE == 12, "INIT_NP_CLIENT_REQUEST_REGISTRATION must be 12 bytes");
+    static_assert(InitRegisterNpServerRelay::SIZE == 8, "INIT_REGISTER_NP_SERVER_RELAY must be 8 bytes");
+    static_assert(InitRegisterNpServerResponse::SIZE == 12, "INIT_REGISTER_NP_SERVER_RESPONSE must be 12 bytes");
+    static_assert(InitNpClientRequestRegistrationResponse::SIZE == 58, "INIT_NP_CLIENT_REQUEST_REGISTRATION_RESPONSE must be 58 bytes");
+    static_assert(InitNpClientRequestRegistrationResponse::SIZE - InitNpClientRequestRegistrationResponse::getFieldOffset<1>() ==
+        NpClientRequestRegistrationResponse::SIZE - NpClientRequestRegistrationResponse::getFieldOffset<0>(),
+        "Address and port are laid out like in NP_CLIENT_REQUEST_REGISTRATION_RESPONSE");
+    static_assert(InitRegisterNpServerRelayResponse::SIZE == 20, "INIT_REGISTER_NP_SERVER_RELAY_RESPONSE must be 20 bytes");
+    static_assert(RegisterNpServers::RECORD_SIZE == 4 && RenewNpServers::RECORD_SIZE == 8 && CloseNpServers::RECORD_SIZE == 8,
+        "Batch records must keep their size");
+    static_assert(RegisterNpServersResponse::RECORD_SIZE <= RegisterNpServers::RECORD_SIZE &&
+        RenewNpServersResponse::RECORD_SIZE <= RenewNpServers::RECORD_SIZE, "Batch responses are never larger than their request");
+    static_assert(InboundMessages::getFrameSize(RegisterNpServers::ID) == VARIABLE_FRAME_SIZE, "Batch messages are variable length");
+    static_assert(RegisterListedNpServer::SIZE == 24, "REGISTER_LISTED_NP_SERVER must be 24 bytes");
+    static_assert(UpdateRoomListing::SIZE == 20, "UPDATE_ROOM_LISTING must be 20 bytes");
+    static_assert(QueryRooms::SIZE == 24, "QUERY_ROOMS must be 24 bytes");
+    static_assert(QueryRoomsResponse::RECORD_SIZE == 12, "QUERY_ROOMS_RESPONSE records must be 12 bytes");
+    static_assert(RelayBind::SIZE == 8, "Relay bind datagrams must be 8 bytes");
+    static_assert(InboundMessages::getFrameSize(NpServerGameStarted::ID) == 4, "Frame size table is generated from the messages");
+    static_assert(InboundMessages::getFrameSize(InitSessionResponse::ID) == UNKNOWN_FRAME_SIZE, "Responses are never received");
+}
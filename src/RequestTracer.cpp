@@ -0,0 +1,114 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+#include "RequestTracer.hpp"
+
+#include <algorithm>
+#include <limits>
+
+#include "spdlog/spdlog.h"
+
+ConnectionTrace::ConnectionTrace() :
+    mAcceptedMicroseconds(MonotonicClock::nowMicroseconds()),
+    mMilestoneOffsets{}
+{
+}
+
+void ConnectionTrace::mark(Milestone milestone, uint64_t nowMicroseconds)
+{
+    uint64_t offset = nowMicroseconds - mAcceptedMicroseconds;
+    mMilestoneOffsets[milestone] = static_cast<uint32_t>(std::min<uint64_t>(offset, std::numeric_limits<uint32_t>::max()));
+}
+
+uint64_t ConnectionTrace::sinceAccepted(uint64_t nowMicroseconds) const
+{
+    return nowMicroseconds - mAcceptedMicroseconds;
+}
+
+uint64_t ConnectionTrace::since(Milestone milestone, uint64_t nowMicroseconds) const
+{
+    return nowMicroseconds - (mAcceptedMicroseconds + mMilestoneOffsets[milestone]);
+}
+
+RequestTracer::RequestTracer(uint64_t slowThresholdMicroseconds) :
+    mExemplars{},
+    mExemplarCount(0),
+    mSlowThresholdMicroseconds(slowThresholdMicroseconds)
+{
+}
+
+void RequestTracer::record(TracePhase phase, uint64_t durationMicroseconds, int socketHandle, uint32_t roomNumber)
+{
+    mHistograms[static_cast<int>(phase)].record(durationMicroseconds);
+    
+    // The game start phase is as long as players take to join, so it's never considered slow
+    if (durationMicroseconds >= mSlowThresholdMicroseconds && phase != TracePhase::GAME_START) {
+        Exemplar& exemplar = mExemplars[mExemplarCount % MAX_EXEMPLARS];
+        exemplar.phase = phase;
+        exemplar.durationMicroseconds = durationMicroseconds;
+        exemplar.completedMicroseconds = MonotonicClock::nowMicroseconds();
+        exemplar.socketHandle = socketHandle;
+        exemplar.roomNumber = roomNumber;
+        ++mExemplarCount;
+    }
+}
+
+void RequestTracer::dump() const
+{
+    for (int phaseIndex = 0; phaseIndex < static_cast<int>(TracePhase::COUNT); ++phaseIndex) {
+        const LatencyHistogram& histogram = mHistograms[phaseIndex];
+        SPDLOG_INFO("Trace phase {}: count={}, mean_us={:.1f}, p50_us={}, p90_us={}, p99_us={}, p999_us={}, max_us={}",
+            getPhaseName(static_cast<TracePhase>(phaseIndex)), histogram.getCount(), histogram.getMean(),
+            histogram.getPercentile(50.0), histogram.getPercentile(90.0), histogram.getPercentile(99.0),
+            histogram.getPercentile(99.9), histogram.getMax());
+    }
+    
+    uint64_t nowMicroseconds = MonotonicClock::nowMicroseconds();
+    uint64_t firstExemplar = mExemplarCount > MAX_EXEMPLARS ? mExemplarCount - MAX_EXEMPLARS : 0;
+    for (uint64_t exemplarIndex = firstExemplar; exemplarIndex < mExemplarCount; ++exemplarIndex) {
+        const Exemplar& exemplar = mExemplars[exemplarIndex % MAX_EXEMPLARS];
+        SPDLOG_INFO("Slow request: phase={}, duration_us={}, socket={}, room={}, age_ms={}",
+            getPhaseName(exemplar.phase), exemplar.durationMicroseconds, exemplar.socketHandle, exemplar.roomNumber,
+            (nowMicroseconds - exemplar.completedMicroseconds) / 1000);
+    }
+}
+
+const char* RequestTracer::getPhaseName(TracePhase phase)
+{
+    switch (phase) {
+        case TracePhase::INIT_SESSION:
+            return "init_session";
+        case TracePhase::REGISTER_NP_SERVER:
+            return "register_np_server";
+        case TracePhase::CALLBACK_CONNECT:
+            return "callback_connect";
+        case TracePhase::ROOM_NUMBER_SEND:
+            return "room_number_send";
+        case TracePhase::ROOM_NUMBER_DELIVERY:
+            return "room_number_delivery";
+        case TracePhase::GAME_START:
+            return "game_start";
+        case TracePhase::LOOKUP:
+            return "lookup";
+        default:
+            return "unknown";
+    }
+}
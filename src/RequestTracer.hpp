@@ -0,0 +1,173 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "LatencyHistogram.hpp"
+#include "MonotonicClock.hpp"
+
+/**
+ * Phases of a request that are traced, each one is the time between two milestones of a connection
+ */
+enum class TracePhase
+{
+    // Connection accepted until INIT_SESSION was processed
+    INIT_SESSION = 0,
+    // INIT_SESSION until REGISTER_NP_SERVER was processed
+    REGISTER_NP_SERVER,
+    // REGISTER_NP_SERVER until the room number socket connected to the netplay server
+    CALLBACK_CONNECT,
+    // Room number socket connected until the room number was fully sent
+    ROOM_NUMBER_SEND,
+    // REGISTER_NP_SERVER until the room number was fully sent, what a host perceives
+    ROOM_NUMBER_DELIVERY,
+    // REGISTER_NP_SERVER until NP_SERVER_GAME_STARTED
+    GAME_START,
+    // NP_CLIENT_REQUEST_REGISTRATION handled until its response was sent
+    LOOKUP,
+    COUNT
+};
+
+/**
+ * Milestone timestamps of a single connection, stored as microsecond offsets from the time the
+ * connection was accepted to keep the per connection footprint small
+ */
+class ConnectionTrace
+{
+public:
+    
+    // Milestones recorded after the connection is accepted
+    enum Milestone {
+        INIT_SESSION = 0,
+        REGISTERED,
+        CALLBACK_CONNECTED,
+        MILESTONE_COUNT
+    };
+    
+    /**
+     * Constructor, the connection is considered accepted now
+     */
+    ConnectionTrace();
+    
+    /**
+     * Record a milestone
+     * @param milestone Milestone reached
+     * @param nowMicroseconds Current monotonic time in microseconds
+     */
+    void mark(Milestone milestone, uint64_t nowMicroseconds);
+    
+    /**
+     * @param nowMicroseconds Current monotonic time in microseconds
+     * @return Microseconds since the connection was accepted
+     */
+    uint64_t sinceAccepted(uint64_t nowMicroseconds) const;
+    
+    /**
+     * @param milestone Milestone
+     * @param nowMicroseconds Current monotonic time in microseconds
+     * @return Microseconds since the milestone was reached
+     */
+    uint64_t since(Milestone milestone, uint64_t nowMicroseconds) const;
+	
+private:
+    
+    // Time the connection was accepted, in microseconds
+    uint64_t mAcceptedMicroseconds;
+    
+    // Offset of every milestone from mAcceptedMicroseconds
+    std::array<uint32_t, MILESTONE_COUNT> mMilestoneOffsets;
+};
+
+/**
+ * Collects per phase latency histograms and exemplars of slow requests. Owned by the event loop
+ * thread.
+ */
+class RequestTracer
+{
+public:
+    
+    /**
+     * Constructor
+     * @param slowThresholdMicroseconds Requests slower than this are kept as exemplars
+     */
+    RequestTracer(uint64_t slowThresholdMicroseconds);
+    
+    /**
+     * Record the duration of a phase
+     * @param phase Phase
+     * @param durationMicroseconds Duration of the phase
+     * @param socketHandle Socket of the connection, used to identify exemplars
+     * @param roomNumber Room number related to the request, 0 if none
+     */
+    void record(TracePhase phase, uint64_t durationMicroseconds, int socketHandle, uint32_t roomNumber);
+    
+    /**
+     * Write all histograms and slow request exemplars to the log
+     */
+    void dump() const;
+	
+private:
+    
+    /**
+     * A request that took longer than the slow threshold
+     */
+    struct Exemplar
+    {
+        // Phase that was slow
+        TracePhase phase;
+        
+        // Duration of the phase in microseconds
+        uint64_t durationMicroseconds;
+        
+        // Monotonic time the phase completed, in microseconds
+        uint64_t completedMicroseconds;
+        
+        // Socket of the connection
+        int socketHandle;
+        
+        // Room number related to the request
+        uint32_t roomNumber;
+    };
+    
+    // Number of slow request exemplars kept, older ones are overwritten
+    static const int MAX_EXEMPLARS = 32;
+    
+    /**
+     * @param phase Phase
+     * @return Name of the phase
+     */
+    static const char* getPhaseName(TracePhase phase);
+    
+    // Histogram of every phase
+    std::array<LatencyHistogram, static_cast<int>(TracePhase::COUNT)> mHistograms;
+    
+    // Most recent slow request exemplars
+    std::array<Exemplar, MAX_EXEMPLARS> mExemplars;
+    
+    // Total number of exemplars recorded
+    uint64_t mExemplarCount;
+    
+    // Requests slower than this are kept as exemplars
+    uint64_t mSlowThresholdMicroseconds;
+};
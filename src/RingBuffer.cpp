@@ -0,0 +1,156 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+#include "RingBuffer.hpp"
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <cstring>
+
+FrameView::FrameView(const char* first, uint32_t firstLength, const char* second, uint32_t secondLength) :
+    mFirst(first),
+    mFirstLength(firstLength),
+    mSecond(second),
+    mSecondLength(secondLength)
+{
+}
+
+uint32_t FrameView::size() const
+{
+    return mFirstLength + mSecondLength;
+}
+
+uint8_t FrameView::readUint8(uint32_t offset) const
+{
+    return static_cast<uint8_t>(offset < mFirstLength ? mFirst[offset] : mSecond[offset - mFirstLength]);
+}
+
+uint32_t FrameView::readUint32(uint32_t offset) const
+{
+    uint32_t value;
+    
+    // Single load when the integer doesn't straddle the wrap point, which is almost always the case
+    if (offset + sizeof(value) <= mFirstLength) {
+        std::memcpy(&value, mFirst + offset, sizeof(value));
+    } else {
+        copyTo(offset, sizeof(value), reinterpret_cast<char*>(&value));
+    }
+    
+    return ntohl(value);
+}
+
+void FrameView::copyTo(uint32_t offset, uint32_t length, char* destination) const
+{
+    if (offset < mFirstLength) {
+        uint32_t firstPart = std::min(length, mFirstLength - offset);
+        std::memcpy(destination, mFirst + offset, firstPart);
+        destination += firstPart;
+        length -= firstPart;
+        offset = 0;
+    } else {
+        offset -= mFirstLength;
+    }
+    
+    if (length > 0) {
+        std::memcpy(destination, mSecond + offset, length);
+    }
+}
+
+RingBuffer::RingBuffer() :
+    mStorage(nullptr),
+    mCapacity(0),
+    mReadCount(0),
+    mWriteCount(0)
+{
+}
+
+void RingBuffer::attach(char* storage, uint32_t capacity)
+{
+    mStorage = storage;
+    mCapacity = capacity;
+    mReadCount = 0;
+    mWriteCount = 0;
+}
+
+char* RingBuffer::detach()
+{
+    char* storage = mStorage;
+    mStorage = nullptr;
+    mCapacity = 0;
+    mReadCount = 0;
+    mWriteCount = 0;
+    return storage;
+}
+
+bool RingBuffer::hasStorage() const
+{
+    return mStorage != nullptr;
+}
+
+uint32_t RingBuffer::size() const
+{
+    return mWriteCount - mReadCount;
+}
+
+uint32_t RingBuffer::capacity() const
+{
+    return mCapacity;
+}
+
+int RingBuffer::getWritableSegments(iovec (&segments)[2]) const
+{
+    uint32_t freeSpace = mCapacity - size();
+    if (freeSpace == 0) {
+        return 0;
+    }
+    
+    uint32_t writePosition = mWriteCount & (mCapacity - 1);
+    uint32_t firstLength = std::min(freeSpace, mCapacity - writePosition);
+    
+    segments[0].iov_base = mStorage + writePosition;
+    segments[0].iov_len = firstLength;
+    
+    if (firstLength == freeSpace) {
+        return 1;
+    }
+    
+    segments[1].iov_base = mStorage;
+    segments[1].iov_len = freeSpace - firstLength;
+    return 2;
+}
+
+void RingBuffer::commit(uint32_t length)
+{
+    mWriteCount += length;
+}
+
+FrameView RingBuffer::peek(uint32_t length) const
+{
+    uint32_t readPosition = mReadCount & (mCapacity - 1);
+    uint32_t firstLength = std::min(length, mCapacity - readPosition);
+    return FrameView(mStorage + readPosition, firstLength, mStorage, length - firstLength);
+}
+
+void RingBuffer::consume(uint32_t length)
+{
+    mReadCount += length;
+}
@@ -0,0 +1,167 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+#pragma once
+
+#include <sys/uio.h>
+
+#include <cstdint>
+
+/**
+ * Read only view of a frame stored in a ring buffer. A frame that wraps around the end of the ring
+ * is made of two segments, nothing is copied to make it contiguous.
+ */
+class FrameView
+{
+public:
+    
+    /**
+     * Constructor
+     * @param first First segment
+     * @param firstLength Length of the first segment
+     * @param second Second segment, only used if the frame wraps around
+     * @param secondLength Length of the second segment
+     */
+    FrameView(const char* first, uint32_t firstLength, const char* second, uint32_t secondLength);
+    
+    /**
+     * @return Size of the frame in bytes
+     */
+    uint32_t size() const;
+    
+    /**
+     * Read a byte
+     * @param offset Offset into the frame
+     * @return Byte at the offset
+     */
+    uint8_t readUint8(uint32_t offset) const;
+    
+    /**
+     * Read a big endian 32 bit integer
+     * @param offset Offset into the frame
+     * @return Integer in host byte order
+     */
+    uint32_t readUint32(uint32_t offset) const;
+    
+    /**
+     * Copy part of the frame
+     * @param offset Offset into the frame
+     * @param length Number of bytes to copy
+     * @param destination Destination buffer
+     */
+    void copyTo(uint32_t offset, uint32_t length, char* destination) const;
+	
+private:
+    
+    // First segment
+    const char* mFirst;
+    
+    // Length of the first segment
+    uint32_t mFirstLength;
+    
+    // Second segment
+    const char* mSecond;
+    
+    // Length of the second segment
+    uint32_t mSecondLength;
+};
+
+/**
+ * Fixed capacity byte ring buffer. Storage is attached by the owner, so that it can be borrowed from a
+ * buffer pool only while there is data in the ring. The capacity must be a power of two.
+ */
+class RingBuffer
+{
+public:
+    
+    /**
+     * Constructor, the ring has no storage until attach() is called
+     */
+    RingBuffer();
+    
+    /**
+     * Attach storage to an empty ring
+     * @param storage Storage
+     * @param capacity Size of the storage, must be a power of two
+     */
+    void attach(char* storage, uint32_t capacity);
+    
+    /**
+     * Detach the storage, the ring must be empty
+     * @return Storage that was attached
+     */
+    char* detach();
+    
+    /**
+     * @return true if storage is attached
+     */
+    bool hasStorage() const;
+    
+    /**
+     * @return Number of bytes in the ring
+     */
+    uint32_t size() const;
+    
+    /**
+     * @return Capacity of the ring
+     */
+    uint32_t capacity() const;
+    
+    /**
+     * Gets the free space of the ring as at most two segments, suitable for readv()
+     * @param segments Filled with the free segments
+     * @return Number of segments, 0 if the ring is full
+     */
+    int getWritableSegments(iovec (&segments)[2]) const;
+    
+    /**
+     * Mark bytes written into the writable segments as part of the ring
+     * @param length Number of bytes written
+     */
+    void commit(uint32_t length);
+    
+    /**
+     * Gets a view of the oldest bytes in the ring
+     * @param length Number of bytes, must not be larger than size()
+     * @return View of the bytes
+     */
+    FrameView peek(uint32_t length) const;
+    
+    /**
+     * Remove the oldest bytes from the ring
+     * @param length Number of bytes to remove
+     */
+    void consume(uint32_t length);
+	
+private:
+    
+    // Attached storage
+    char* mStorage;
+    
+    // Capacity of the storage
+    uint32_t mCapacity;
+    
+    // Total bytes ever consumed, the read position is this masked by the capacity
+    uint32_t mReadCount;
+    
+    // Total bytes ever written, the write position is this masked by the capacity
+    uint32_t mWriteCount;
+};
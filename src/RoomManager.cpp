@@ -19,43 +19,234 @@
  * Authors: fzurita
  */
 
+#include <algorithm>
 #include <limits>
+#include <utility>
 #include "RoomManager.hpp"
 
 RoomManager::RoomManager() :
     mMt(mRandomDevice()),
-    mDistribution(std::numeric_limits<uint32_t>::min(), std::numeric_limits<uint32_t>::max())
+    // 0 is never a room number, responses use it for no room
+    mDistribution(1, std::numeric_limits<uint32_t>::max()),
+    mProfiler(nullptr)
 {
 }
 
 uint32_t RoomManager::createRoom(std::string ipAddress, int port)
 {
-    auto roomValue = std::make_pair(ipAddress, port);
+    ProfileScope profileScope(mProfiler, ProfilePhase::ROOM_TABLE);
     
     uint32_t roomNumber = mDistribution(mMt);
     
     // Find an unused roomNumber
-    while (mRoomNumbers.count(roomNumber) != 0) {
+    while (mRooms.count(roomNumber) != 0) {
         roomNumber = mDistribution(mMt);
     }
     
-    mRoomNumbers[roomNumber] = roomValue;
+    setRoomAddress(mRooms[roomNumber], std::move(ipAddress), port);
     
     return roomNumber;
 }
 
 std::pair<std::string, int> RoomManager::getRoom(uint32_t roomNumber)
 {
+    ProfileScope profileScope(mProfiler, ProfilePhase::ROOM_TABLE);
     std::pair<std::string, int> roomData = std::make_pair("", -1);
 
-    if (mRoomNumbers.count(roomNumber) != 0) {
-        roomData = mRoomNumbers[roomNumber];
+    auto roomIter = mRooms.find(roomNumber);
+    if (roomIter != mRooms.end()) {
+        roomData = std::make_pair(roomIter->second.ipAddress, roomIter->second.port);
     }
         
     return roomData;
 }
 
-void RoomManager::removeRoom(uint32_t roomNumber)
+const RoomManager::LookupResponse* RoomManager::findLookupResponse(uint32_t roomNumber)
 {
-    mRoomNumbers.erase(roomNumber);
-}
\ No newline at end of file
+    ProfileScope profileScope(mProfiler, ProfilePhase::ROOM_TABLE);
+    
+    auto roomIter = mRooms.find(roomNumber);
+    return roomIter == mRooms.end() ? nullptr : &roomIter->second.lookupResponse;
+}
+
+const RoomManager::LookupResponse& RoomManager::getMissingRoomResponse()
+{
+    static const LookupResponse missingRoomResponse = [] {
+        LookupResponse response;
+        Protocol::NpClientRequestRegistrationResponse::encode(response.data(),
+            Protocol::FixedStringField<INET6_ADDRSTRLEN>::fromString(""), -1);
+        return response;
+    }();
+    return missingRoomResponse;
+}
+
+void RoomManager::setRoomAddress(Room& room, std::string ipAddress, int port)
+{
+    Protocol::NpClientRequestRegistrationResponse::encode(room.lookupResponse.data(),
+        Protocol::FixedStringField<INET6_ADDRSTRLEN>::fromString(ipAddress), port);
+    room.ipAddress = std::move(ipAddress);
+    room.port = port;
+}
+
+void RoomManager::updateRoom(uint32_t roomNumber, std::string ipAddress, int port)
+{
+    ProfileScope profileScope(mProfiler, ProfilePhase::ROOM_TABLE);
+    auto roomIter = mRooms.find(roomNumber);
+    if (roomIter == mRooms.end() || (roomIter->second.ipAddress == ipAddress && roomIter->second.port == port)) {
+        return;
+    }
+    
+    if (mSubscribers.count(roomNumber) != 0) {
+        mPendingEvents.push_back({RoomEvent::ROOM_ADDRESS_CHANGED, roomNumber, ipAddress, port});
+    }
+    
+    setRoomAddress(roomIter->second, std::move(ipAddress), port);
+}
+
+bool RoomManager::setListing(uint32_t roomNumber, const RoomListing& listing)
+{
+    ProfileScope profileScope(mProfiler, ProfilePhase::ROOM_TABLE);
+    auto roomIter = mRooms.find(roomNumber);
+    if (roomIter == mRooms.end()) {
+        return false;
+    }
+    
+    Room& room = roomIter->second;
+    if (room.listed) {
+        unindexListing(roomNumber, room.listing);
+    }
+    
+    room.listing = listing;
+    room.listed = true;
+    indexListing(roomNumber, listing);
+    return true;
+}
+
+void RoomManager::queryRooms(uint64_t gameId, uint32_t region, uint32_t afterRoomNumber, uint32_t maxRooms,
+    std::vector<ListedRoom>& rooms)
+{
+    ProfileScope profileScope(mProfiler, ProfilePhase::ROOM_TABLE);
+    rooms.clear();
+    
+    // Both indexes end with the room number, so a page starts right after the last room of the previous one
+    // whatever was added or removed in between
+    if (region == Protocol::ANY_REGION) {
+        auto indexIter = mOpenRoomsByGame.upper_bound(std::make_pair(gameId, afterRoomNumber));
+        for (; indexIter != mOpenRoomsByGame.end() && indexIter->first.first == gameId && rooms.size() < maxRooms; ++indexIter) {
+            rooms.push_back(indexIter->second);
+        }
+    } else {
+        auto indexIter = mOpenRoomsByGameRegion.upper_bound(std::make_tuple(gameId, region, afterRoomNumber));
+        for (; indexIter != mOpenRoomsByGameRegion.end() && std::get<0>(indexIter->first) == gameId &&
+            std::get<1>(indexIter->first) == region && rooms.size() < maxRooms; ++indexIter) {
+            rooms.push_back(indexIter->second);
+        }
+    }
+}
+
+void RoomManager::indexListing(uint32_t roomNumber, const RoomListing& listing)
+{
+    if (listing.openSlots != 0) {
+        ListedRoom listedRoom{roomNumber, listing.region, listing.openSlots};
+        mOpenRoomsByGame.emplace(std::make_pair(listing.gameId, roomNumber), listedRoom);
+        mOpenRoomsByGameRegion.emplace(std::make_tuple(listing.gameId, listing.region, roomNumber), listedRoom);
+    }
+}
+
+void RoomManager::unindexListing(uint32_t roomNumber, const RoomListing& listing)
+{
+    if (listing.openSlots != 0) {
+        mOpenRoomsByGame.erase(std::make_pair(listing.gameId, roomNumber));
+        mOpenRoomsByGameRegion.erase(std::make_tuple(listing.gameId, listing.region, roomNumber));
+    }
+}
+
+void RoomManager::removeRoom(uint32_t roomNumber, RoomEvent::Type reason)
+{
+    ProfileScope profileScope(mProfiler, ProfilePhase::ROOM_TABLE);
+    eraseRoom(roomNumber, reason);
+}
+
+void RoomManager::removeRooms(const std::vector<uint32_t>& roomNumbers, RoomEvent::Type reason)
+{
+    ProfileScope profileScope(mProfiler, ProfilePhase::ROOM_TABLE);
+    for (uint32_t roomNumber : roomNumbers) {
+        eraseRoom(roomNumber, reason);
+    }
+}
+
+size_t RoomManager::getRoomCount() const
+{
+    return mRooms.size();
+}
+
+void RoomManager::eraseRoom(uint32_t roomNumber, RoomEvent::Type reason)
+{
+    auto roomIter = mRooms.find(roomNumber);
+    if (roomIter == mRooms.end()) {
+        return;
+    }
+    
+    // Subscribers still get the last known address, the port tells them the room is gone
+    if (mSubscribers.count(roomNumber) != 0) {
+        mPendingEvents.push_back({reason, roomNumber, roomIter->second.ipAddress, -1});
+    }
+    
+    if (roomIter->second.listed) {
+        unindexListing(roomNumber, roomIter->second.listing);
+    }
+    
+    mRooms.erase(roomIter);
+}
+
+void RoomManager::subscribe(uint32_t roomNumber, int subscriber)
+{
+    ProfileScope profileScope(mProfiler, ProfilePhase::ROOM_TABLE);
+    std::vector<int>& subscribers = mSubscribers[roomNumber];
+    if (std::find(subscribers.begin(), subscribers.end(), subscriber) == subscribers.end()) {
+        subscribers.push_back(subscriber);
+    }
+}
+
+void RoomManager::unsubscribe(uint32_t roomNumber, int subscriber)
+{
+    ProfileScope profileScope(mProfiler, ProfilePhase::ROOM_TABLE);
+    auto subscribersIter = mSubscribers.find(roomNumber);
+    if (subscribersIter == mSubscribers.end()) {
+        return;
+    }
+    
+    std::vector<int>& subscribers = subscribersIter->second;
+    auto subscriberIter = std::find(subscribers.begin(), subscribers.end(), subscriber);
+    if (subscriberIter != subscribers.end()) {
+        *subscriberIter = subscribers.back();
+        subscribers.pop_back();
+    }
+    
+    if (subscribers.empty()) {
+        mSubscribers.erase(subscribersIter);
+    }
+}
+
+void RoomManager::clearSubscribers(uint32_t roomNumber)
+{
+    ProfileScope profileScope(mProfiler, ProfilePhase::ROOM_TABLE);
+    mSubscribers.erase(roomNumber);
+}
+
+const std::vector<int>* RoomManager::getSubscribers(uint32_t roomNumber) const
+{
+    auto subscribersIter = mSubscribers.find(roomNumber);
+    return subscribersIter == mSubscribers.end() ? nullptr : &subscribersIter->second;
+}
+
+void RoomManager::takeEvents(std::vector<RoomEvent>& events)
+{
+    events.clear();
+    events.swap(mPendingEvents);
+}
+
+void RoomManager::setProfiler(PhaseProfiler* profiler)
+{
+    mProfiler = profiler;
+}
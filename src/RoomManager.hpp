@@ -21,14 +21,86 @@
 
 #pragma once
 
+#include <cstdint>
+#include <map>
+#include <string>
+#include <tuple>
 #include <unordered_map>
 #include <utility>
 #include <random>
+#include <vector>
+
+#include "PhaseProfiler.hpp"
+#include "Protocol.hpp"
+
+/**
+ * A change of a room that is pushed to its subscribers
+ */
+struct RoomEvent
+{
+    // Event types, sent as is on the wire
+    enum Type : uint32_t {
+        // The room exists, only sent as the reply to a subscription and never pushed. Room numbers are random and
+        // handed out by the host, so nobody can subscribe to a room before it exists.
+        ROOM_EXISTS = 0,
+        // The host registered again with a different address or port
+        ROOM_ADDRESS_CHANGED = 1,
+        // The host started the game, the room no longer exists
+        GAME_STARTED = 2,
+        // The host left without starting the game, or the room never existed
+        ROOM_REMOVED = 3
+    };
+    
+    // Event type
+    Type type;
+    
+    // Room number
+    uint32_t roomNumber;
+    
+    // Address of the room
+    std::string ipAddress;
+    
+    // Port of the room, -1 once the room no longer exists
+    int port;
+};
+
+/**
+ * Room directory listing published by a host
+ */
+struct RoomListing
+{
+    // Game id, like a hash of the ROM
+    uint64_t gameId;
+    
+    // Region of the host
+    uint32_t region;
+    
+    // Number of players that can still join, the room is only found by queries while it's not 0
+    uint32_t openSlots;
+};
+
+/**
+ * A room found in the room directory
+ */
+struct ListedRoom
+{
+    // Room number
+    uint32_t roomNumber;
+    
+    // Region of the host
+    uint32_t region;
+    
+    // Number of players that can still join
+    uint32_t openSlots;
+};
 
 class RoomManager
 {
 public:
     
+    // Serialized NP_CLIENT_REQUEST_REGISTRATION_RESPONSE of a room
+    using LookupResponse = Protocol::NpClientRequestRegistrationResponse::Buffer;
+    
     /**
      * Constructor
      */
@@ -38,7 +110,8 @@ public:
      * Creates a room using the given IP and port and returns the room number
      * @param ipAddress IP Address of room
      * @param port Port number of room
-     * @return Randomly generated room number
+     * @return Randomly generated room number, never 0 since responses such as REGISTER_NP_SERVERS_RESPONSE use
+     * 0 for no room
      */
     uint32_t createRoom(std::string ipAddress, int port);
     
@@ -49,13 +122,157 @@ public:
      */
     std::pair<std::string, int> getRoom(uint32_t roomNumber);
     
+    /**
+     * Gets the lookup response of a room, which is serialized when the room is created or its address changes
+     * so that lookups only copy it out
+     * @param roomNumber Room number
+     * @return Response, nullptr if the room is not found
+     */
+    const LookupResponse* findLookupResponse(uint32_t roomNumber);
+    
+    /**
+     * @return Lookup response of a room that doesn't exist, an empty address and port -1
+     */
+    static const LookupResponse& getMissingRoomResponse();
+    
+    /**
+     * Changes the address of an existing room
+     * @param roomNumber Room number
+     * @param ipAddress New IP address of the room
+     * @param port New port number of the room
+     */
+    void updateRoom(uint32_t roomNumber, std::string ipAddress, int port);
+    
+    /**
+     * Lists a room in the room directory, or changes its listing
+     * @param roomNumber Room number
+     * @param listing Listing of the room
+     * @return false if the room doesn't exist
+     */
+    bool setListing(uint32_t roomNumber, const RoomListing& listing);
+    
+    /**
+     * Finds listed rooms of a game with open slots, in increasing room number order. Pages are found through
+     * ordered indexes, so a query takes time in proportion to the page size, not to the number of rooms.
+     * @param gameId Game id
+     * @param region Region, Protocol::ANY_REGION for every region
+     * @param afterRoomNumber Only rooms with a larger room number are returned, 0 for the first page
+     * @param maxRooms Maximum number of rooms
+     * @param rooms Replaced with the rooms found
+     */
+    void queryRooms(uint64_t gameId, uint32_t region, uint32_t afterRoomNumber, uint32_t maxRooms,
+        std::vector<ListedRoom>& rooms);
+    
     /**
      * Removes a room using the room number
      * @param roomNumber Room number to remove
+     * @param reason Event pushed to subscribers, GAME_STARTED or ROOM_REMOVED
+     */
+    void removeRoom(uint32_t roomNumber, RoomEvent::Type reason = RoomEvent::ROOM_REMOVED);
+    
+    /**
+     * Removes several rooms in one pass, rooms that don't exist are skipped
+     * @param roomNumbers Room numbers to remove
+     * @param reason Event pushed to subscribers, GAME_STARTED or ROOM_REMOVED
      */
-    void removeRoom(uint32_t roomNumber);
+    void removeRooms(const std::vector<uint32_t>& roomNumbers, RoomEvent::Type reason = RoomEvent::ROOM_REMOVED);
+    
+    /**
+     * @return Number of rooms
+     */
+    size_t getRoomCount() const;
+    
+    /**
+     * Subscribe a connection to the events of a room
+     * @param roomNumber Room number
+     * @param subscriber Socket of the subscribing connection
+     */
+    void subscribe(uint32_t roomNumber, int subscriber);
+    
+    /**
+     * Remove a subscription, nothing happens if it doesn't exist
+     * @param roomNumber Room number
+     * @param subscriber Socket of the subscribing connection
+     */
+    void unsubscribe(uint32_t roomNumber, int subscriber);
+    
+    /**
+     * Remove every subscription of a room
+     * @param roomNumber Room number
+     */
+    void clearSubscribers(uint32_t roomNumber);
+    
+    /**
+     * Gets the subscribers of a room
+     * @param roomNumber Room number
+     * @return Sockets of the subscribers, nullptr if there are none
+     */
+    const std::vector<int>* getSubscribers(uint32_t roomNumber) const;
+    
+    /**
+     * Takes all events recorded since the last call. Only rooms with subscribers record events.
+     * @param events Replaced with the recorded events, its storage is reused for the next events
+     */
+    void takeEvents(std::vector<RoomEvent>& events);
+    
+    /**
+     * Charge room table operations to a profiler
+     * @param profiler Profiler, nullptr to stop profiling
+     */
+    void setProfiler(PhaseProfiler* profiler);
 	
 private:
+    
+    /**
+     * Address of a room and its serialized lookup response
+     */
+    struct Room
+    {
+        // IP address of the room
+        std::string ipAddress;
+        
+        // Port of the room
+        int port;
+        
+        // NP_CLIENT_REQUEST_REGISTRATION_RESPONSE for this address and port
+        LookupResponse lookupResponse;
+        
+        // Room directory listing, only valid if listed is true
+        RoomListing listing = {};
+        
+        // True if the host listed the room in the room directory
+        bool listed = false;
+    };
+    
+    /**
+     * Set the address of a room and serialize its lookup response
+     * @param room Room to update
+     * @param ipAddress IP address of the room
+     * @param port Port number of the room
+     */
+    static void setRoomAddress(Room& room, std::string ipAddress, int port);
+    
+    /**
+     * Remove a room and record the event for its subscribers
+     * @param roomNumber Room number to remove
+     * @param reason Event pushed to subscribers
+     */
+    void eraseRoom(uint32_t roomNumber, RoomEvent::Type reason);
+    
+    /**
+     * Add a listed room to the room directory indexes if it has open slots
+     * @param roomNumber Room number
+     * @param listing Listing of the room
+     */
+    void indexListing(uint32_t roomNumber, const RoomListing& listing);
+    
+    /**
+     * Remove a listed room from the room directory indexes
+     * @param roomNumber Room number
+     * @param listing Listing the room was indexed with
+     */
+    void unindexListing(uint32_t roomNumber, const RoomListing& listing);
+    
     // Random device
     std::random_device mRandomDevice;
     
@@ -65,6 +282,22 @@ private:
     // Random distribution
     std::uniform_int_distribution<uint32_t> mDistribution;
     
-    // Map of room number to Room ip and port
-    std::unordered_map<uint32_t, std::pair<std::string, int>> mRoomNumbers;
+    // Map of room number to the room
+    std::unordered_map<uint32_t, Room> mRooms;
+    
+    // Listed rooms with open slots, ordered by game id then room number. Entries hold what a query returns,
+    // so a page is read from the index alone.
+    std::map<std::pair<uint64_t, uint32_t>, ListedRoom> mOpenRoomsByGame;
+    
+    // Listed rooms with open slots, ordered by game id, region then room number
+    std::map<std::tuple<uint64_t, uint32_t, uint32_t>, ListedRoom> mOpenRoomsByGameRegion;
+    
+    // Map of room number to the sockets subscribed to it
+    std::unordered_map<uint32_t, std::vector<int>> mSubscribers;
+    
+    // Events waiting to be pushed to subscribers
+    std::vector<RoomEvent> mPendingEvents;
+    
+    // Profiler room table operations are charged to, nullptr when profiling is disabled
+    PhaseProfiler* mProfiler;
 };
\ No newline at end of file
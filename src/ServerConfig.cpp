@@ -0,0 +1,195 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+#include "ServerConfig.hpp"
+
+#include <sched.h>
+
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+#include "spdlog/spdlog.h"
+
+/**
+ * Parses an integer argument and validates its range
+ * @param name Name of the argument, used for logging
+ * @param value String value to parse
+ * @param minValue Minimum valid value
+ * @param maxValue Maximum valid value
+ * @param result Parsed value
+ * @return true if the value was valid
+ */
+static bool parseIntArgument(const std::string& name, const std::string& value, int minValue, int maxValue, int& result)
+{
+    try {
+        result = std::stoi(value);
+    } catch(const std::invalid_argument& e) {
+        std::cout << "Invalid argument exception for " << name << std::endl;
+        SPDLOG_ERROR("Invalid argument exception for {}", name);
+        return false;
+    } catch(const std::out_of_range& e) {
+        std::cout << "Out of range exception for " << name << std::endl;
+        SPDLOG_ERROR("Out of range exception for {}", name);
+        return false;
+    }
+
+    if (result < minValue || result > maxValue) {
+        std::cout << "Invalid " << name << ": " << value << ", min=" << minValue << ", max=" << maxValue << std::endl;
+        SPDLOG_ERROR("Invalid {}: {}, min={}, max={}", name, value, minValue, maxValue);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Parses all arguments
+ * @param argc Number of arguments
+ * @param argv Arguments
+ * @param config Configuration to populate
+ * @return true if all arguments were valid
+ */
+static bool parseArguments(int argc, char *argv[], ServerConfig& config)
+{
+    int argumentIndex = 1;
+
+    // The first argument is the port number, if present
+    if (argc > argumentIndex && std::string(argv[argumentIndex]).rfind("--", 0) != 0) {
+        if (!parseIntArgument("port", argv[argumentIndex], 0, std::numeric_limits<uint16_t>::max(), config.portNumber)) {
+            return false;
+        }
+        ++argumentIndex;
+    }
+
+    // The rest are options in the form of "--name value"
+    for (; argumentIndex < argc; ++argumentIndex) {
+        std::string option(argv[argumentIndex]);
+
+        if (argumentIndex + 1 >= argc) {
+            std::cout << "Missing value for option " << option << std::endl;
+            SPDLOG_ERROR("Missing value for option {}", option);
+            return false;
+        }
+
+        std::string value(argv[++argumentIndex]);
+        bool valid = true;
+
+        if (option == "--listen-backlog") {
+            valid = parseIntArgument(option, value, 0, std::numeric_limits<int>::max(), config.listenBacklog);
+        } else if (option == "--accept-batch") {
+            valid = parseIntArgument(option, value, 1, std::numeric_limits<int>::max(), config.maxAcceptsPerWakeup);
+        } else if (option == "--byte-budget") {
+            valid = parseIntArgument(option, value, 1, std::numeric_limits<int>::max(), config.maxBytesPerWakeup);
+        } else if (option == "--message-budget") {
+            valid = parseIntArgument(option, value, 1, std::numeric_limits<int>::max(), config.maxMessagesPerWakeup);
+        } else if (option == "--max-connections") {
+            valid = parseIntArgument(option, value, 0, std::numeric_limits<int>::max(), config.maxConnections);
+        } else if (option == "--max-rooms-per-connection") {
+            valid = parseIntArgument(option, value, 0, std::numeric_limits<int>::max(), config.maxRoomsPerConnection);
+        } else if (option == "--defer-accept") {
+            valid = parseIntArgument(option, value, 0, 3600, config.deferAcceptSeconds);
+        } else if (option == "--spin-us") {
+            valid = parseIntArgument(option, value, 0, 1000000, config.spinMicroseconds);
+        } else if (option == "--busy-poll-us") {
+            valid = parseIntArgument(option, value, 0, 1000000, config.busyPollMicroseconds);
+        } else if (option == "--pin-cpu") {
+            valid = parseIntArgument(option, value, -1, CPU_SETSIZE - 1, config.pinnedCpu);
+        } else if (option == "--profile-phases") {
+            int profilePhases = 0;
+            valid = parseIntArgument(option, value, 0, 1, profilePhases);
+            config.profilePhases = profilePhases != 0;
+        } else if (option == "--stall-threshold-ms") {
+            valid = parseIntArgument(option, value, 0, 3600000, config.stallThresholdMilliseconds);
+        } else if (option == "--stats-interval") {
+            valid = parseIntArgument(option, value, 1, std::numeric_limits<int>::max(), config.statsIntervalSeconds);
+        } else if (option == "--trace-slow-ms") {
+            valid = parseIntArgument(option, value, 0, std::numeric_limits<int>::max(), config.traceSlowMilliseconds);
+        } else if (option == "--capture-file") {
+            config.captureFile = value;
+        } else if (option == "--capture-max-mb") {
+            valid = parseIntArgument(option, value, 1, std::numeric_limits<int>::max(), config.captureMaxMegabytes);
+        } else if (option == "--relay-ports") {
+            valid = parseIntArgument(option, value, 0, std::numeric_limits<uint16_t>::max(), config.relayFirstPort);
+        } else if (option == "--relay-port-count") {
+            valid = parseIntArgument(option, value, 1, std::numeric_limits<uint16_t>::max(), config.relayPortCount);
+        } else if (option == "--relay-address") {
+            config.relayAddress = value;
+        } else {
+            std::cout << "Unknown option " << option << std::endl;
+            SPDLOG_ERROR("Unknown option {}", option);
+            valid = false;
+        }
+
+        if (!valid) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Prints the command line usage
+ * @param programName Name of the executable
+ */
+static void printUsage(const char* programName)
+{
+    std::cout << "Usage: " << programName << " [port] [options]" << std::endl
+        << "  --listen-backlog n         Listen backlog, 0 uses somaxconn (default 0)" << std::endl
+        << "  --accept-batch n           Maximum connections accepted per wakeup (default 64)" << std::endl
+        << "  --byte-budget n            Maximum bytes received from a connection per event loop turn (default 4096)" << std::endl
+        << "  --message-budget n         Maximum messages processed for a connection per event loop turn (default 16)" << std::endl
+        << "  --max-connections n        Maximum open connections, 0 derives it from the descriptor limit (default 0)" << std::endl
+        << "  --max-rooms-per-connection n  Maximum rooms a host registers with REGISTER_NP_SERVERS (default 256)" << std::endl
+        << "  --defer-accept seconds     Enable TCP_DEFER_ACCEPT with the given timeout (default 0, off)" << std::endl
+        << "  --spin-us us               Keep polling without blocking for this long after an event (default 0, off)" << std::endl
+        << "  --busy-poll-us us          SO_BUSY_POLL value of client sockets (default 0, off)" << std::endl
+        << "  --pin-cpu n                Pin the event loop thread to a CPU (default -1, off)" << std::endl
+        << "  --profile-phases 0|1       Log CPU counters of every event loop phase (default 0, off)" << std::endl
+        << "  --stall-threshold-ms ms    Log event loop iterations slower than this, 0 disables (default 100)" << std::endl
+        << "  --stats-interval seconds   Interval between statistics log entries (default 60)" << std::endl
+        << "  --trace-slow-ms ms         Keep traced requests slower than this as exemplars (default 1000)" << std::endl
+        << "  --capture-file path        Record inbound traffic to a capture file for np-replay, disk writes block the event loop" << std::endl
+        << "  --capture-max-mb n         Stop capturing once the capture file reaches this size (default 1024)" << std::endl
+        << "  --relay-ports first        First UDP port of the relay, enables relaying (default 0, off)" << std::endl
+        << "  --relay-port-count n       Number of UDP relay ports, one per relayed room (default 100)" << std::endl
+        << "  --relay-address address    Relay address given to joiners (default: address the host connected to)" << std::endl;
+}
+
+bool parseServerConfig(int argc, char *argv[], ServerConfig& config)
+{
+    if (!parseArguments(argc, argv, config)) {
+        printUsage(argv[0]);
+        return false;
+    }
+
+    if (config.relayFirstPort != 0 && config.relayFirstPort + config.relayPortCount - 1 > std::numeric_limits<uint16_t>::max()) {
+        std::cout << "Relay ports " << config.relayFirstPort << "+" << config.relayPortCount << " are out of range" << std::endl;
+        SPDLOG_ERROR("Relay ports {}+{} are out of range", config.relayFirstPort, config.relayPortCount);
+        printUsage(argv[0]);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,102 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+#pragma once
+
+#include <string>
+
+/**
+ * Server configuration, populated from the command line
+ */
+struct ServerConfig
+{
+    // Port number used to listen in
+    int portNumber = 37520;
+
+    // Requested listen backlog, 0 means use the system maximum (somaxconn)
+    int listenBacklog = 0;
+
+    // Maximum number of connections accepted per wakeup of the listening socket
+    int maxAcceptsPerWakeup = 64;
+
+    // Maximum number of bytes received from a connection per event loop iteration
+    int maxBytesPerWakeup = 4096;
+
+    // Maximum number of messages processed for a connection per event loop iteration
+    int maxMessagesPerWakeup = 16;
+
+    // Maximum number of open connections, 0 derives it from the file descriptor limit. Connections over the
+    // limit are sent SERVER_BUSY and closed.
+    int maxConnections = 0;
+
+    // Maximum number of rooms a host connection can register with REGISTER_NP_SERVERS
+    int maxRoomsPerConnection = 256;
+
+    // If non-zero, TCP_DEFER_ACCEPT timeout in seconds. The server will only be woken up for
+    // a new connection once the client has sent data (INIT_SESSION)
+    int deferAcceptSeconds = 0;
+
+    // If non-zero, the event loop keeps polling without blocking for this long after the last event, in microseconds
+    int spinMicroseconds = 0;
+
+    // If non-zero, SO_BUSY_POLL value of client sockets, in microseconds
+    int busyPollMicroseconds = 0;
+
+    // CPU the event loop thread is pinned to, -1 leaves it to the scheduler
+    int pinnedCpu = -1;
+
+    // If true, CPU counters of every event loop phase are written to the log with the statistics
+    bool profilePhases = false;
+
+    // Event loop iterations running longer than this are logged as stalls by the watchdog thread, in
+    // milliseconds. 0 disables the watchdog.
+    int stallThresholdMilliseconds = 100;
+
+    // How often statistics are written to the log, in seconds
+    int statsIntervalSeconds = 60;
+
+    // Traced requests slower than this are kept as slow request exemplars, in milliseconds
+    int traceSlowMilliseconds = 1000;
+
+    // If not empty, inbound traffic is recorded to this capture file
+    std::string captureFile;
+
+    // Maximum size of the capture file in megabytes, capturing stops once it's reached
+    int captureMaxMegabytes = 1024;
+
+    // First UDP port of the relay, 0 disables relaying
+    int relayFirstPort = 0;
+
+    // Number of UDP relay ports, which is the maximum number of relayed rooms
+    int relayPortCount = 100;
+
+    // Address of the relay handed out to joiners, empty to use the address the host connected to
+    std::string relayAddress;
+};
+
+/**
+ * Parses the command line into a server configuration
+ * @param argc Number of arguments
+ * @param argv Arguments
+ * @param config Configuration to populate
+ * @return true if the command line was valid
+ */
+bool parseServerConfig(int argc, char *argv[], ServerConfig& config);
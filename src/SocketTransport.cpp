@@ -0,0 +1,87 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+
+#include "SocketTransport.hpp"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+ssize_t SocketTransport::receive(int handle, const iovec* segments, int numberOfSegments)
+{
+    return readv(handle, segments, numberOfSegments);
+}
+
+ssize_t SocketTransport::send(int handle, const char* data, size_t length)
+{
+    return ::send(handle, data, length, 0);
+}
+
+int SocketTransport::connect(const sockaddr_in6& address)
+{
+    int handle = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (handle < 0) {
+        return -1;
+    }
+    
+    if (::connect(handle, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0 &&
+        errno != EWOULDBLOCK && errno != EINPROGRESS) {
+        int connectError = errno;
+        ::close(handle);
+        errno = connectError;
+        return -1;
+    }
+    
+    return handle;
+}
+
+int SocketTransport::getConnectError(int handle)
+{
+    // Only a connected socket has a peer, SO_ERROR holds the reason otherwise
+    sockaddr_in6 address;
+    if (getPeerAddress(handle, address)) {
+        return 0;
+    }
+    
+    int socketError = 0;
+    socklen_t socketErrorLength = sizeof(socketError);
+    getsockopt(handle, SOL_SOCKET, SO_ERROR, &socketError, &socketErrorLength);
+    return socketError != 0 ? socketError : ENOTCONN;
+}
+
+bool SocketTransport::getPeerAddress(int handle, sockaddr_in6& address)
+{
+    socklen_t length = sizeof(address);
+    return getpeername(handle, reinterpret_cast<sockaddr*>(&address), &length) == 0;
+}
+
+bool SocketTransport::getLocalAddress(int handle, sockaddr_in6& address)
+{
+    socklen_t length = sizeof(address);
+    return getsockname(handle, reinterpret_cast<sockaddr*>(&address), &length) == 0;
+}
+
+void SocketTransport::close(int handle)
+{
+    ::close(handle);
+}
@@ -0,0 +1,47 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+
+#pragma once
+
+#include "Transport.hpp"
+
+/**
+ * Transport over kernel sockets, handles are file descriptors
+ */
+class SocketTransport : public Transport
+{
+public:
+    
+    ssize_t receive(int handle, const iovec* segments, int numberOfSegments) override;
+    
+    ssize_t send(int handle, const char* data, size_t length) override;
+    
+    int connect(const sockaddr_in6& address) override;
+    
+    int getConnectError(int handle) override;
+    
+    bool getPeerAddress(int handle, sockaddr_in6& address) override;
+    
+    bool getLocalAddress(int handle, sockaddr_in6& address) override;
+    
+    void close(int handle) override;
+};
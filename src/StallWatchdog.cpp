@@ -0,0 +1,186 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+
+#include "StallWatchdog.hpp"
+
+#include <algorithm>
+#include <string>
+
+#include "spdlog/spdlog.h"
+
+StallWatchdog::StallWatchdog(uint32_t thresholdMilliseconds) :
+    mThresholdMicroseconds(static_cast<uint64_t>(thresholdMilliseconds) * 1000),
+    mSampleInterval(std::clamp<uint32_t>(thresholdMilliseconds / 4, 1, MAX_SAMPLE_INTERVAL_MILLISECONDS)),
+    mIterationStartMicroseconds(0),
+    mPhase(static_cast<uint32_t>(LoopPhase::POLL_WAIT)),
+    mFd(-1),
+    mStalledSamples{},
+    mLongestStallPhase(LoopPhase::POLL_WAIT),
+    mLongestStallFd(-1),
+    mCurrentStallPhase(LoopPhase::POLL_WAIT),
+    mCurrentStallFd(-1),
+    mStopRequested(false)
+{
+}
+
+StallWatchdog::~StallWatchdog()
+{
+    stop();
+}
+
+void StallWatchdog::start()
+{
+    if (mThresholdMicroseconds == 0 || mThread.joinable()) {
+        return;
+    }
+    
+    mStopRequested = false;
+    mThread = std::thread(&StallWatchdog::run, this);
+    SPDLOG_INFO("Stall watchdog started, threshold {} ms, sampled every {} ms", mThresholdMicroseconds / 1000,
+        mSampleInterval.count());
+}
+
+void StallWatchdog::stop()
+{
+    if (!mThread.joinable()) {
+        return;
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(mStopMutex);
+        mStopRequested = true;
+    }
+    mStopCondition.notify_one();
+    
+    mThread.join();
+}
+
+void StallWatchdog::run()
+{
+    // Start time of the iteration that is stalled, 0 if the event loop isn't stalled
+    uint64_t stalledIterationStart = 0;
+    
+    // How long the stalled iteration has been seen running
+    uint64_t stalledMicroseconds = 0;
+    
+    std::unique_lock<std::mutex> lock(mStopMutex);
+    while (!mStopCondition.wait_for(lock, mSampleInterval, [this] { return mStopRequested; })) {
+        // The phase is read first, the start time is then at least as recent as the phase. If the event loop moves
+        // on in between, the start time belongs to an iteration that only just started and nothing is reported.
+        uint64_t nowMicroseconds = MonotonicClock::nowMicroseconds();
+        LoopPhase phase = static_cast<LoopPhase>(mPhase.load(std::memory_order_acquire));
+        int fd = mFd.load(std::memory_order_relaxed);
+        uint64_t iterationStart = mIterationStartMicroseconds.load(std::memory_order_relaxed);
+        
+        bool running = phase != LoopPhase::POLL_WAIT && nowMicroseconds > iterationStart;
+        uint64_t runningMicroseconds = running ? nowMicroseconds - iterationStart : 0;
+        
+        // A stall ends once the event loop goes back to poll() or starts another iteration
+        if (stalledIterationStart != 0 && (!running || iterationStart != stalledIterationStart)) {
+            finishStall(stalledMicroseconds);
+            stalledIterationStart = 0;
+        }
+        
+        if (!running || runningMicroseconds < mThresholdMicroseconds) {
+            continue;
+        }
+        
+        // Logged as soon as the threshold is crossed, so a loop that never comes back is still reported
+        if (stalledIterationStart == 0) {
+            stalledIterationStart = iterationStart;
+            mCurrentStallPhase = phase;
+            mCurrentStallFd = fd;
+            SPDLOG_WARN("Event loop stalled for {} ms in phase {} on fd {}", runningMicroseconds / 1000,
+                getPhaseName(phase), fd);
+        }
+        stalledMicroseconds = runningMicroseconds;
+        
+        std::lock_guard<std::mutex> statisticsLock(mStatisticsMutex);
+        ++mStalledSamples[static_cast<size_t>(phase)];
+    }
+    
+    if (stalledIterationStart != 0) {
+        finishStall(stalledMicroseconds);
+    }
+}
+
+void StallWatchdog::finishStall(uint64_t durationMicroseconds)
+{
+    SPDLOG_WARN("Event loop stall ended after at least {} ms, it started in phase {} on fd {}", durationMicroseconds / 1000,
+        getPhaseName(mCurrentStallPhase), mCurrentStallFd);
+    
+    std::lock_guard<std::mutex> lock(mStatisticsMutex);
+    if (durationMicroseconds >= mStallDurations.getMax()) {
+        mLongestStallPhase = mCurrentStallPhase;
+        mLongestStallFd = mCurrentStallFd;
+    }
+    mStallDurations.record(durationMicroseconds);
+}
+
+void StallWatchdog::logStatistics()
+{
+    if (mThresholdMicroseconds == 0) {
+        return;
+    }
+    
+    std::lock_guard<std::mutex> lock(mStatisticsMutex);
+    
+    // Only phases that were seen stalled are listed
+    std::string stalledTime;
+    for (size_t phaseIndex = 0; phaseIndex < mStalledSamples.size(); ++phaseIndex) {
+        if (mStalledSamples[phaseIndex] != 0) {
+            stalledTime += fmt::format(" {}={}", getPhaseName(static_cast<LoopPhase>(phaseIndex)),
+                mStalledSamples[phaseIndex] * mSampleInterval.count());
+        }
+    }
+    
+    SPDLOG_INFO("Event loop stalls: count={}, p50_ms={}, p99_ms={}, max_ms={}, longest_phase={}, longest_fd={}, "
+        "stalled_ms_by_phase:{}", mStallDurations.getCount(), mStallDurations.getPercentile(50.0) / 1000,
+        mStallDurations.getPercentile(99.0) / 1000, mStallDurations.getMax() / 1000, getPhaseName(mLongestStallPhase),
+        mLongestStallFd, stalledTime.empty() ? " none" : stalledTime);
+}
+
+const char* StallWatchdog::getPhaseName(LoopPhase phase)
+{
+    switch (phase) {
+        case LoopPhase::POLL_WAIT:
+            return "poll_wait";
+        case LoopPhase::STATISTICS:
+            return "statistics";
+        case LoopPhase::ACCEPT:
+            return "accept";
+        case LoopPhase::WAKEUP:
+            return "wakeup";
+        case LoopPhase::ROOM_NUMBER_SOCKET:
+            return "room_number_socket";
+        case LoopPhase::CLIENT:
+            return "client";
+        case LoopPhase::READY_QUEUE:
+            return "ready_queue";
+        case LoopPhase::ROOM_EVENTS:
+            return "room_events";
+        case LoopPhase::COMPACTION:
+            return "compaction";
+        default:
+            return "unknown";
+    }
+}
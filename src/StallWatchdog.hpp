@@ -0,0 +1,193 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#include "LatencyHistogram.hpp"
+#include "MonotonicClock.hpp"
+
+/**
+ * Sections of an event loop iteration, a stall is attributed to the section that was running
+ */
+enum class LoopPhase : uint32_t
+{
+    // Waiting in poll(), the loop is idle and can't stall
+    POLL_WAIT = 0,
+    // Writing statistics, trace histograms and profiles to the log
+    STATISTICS,
+    // Accepting new connections
+    ACCEPT,
+    // Handling stop and trace dump requests from other threads
+    WAKEUP,
+    // Sending a room number through a room number socket
+    ROOM_NUMBER_SOCKET,
+    // Receiving and handling the requests of a connection
+    CLIENT,
+    // Giving connections that used up their budget another turn
+    READY_QUEUE,
+    // Pushing room events to subscribers
+    ROOM_EVENTS,
+    // Compacting the poll set after connections closed
+    COMPACTION,
+    COUNT
+};
+
+/**
+ * Watches the event loop from its own thread and reports iterations that take longer than a threshold, with
+ * the phase and descriptor that were running. The event loop publishes a heartbeat with atomic stores,
+ * the start time of every iteration plus its current phase and descriptor, so watching costs the loop a clock
+ * read per iteration and a couple of plain stores per phase. The watchdog thread samples the heartbeat every
+ * few milliseconds, stall durations are only as precise as that.
+ */
+class StallWatchdog
+{
+public:
+    
+    /**
+     * Constructor
+     * @param thresholdMilliseconds Iterations running longer than this are stalls, 0 disables the watchdog
+     */
+    explicit StallWatchdog(uint32_t thresholdMilliseconds);
+    
+    /**
+     * The watchdog owns its thread, so it's never copied
+     */
+    StallWatchdog(const StallWatchdog& watchdog) = delete;
+    StallWatchdog& operator=(const StallWatchdog& watchdog) = delete;
+    
+    /**
+     * Destructor, stops the watchdog thread
+     */
+    ~StallWatchdog();
+    
+    /**
+     * Start the watchdog thread, nothing happens if the watchdog is disabled
+     */
+    void start();
+    
+    /**
+     * Stop the watchdog thread
+     */
+    void stop();
+    
+    /**
+     * Called by the event loop when poll() returns and an iteration starts
+     */
+    void beginIteration()
+    {
+        mIterationStartMicroseconds.store(MonotonicClock::nowMicroseconds(), std::memory_order_relaxed);
+    }
+    
+    /**
+     * Called by the event loop when it moves to another phase
+     * @param phase Phase being entered
+     * @param fd Descriptor the phase works on, -1 if there is none
+     */
+    void setPhase(LoopPhase phase, int fd = -1)
+    {
+        // Release, so that a watchdog that sees the phase also sees the iteration start and descriptor before it.
+        // It's a plain store on x86.
+        mFd.store(fd, std::memory_order_relaxed);
+        mPhase.store(static_cast<uint32_t>(phase), std::memory_order_release);
+    }
+    
+    /**
+     * Write the stall statistics to the log, can be called from any thread
+     */
+    void logStatistics();
+    
+    /**
+     * Gets the name of a phase
+     * @param phase Phase
+     * @return Name used in the log
+     */
+    static const char* getPhaseName(LoopPhase phase);
+	
+private:
+    
+    // Longest time between two samples of the heartbeat, in milliseconds
+    static const uint32_t MAX_SAMPLE_INTERVAL_MILLISECONDS = 10;
+    
+    /**
+     * Watchdog thread main loop
+     */
+    void run();
+    
+    /**
+     * Record a stall once the event loop moved on
+     * @param durationMicroseconds Longest time the stalled iteration was seen running
+     */
+    void finishStall(uint64_t durationMicroseconds);
+    
+    // Iterations running longer than this are stalls, in microseconds
+    const uint64_t mThresholdMicroseconds;
+    
+    // Time between two samples of the heartbeat
+    const std::chrono::milliseconds mSampleInterval;
+    
+    // Heartbeat: start time of the current event loop iteration, in microseconds
+    std::atomic<uint64_t> mIterationStartMicroseconds;
+    
+    // Heartbeat: LoopPhase the event loop is in
+    std::atomic<uint32_t> mPhase;
+    
+    // Heartbeat: descriptor the current phase works on, -1 if there is none
+    std::atomic<int> mFd;
+    
+    // Protects the statistics, which are written by the watchdog thread and logged by the event loop
+    std::mutex mStatisticsMutex;
+    
+    // Duration of every finished stall, in microseconds
+    LatencyHistogram mStallDurations;
+    
+    // Samples taken while the event loop was stalled, per phase. Multiplied by the sample interval, it's
+    // roughly where stalled time went.
+    std::array<uint64_t, static_cast<size_t>(LoopPhase::COUNT)> mStalledSamples;
+    
+    // Phase that was running when the longest stall crossed the threshold
+    LoopPhase mLongestStallPhase;
+    
+    // Descriptor the longest stall was working on when it crossed the threshold
+    int mLongestStallFd;
+    
+    // Phase and descriptor of the stall in progress when it crossed the threshold, only used by the watchdog thread
+    LoopPhase mCurrentStallPhase;
+    int mCurrentStallFd;
+    
+    // Used to wake up the watchdog thread when it's stopped
+    std::mutex mStopMutex;
+    std::condition_variable mStopCondition;
+    
+    // True if the watchdog thread was asked to stop
+    bool mStopRequested;
+    
+    // Watchdog thread
+    std::thread mThread;
+};
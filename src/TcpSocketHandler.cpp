@@ -22,41 +22,140 @@
 #include <cstdio>
 #include <cstdlib>
 #include <sys/time.h>
+#include <pthread.h>
+#include <sched.h>
 #include <errno.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <algorithm>
+#include <fstream>
+#include <limits>
 
 #include "spdlog/spdlog.h"
 
 #include "TcpSocketHandler.hpp"
 
-TcpSocketHandler::TcpSocketHandler(RoomManager& roomManager, int portNumber) :
-    mFds{},
-    mRoomManager(roomManager)
+/**
+ * @return Number of descriptors currently open by the process
+ */
+static int countOpenDescriptors()
+{
+    DIR* directory = opendir("/proc/self/fd");
+    if (directory == nullptr) {
+        return 0;
+    }
+    
+    int openDescriptors = 0;
+    while (dirent* entry = readdir(directory)) {
+        if (entry->d_name[0] != '.') {
+            ++openDescriptors;
+        }
+    }
+    closedir(directory);
+    
+    // The directory itself was open while counting
+    return openDescriptors - 1;
+}
+
+TcpSocketHandler::TcpSocketHandler(RoomManager& roomManager, const ServerConfig& config) :
+    mConfig(config),
+    mRoomManager(roomManager),
+    mBufferPool(ClientHandler::RECEIVE_BUFFER_SIZE),
+    mTracer(static_cast<uint64_t>(config.traceSlowMilliseconds) * 1000),
+    mCapture(config.captureFile.empty() ? nullptr :
+        new TrafficCapture(config.captureFile, static_cast<uint64_t>(config.captureMaxMegabytes) * 1024 * 1024)),
+    mRelay(config.relayFirstPort == 0 ? nullptr :
+        new UdpRelay(config.relayFirstPort, config.relayPortCount, config.relayAddress, config.statsIntervalSeconds)),
+    mWatchdog(static_cast<uint32_t>(config.stallThresholdMilliseconds)),
+    mClientContext{mRoomManager, mBufferPool, mTracer, nullptr, nullptr, mTransport,
+        static_cast<uint32_t>(config.maxBytesPerWakeup), static_cast<uint32_t>(config.maxMessagesPerWakeup),
+        static_cast<uint32_t>(config.maxRoomsPerConnection)},
+    mTraceDumpRequested(false),
+    mStopRequested(false),
+    mMaxConnections(0),
+    mLastStatisticsTime(std::chrono::steady_clock::now())
 {
-    mPortNumber = portNumber;
     mEndServer = false;
-    mNumberFileDescriptors = 1;
-        
-    mRoomRegistrationDataThread = std::thread(&TcpSocketHandler::sendRegistrationData, this);
+    mNumberFileDescriptors = 0;
+    mCompressArray = false;
+    
+    if (mCapture != nullptr)
+    {
+        if (mCapture->isOpen())
+        {
+            SPDLOG_INFO("Capturing inbound traffic to {}", config.captureFile);
+            mClientContext.capture = mCapture.get();
+        }
+        else
+        {
+            SPDLOG_ERROR("Unable to open capture file {}", config.captureFile);
+        }
+    }
+    
+    mWakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mWakeupFd < 0)
+    {
+        SPDLOG_ERROR("eventfd() failed, errno={}", errno);
+    }
+    
+    mReserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (mReserveFd < 0)
+    {
+        SPDLOG_ERROR("Unable to open the reserve descriptor, errno={}", errno);
+    }
 }
 
 TcpSocketHandler::~TcpSocketHandler()
 {
-    mRoomRegistrationDataThread.join();
+    if (mWakeupFd >= 0)
+    {
+        close(mWakeupFd);
+    }
+    
+    if (mReserveFd >= 0)
+    {
+        close(mReserveFd);
+    }
+}
+
+void TcpSocketHandler::stopServer()
+{
+    mStopRequested.store(true, std::memory_order_release);
+    wakeup();
+}
+
+void TcpSocketHandler::requestTraceDump()
+{
+    mTraceDumpRequested.store(true, std::memory_order_release);
+    wakeup();
+}
+
+void TcpSocketHandler::wakeup()
+{
+    // Only a write to the eventfd, which is safe to use from a signal handler and never blocks unless
+    // the counter overflows
+    uint64_t value = 1;
+    ssize_t result = write(mWakeupFd, &value, sizeof(value));
+    (void)result;
 }
 
 void TcpSocketHandler::startServer()
 {
     int listenSd = -1;
-    bool compressArray = false;
 
     sockaddr_in6 addr = {};
     
-    // Create an AF_INET stream socket to receive incoming connections on
-    listenSd = socket(AF_INET6, SOCK_STREAM, 0);
+    // Create an AF_INET stream socket to receive incoming connections on. The socket is created nonblocking
+    // so that accept never blocks the event loop.
+    listenSd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (listenSd < 0)
     {
         SPDLOG_ERROR("socket() failed");
@@ -71,81 +170,173 @@ void TcpSocketHandler::startServer()
         close(listenSd);
         return;
     }
-  
-    // Set socket to be nonblocking. All of the sockets for the incoming connections will also be nonblocking since
-    // they will inherit that state from the listening socket.
-    if (ioctl(listenSd, FIONBIO, reinterpret_cast<char*>(&on)) < 0)
+
+    // Only wake up for new connections once the client has sent its first message
+    if (mConfig.deferAcceptSeconds > 0)
     {
-        SPDLOG_ERROR("ioctl() failed");
-        close(listenSd);
-        return;
+        int deferAcceptSeconds = mConfig.deferAcceptSeconds;
+        if (setsockopt(listenSd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &deferAcceptSeconds, sizeof(deferAcceptSeconds)) < 0)
+        {
+            SPDLOG_WARN("setsockopt(TCP_DEFER_ACCEPT) failed, errno={}", errno);
+        }
     }
   
     // Bind the socket
     memset(&addr, 0, sizeof(addr));
     addr.sin6_family = AF_INET6;
     memcpy(&addr.sin6_addr, &in6addr_any, sizeof(in6addr_any));
-    addr.sin6_port = htons(mPortNumber);
+    addr.sin6_port = htons(mConfig.portNumber);
     
     if (bind(listenSd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
     {
-        SPDLOG_ERROR("bind() failed on port {}", mPortNumber);
+        SPDLOG_ERROR("bind() failed on port {}", mConfig.portNumber);
         close(listenSd);
         return;
     }
   
     // Set the listen back log
-    if (listen(listenSd, 32) < 0)
+    int listenBacklog = getListenBacklog();
+    if (listen(listenSd, listenBacklog) < 0)
     {
       SPDLOG_ERROR("listen() failed");
       close(listenSd);
       return;
     }
+    
+    SPDLOG_INFO("Listening on port {} with backlog {}, accept batch {}, defer accept {}s", mConfig.portNumber,
+        listenBacklog, mConfig.maxAcceptsPerWakeup, mConfig.deferAcceptSeconds);
+    
+    // Relaying is optional, the server keeps running without it
+    if (mRelay != nullptr)
+    {
+        if (mRelay->start())
+        {
+            mClientContext.relay = mRelay.get();
+        }
+        else
+        {
+            SPDLOG_ERROR("Unable to start the UDP relay, relaying is disabled");
+        }
+    }
   
-    // Set up the initial listening socket
-    mFds[0].fd = listenSd;
-    mFds[0].events = POLLIN;
+    // Relay sockets are open by now, so they are left out of the capacity
+    mMaxConnections = getConnectionCapacity();
+    
+    // Done after the relay started, so that the relay thread doesn't inherit the CPU of the event loop
+    setUpLowLatencyMode(listenSd);
+    
+    // Counters follow the thread that opens them, which is the event loop thread
+    if (mConfig.profilePhases)
+    {
+        mProfiler.reset(new PhaseProfiler());
+        mClientContext.profiler = mProfiler.get();
+        mRoomManager.setProfiler(mProfiler.get());
+    }
+    
+    // Set up the initial listening socket and the wakeup event used by other threads
+    addFileDescriptor(listenSd, POLLIN);
+    addFileDescriptor(mWakeupFd, POLLIN);
+    
+    // End of the spin window, it's reopened by every event so the loop only blocks once traffic stops
+    const uint64_t spinNanoseconds = static_cast<uint64_t>(mConfig.spinMicroseconds) * 1000;
+    uint64_t spinDeadlineNanoseconds = 0;
+    
+    mWatchdog.start();
    
     // Loop waiting for incoming connects or for incoming data on any of the connected sockets.
     while (!mEndServer)
     {
-        // Poll with a timeout of 1 second
-        int pollReturn = poll(mFds.data(), mNumberFileDescriptors, 1000);
+        // Poll with a timeout of 1 second, or just check for events if clients are waiting for another turn or
+        // the spin window is open
+        bool spinning = spinNanoseconds != 0 && MonotonicClock::nowNanoseconds() < spinDeadlineNanoseconds;
+        int pollTimeout = mReadyQueue.empty() && !spinning ? 1000 : 0;
+        int pollReturn;
+        {
+            ProfileScope profileScope(mProfiler.get(), ProfilePhase::POLL_WAIT);
+            mWatchdog.setPhase(LoopPhase::POLL_WAIT);
+            pollReturn = poll(mFds.data(), mNumberFileDescriptors, pollTimeout);
+            mWatchdog.beginIteration();
+        }
 
         // Check to see if the poll call failed.
         if (pollReturn < 0)
         {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            
             SPDLOG_ERROR("poll() failed" );
             break;
         }
+        
+        if (spinning)
+        {
+            ++mPollStatistics.spinPolls;
+            mPollStatistics.spinHits += pollReturn > 0 ? 1 : 0;
+            
+            // Let anything else that is runnable on this CPU go first, which returns right away on a dedicated
+            // CPU. Otherwise spinning would hold off the threads we are waiting for.
+            if (pollReturn == 0)
+            {
+                sched_yield();
+            }
+        }
+        else if (pollTimeout != 0)
+        {
+            ++mPollStatistics.blockingPolls;
+        }
+        
+        if (spinNanoseconds != 0 && pollReturn > 0)
+        {
+            spinDeadlineNanoseconds = MonotonicClock::nowNanoseconds() + spinNanoseconds;
+        }
+        
+        mWatchdog.setPhase(LoopPhase::STATISTICS);
+        logStatisticsIfNeeded();
+        
+        // Connections stop recording once the capture is full
+        if (mClientContext.capture != nullptr && mClientContext.capture->hasReachedLimit())
+        {
+            SPDLOG_WARN("Traffic capture reached its maximum size of {} MB, capturing stopped", mConfig.captureMaxMegabytes);
+            mClientContext.capture = nullptr;
+        }
     
         // Check to see if timeout expired
-        if (pollReturn == 0)
+        if (pollReturn == 0 && mReadyQueue.empty())
         {
             continue;
         }
+        
+        // Only clients queued in earlier iterations take a turn from the ready queue. Clients that use up their
+        // budget during this dispatch are queued for the next iteration, so nobody gets two budgets in one.
+        mServingQueue.swap(mReadyQueue);
     
-        // One or more descriptors are readable.  Need to determine which ones they are.
+        // One or more descriptors are ready.  Need to determine which ones they are.
         int currentSize = mNumberFileDescriptors;
         for (int fileDescriptors = 0; fileDescriptors < currentSize; fileDescriptors++)
         {
-            // Loop through to find the descriptors that returned POLLIN and determine whether it's the listening
-            // or the active connection.
-            if (mFds[fileDescriptors].revents == 0)
+            // Loop through to find the descriptors that returned events and determine whether it's the listening
+            // socket, the wakeup event, a room number socket or an active connection.
+            int fd = mFds[fileDescriptors].fd;
+            short revents = mFds[fileDescriptors].revents;
+            if (revents == 0 || fd == -1)
             {
                 continue;
             }
-
-            // If revents is not POLLIN, it's an unexpected result, log and end the server.
-            if(mFds[fileDescriptors].revents != POLLIN)
-            {
-                SPDLOG_ERROR("Error! revents = {}",  mFds[fileDescriptors].revents);
-                mEndServer = true;
-                break;
-            }
   
-            if (mFds[fileDescriptors].fd == listenSd)
+            if (fd == listenSd)
             {
+                // If revents is not POLLIN, it's an unexpected result, log and end the server.
+                if (revents != POLLIN)
+                {
+                    SPDLOG_ERROR("Error! revents = {}", revents);
+                    mEndServer = true;
+                    break;
+                }
+                
+                ProfileScope profileScope(mProfiler.get(), ProfilePhase::ACCEPT);
+                mWatchdog.setPhase(LoopPhase::ACCEPT, fd);
                 if (!acceptNewConnections(listenSd))
                 {
                     SPDLOG_ERROR("Error accepting connections");
@@ -153,43 +344,322 @@ void TcpSocketHandler::startServer()
                     break;
                 }
             }
+            else if (fd == mWakeupFd)
+            {
+                mWatchdog.setPhase(LoopPhase::WAKEUP, fd);
+                handleWakeup();
+            }
+            else if (mRoomNumberSockets.count(fd) != 0)
+            {
+                mWatchdog.setPhase(LoopPhase::ROOM_NUMBER_SOCKET, fd);
+                processRoomNumberSocket(fd);
+            }
       
-            // This is not the listening socket, therefore an existing connection must be readable 
+            // This is not the listening socket, therefore an existing connection must be readable, or
+            // it has hung up, which will be detected while reading
             else
             {
-                compressArray = compressArray || processData(mFds[fileDescriptors].fd);
+                mWatchdog.setPhase(LoopPhase::CLIENT, fd);
+                processData(fd);
             }
         }
+        
+        processReadyQueue();
+        mWatchdog.setPhase(LoopPhase::ROOM_EVENTS);
+        publishRoomEvents();
+        mWatchdog.setPhase(LoopPhase::COMPACTION);
+        compressFileDescriptors();
+    };
     
-        // If the compressArray flag was turned on, we need to squeeze together the array and decrement the number
-        // of file descriptors. We do not need to move back the events and revents fields because the events will always
-        // be POLLIN in this case, and revents is output.
-        if (compressArray)
+    mWatchdog.setPhase(LoopPhase::POLL_WAIT);
+    mWatchdog.stop();
+    mWatchdog.logStatistics();
+
+    // Clean up all of the sockets that are open. Room number sockets are closed by their client handlers.
+    for (int fileDescriptorIndex = 0; fileDescriptorIndex < mNumberFileDescriptors; fileDescriptorIndex++)
+    {
+        int fd = mFds[fileDescriptorIndex].fd;
+        if (fd >= 0 && fd != mWakeupFd && mRoomNumberSockets.count(fd) == 0)
         {
-            compressArray = false;
-            for (int fileDescriptorIndex = 0; fileDescriptorIndex < mNumberFileDescriptors; fileDescriptorIndex++)
-            {
-                if (mFds[fileDescriptorIndex].fd == -1)
-                {
-                    for(int compressedIndex = fileDescriptorIndex; compressedIndex < mNumberFileDescriptors; compressedIndex++)
-                    {
-                        mFds[compressedIndex].fd = mFds[compressedIndex+1].fd;
-                    }
-                    fileDescriptorIndex--;
-                    mNumberFileDescriptors--;
-                }
-            }
+            close(fd);
         }
-    };
+    }
+    
+    mRoomNumberSockets.clear();
+    mReadyQueue.clear();
+    mcClients.clear();
+    
+    if (mRelay != nullptr)
+    {
+        mRelay->stop();
+        mClientContext.relay = nullptr;
+    }
+    mFdIndexes.clear();
+    mNumberFileDescriptors = 0;
+    
+    if (mProfiler != nullptr)
+    {
+        mProfiler->dump();
+        mRoomManager.setProfiler(nullptr);
+        mClientContext.profiler = nullptr;
+        mProfiler.reset();
+    }
+}
+
+void TcpSocketHandler::addFileDescriptor(int fd, short events)
+{
+    // The poll set grows with the connections, it's bounded by the connection capacity
+    if (mNumberFileDescriptors == static_cast<int>(mFds.size()))
+    {
+        mFds.emplace_back();
+    }
+    
+    mFds[mNumberFileDescriptors].fd = fd;
+    mFds[mNumberFileDescriptors].events = events;
+    mFds[mNumberFileDescriptors].revents = 0;
+    mFdIndexes[fd] = mNumberFileDescriptors;
+    mNumberFileDescriptors++;
+}
+
+void TcpSocketHandler::removeFileDescriptor(int fd)
+{
+    auto indexIter = mFdIndexes.find(fd);
+    if (indexIter != mFdIndexes.end())
+    {
+        mFds[indexIter->second].fd = -1;
+        mFdIndexes.erase(indexIter);
+        mCompressArray = true;
+    }
+}
 
-    // Clean up all of the sockets that are open
+void TcpSocketHandler::compressFileDescriptors()
+{
+    // If an entry was removed, squeeze together the array in a single pass and update the
+    // index of every entry that moved.
+    if (!mCompressArray)
+    {
+        return;
+    }
+    
+    mCompressArray = false;
+    int compressedIndex = 0;
     for (int fileDescriptorIndex = 0; fileDescriptorIndex < mNumberFileDescriptors; fileDescriptorIndex++)
     {
-        if(mFds[fileDescriptorIndex].fd >= 0)
+        if (mFds[fileDescriptorIndex].fd == -1)
+        {
+            continue;
+        }
+        
+        if (compressedIndex != fileDescriptorIndex)
+        {
+            mFds[compressedIndex] = mFds[fileDescriptorIndex];
+            mFdIndexes[mFds[compressedIndex].fd] = compressedIndex;
+        }
+        compressedIndex++;
+    }
+    mNumberFileDescriptors = compressedIndex;
+}
+
+void TcpSocketHandler::handleWakeup()
+{
+    // Reset the eventfd counter before checking the flags so that a request made meanwhile wakes us up again
+    uint64_t value = 0;
+    if (read(mWakeupFd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+    {
+        SPDLOG_ERROR("Unable to read wakeup event, errno={}", errno);
+    }
+    
+    if (mTraceDumpRequested.exchange(false, std::memory_order_acq_rel))
+    {
+        mTracer.dump();
+        mWatchdog.logStatistics();
+        if (mProfiler != nullptr)
         {
-            close(mFds[fileDescriptorIndex].fd);
+            mProfiler->dump();
         }
     }
+    
+    if (mStopRequested.load(std::memory_order_acquire))
+    {
+        SPDLOG_INFO("Stopping server");
+        mEndServer = true;
+    }
+}
+
+void TcpSocketHandler::setUpLowLatencyMode(int listenFd)
+{
+    if (mConfig.pinnedCpu >= 0)
+    {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(mConfig.pinnedCpu, &cpuSet);
+        int result = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+        if (result != 0)
+        {
+            SPDLOG_WARN("Unable to pin the event loop to CPU {}, error={}", mConfig.pinnedCpu, result);
+        }
+    }
+    
+    // Raising SO_BUSY_POLL over net.core.busy_read needs CAP_NET_ADMIN, so try it once on the listening socket
+    // instead of failing on every accepted connection
+    if (mConfig.busyPollMicroseconds > 0)
+    {
+        int busyPollMicroseconds = mConfig.busyPollMicroseconds;
+        if (setsockopt(listenFd, SOL_SOCKET, SO_BUSY_POLL, &busyPollMicroseconds, sizeof(busyPollMicroseconds)) < 0)
+        {
+            SPDLOG_WARN("setsockopt(SO_BUSY_POLL) failed, busy polling is disabled, errno={}", errno);
+            mConfig.busyPollMicroseconds = 0;
+        }
+    }
+    
+    if (mConfig.spinMicroseconds > 0 || mConfig.busyPollMicroseconds > 0 || mConfig.pinnedCpu >= 0)
+    {
+        SPDLOG_INFO("Low latency mode: spin {}us, busy poll {}us, cpu {}", mConfig.spinMicroseconds,
+            mConfig.busyPollMicroseconds, mConfig.pinnedCpu);
+    }
+}
+
+int TcpSocketHandler::getListenBacklog() const
+{
+    // The kernel silently truncates the backlog to somaxconn, so read it to know the real value
+    int somaxconn = SOMAXCONN;
+    std::ifstream somaxconnFile("/proc/sys/net/core/somaxconn");
+    if (!(somaxconnFile >> somaxconn) || somaxconn <= 0) {
+        somaxconn = SOMAXCONN;
+    }
+    
+    if (mConfig.listenBacklog <= 0) {
+        return somaxconn;
+    }
+    
+    if (mConfig.listenBacklog > somaxconn) {
+        SPDLOG_WARN("Requested listen backlog {} is larger than somaxconn {}, using {}",
+            mConfig.listenBacklog, somaxconn, somaxconn);
+    }
+    
+    return std::min(mConfig.listenBacklog, somaxconn);
+}
+
+int TcpSocketHandler::getConnectionCapacity()
+{
+    // Use every descriptor we are allowed to, the soft limit is usually far below the hard limit
+    rlimit limit = {};
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0)
+    {
+        SPDLOG_ERROR("getrlimit() failed, errno={}", errno);
+        limit.rlim_cur = FD_SETSIZE;
+    }
+    else if (limit.rlim_cur < limit.rlim_max)
+    {
+        rlimit raisedLimit = limit;
+        raisedLimit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &raisedLimit) == 0)
+        {
+            limit = raisedLimit;
+        }
+        else
+        {
+            SPDLOG_WARN("Unable to raise the descriptor limit from {} to {}, errno={}", limit.rlim_cur, limit.rlim_max, errno);
+        }
+    }
+    
+    int64_t descriptorLimit = limit.rlim_cur == RLIM_INFINITY ? std::numeric_limits<int>::max() :
+        static_cast<int64_t>(std::min<rlim_t>(limit.rlim_cur, std::numeric_limits<int>::max()));
+    
+    // Descriptors that are open already, like the relay sockets, and the ones used outside of connections
+    // are kept out, then a share is left for the room number sockets, which only live until the room number
+    // is delivered
+    int64_t availableDescriptors = std::max<int64_t>(0, descriptorLimit - RESERVED_FILE_DESCRIPTORS - countOpenDescriptors());
+    int64_t capacity = availableDescriptors - availableDescriptors / ROOM_NUMBER_SOCKET_SHARE;
+    
+    if (mConfig.maxConnections > 0)
+    {
+        if (mConfig.maxConnections > capacity)
+        {
+            SPDLOG_WARN("Requested connection limit {} is larger than the descriptor limit {} allows, using {}",
+                mConfig.maxConnections, descriptorLimit, capacity);
+        }
+        capacity = std::min<int64_t>(capacity, mConfig.maxConnections);
+    }
+    
+    SPDLOG_INFO("Connection capacity {} with descriptor limit {}", capacity, descriptorLimit);
+    return static_cast<int>(capacity);
+}
+
+size_t TcpSocketHandler::getConnectionCount() const
+{
+    // Room number sockets are closed as soon as they leave mRoomNumberSockets, so this is every open connection
+    return mcClients.size() + mRoomNumberSockets.size();
+}
+
+void TcpSocketHandler::logStatisticsIfNeeded()
+{
+    auto now = std::chrono::steady_clock::now();
+    
+    if (now - mLastStatisticsTime < std::chrono::seconds(mConfig.statsIntervalSeconds)) {
+        return;
+    }
+    
+    mLastStatisticsTime = now;
+    
+    // Before accept4 this was one accept() and one ioctl() per connection plus one failing accept() per wakeup
+    const AcceptStatistics& stats = mAcceptStatistics;
+    double syscallsPerConnection = stats.acceptedConnections == 0 ? 0.0 :
+        static_cast<double>(stats.acceptCalls) / stats.acceptedConnections;
+    SPDLOG_INFO("Accept statistics: connections={}, accept_calls={}, limited_wakeups={}, syscalls_per_connection={:.3f}, "
+        "open_connections={}, capacity={}, rejected={}, reserve_descriptor_uses={}",
+        stats.acceptedConnections, stats.acceptCalls, stats.limitedWakeups, syscallsPerConnection,
+        getConnectionCount(), mMaxConnections, stats.rejectedConnections, stats.reserveDescriptorUses);
+    
+    SPDLOG_INFO("Room event statistics: events={}, pushes={}, slow_subscribers={}",
+        mPushStatistics.roomEvents, mPushStatistics.pushes, mPushStatistics.slowSubscribers);
+    
+    SPDLOG_INFO("Scheduling statistics: deferrals={}, ready_queue={}, max_ready_queue={}, max_handler_us={:.1f}",
+        mSchedulingStatistics.deferrals, mReadyQueue.size(), mSchedulingStatistics.maxReadyQueueDepth,
+        mSchedulingStatistics.maxHandlerNanoseconds / 1000.0);
+    mSchedulingStatistics.maxReadyQueueDepth = 0;
+    mSchedulingStatistics.maxHandlerNanoseconds = 0;
+    
+    SPDLOG_INFO("Poll statistics: blocking_polls={}, spin_polls={}, spin_hits={}",
+        mPollStatistics.blockingPolls, mPollStatistics.spinPolls, mPollStatistics.spinHits);
+    
+    mWatchdog.logStatistics();
+    
+    logConnectionMemory();
+    mTracer.dump();
+    
+    if (mProfiler != nullptr)
+    {
+        mProfiler->dump();
+    }
+    
+    if (mCapture != nullptr && mCapture->isOpen())
+    {
+        mCapture->flush();
+        SPDLOG_INFO("Traffic capture: bytes={}", mCapture->getCapturedBytes());
+    }
+}
+
+void TcpSocketHandler::logConnectionMemory()
+{
+    size_t numberOfClients = mcClients.size();
+    size_t buffersInUse = mBufferPool.getBuffersInUse();
+    size_t bufferPoolBytes = mBufferPool.getAllocatedBytes();
+    size_t coroutineFrames = CoroutineFramePool::getFramesInUse();
+    size_t coroutineFrameBytes = CoroutineFramePool::getAllocatedBytes();
+    
+    // An idle connection holds its handler in a client map node, a bucket pointer and a pollfd entry, plus
+    // the pooled frame of its suspended connection flow which is reported separately. Buffers are only held
+    // while a message is partially received.
+    const size_t mapNodeBytes = sizeof(void*) + sizeof(std::pair<const int, ClientHandler>) + sizeof(size_t);
+    const size_t idleBytesPerConnection = mapNodeBytes + sizeof(void*) + sizeof(pollfd);
+    const size_t idleConnectionsReference = 100000;
+    
+    SPDLOG_INFO("Connection memory: clients={}, rooms={}, handler_bytes={}, idle_bytes_per_connection={}, "
+        "receive_buffers_in_use={}, buffer_pool_bytes={}, coroutine_frames={}, coroutine_frame_bytes={}, "
+        "estimated_100k_idle_bytes={}",
+        numberOfClients, mRoomManager.getRoomCount(), sizeof(ClientHandler), idleBytesPerConnection, buffersInUse, bufferPoolBytes,
+        coroutineFrames, coroutineFrameBytes, idleBytesPerConnection * idleConnectionsReference);
 }
 
 bool TcpSocketHandler::acceptNewConnections(int socketFd)
@@ -199,85 +669,270 @@ bool TcpSocketHandler::acceptNewConnections(int socketFd)
     // Listening descriptor is readable.
     SPDLOG_DEBUG("Listening socket is readable");
     
-    // Accept all incoming connections that are queued up on the listening socket before we
-    // loop back and call poll again.
-    int newSocket = accept(socketFd, nullptr, nullptr);
-    
-    while (newSocket != -1) {
-        int on = 1;
-        if (ioctl(newSocket, FIONBIO, reinterpret_cast<char*>(&on)) < 0)
-        {
-            SPDLOG_ERROR("ioctl() failed");
-            close(newSocket);
+    // Accept incoming connections that are queued up on the listening socket before we loop back and call
+    // poll again, up to the per wakeup limit. Anything left over stays in the backlog and will wake poll
+    // up again immediately. accept4() gives us a nonblocking socket directly, so no extra ioctl is needed.
+    int acceptedConnections = 0;
+    while (acceptedConnections < mConfig.maxAcceptsPerWakeup) {
+        int newSocket = accept4(socketFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        ++mAcceptStatistics.acceptCalls;
+        
+        if (newSocket == -1) {
+            // If accept fails with EWOULDBLOCK, then we have accepted all of them. Connections that were
+            // aborted before we got to them are skipped. Any other failure on accept will cause us to end the server.
+            if (errno == ECONNABORTED || errno == EINTR) {
+                continue;
+            }
+            
+            // Out of descriptors, the connection is rejected with the reserve one. If that's gone too, the
+            // rest wait in the backlog until connections close.
+            if (errno == EMFILE || errno == ENFILE) {
+                ++acceptedConnections;
+                if (!rejectWithReserveDescriptor(socketFd)) {
+                    break;
+                }
+                continue;
+            }
+            
+            if (errno != EWOULDBLOCK && errno != EAGAIN)
+            {
+                SPDLOG_ERROR("accept() failed, errno={}", errno);
+                success = false;
+            }
+            break;
         }
         
-        {
-            std::unique_lock<std::mutex> lock(mClientsMutex);
-            mcClients.emplace(newSocket, ClientHandler(mRoomManager, newSocket));
+        ++acceptedConnections;
+        
+        // Shed load once the server is full, before the client costs anything but the accept
+        if (getConnectionCount() >= static_cast<size_t>(mMaxConnections)) {
+            rejectConnection(newSocket);
+            continue;
         }
         
+        ++mAcceptStatistics.acceptedConnections;
+        
+        if (mConfig.busyPollMicroseconds > 0) {
+            int busyPollMicroseconds = mConfig.busyPollMicroseconds;
+            setsockopt(newSocket, SOL_SOCKET, SO_BUSY_POLL, &busyPollMicroseconds, sizeof(busyPollMicroseconds));
+        }
+        
+        mcClients.emplace(std::piecewise_construct, std::forward_as_tuple(newSocket),
+            std::forward_as_tuple(mClientContext, newSocket));
+        
         // Add the new incoming connection to the pollfd structure
         SPDLOG_INFO("New connection with id {}!", newSocket);
-        mFds[mNumberFileDescriptors].fd = newSocket;
-        mFds[mNumberFileDescriptors].events = POLLIN;
-        mNumberFileDescriptors++;
-        
-        newSocket = accept(socketFd, nullptr, nullptr);
+        addFileDescriptor(newSocket, POLLIN);
     }
     
-    // If accept fails with EWOULDBLOCK, then we have accepted all of them. Any other failure
-    // on accept will cause us to end the server.
-    if (errno != EWOULDBLOCK)
-    {
-        SPDLOG_ERROR("accept() failed");
-        success = false;
+    if (acceptedConnections == mConfig.maxAcceptsPerWakeup) {
+        ++mAcceptStatistics.limitedWakeups;
     }
     
     return success;
 }
 
-bool TcpSocketHandler::processData(int& socketFd)
+bool TcpSocketHandler::rejectWithReserveDescriptor(int socketFd)
+{
+    if (mReserveFd < 0) {
+        return false;
+    }
+    
+    ++mAcceptStatistics.reserveDescriptorUses;
+    close(mReserveFd);
+    
+    int newSocket = accept4(socketFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    ++mAcceptStatistics.acceptCalls;
+    if (newSocket >= 0) {
+        rejectConnection(newSocket);
+    }
+    
+    mReserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (mReserveFd < 0) {
+        SPDLOG_ERROR("Unable to reopen the reserve descriptor, errno={}", errno);
+        return false;
+    }
+    
+    return newSocket >= 0;
+}
+
+void TcpSocketHandler::rejectConnection(int socketFd)
+{
+    ++mAcceptStatistics.rejectedConnections;
+    
+    // Closing with unread data resets the connection, which could make the client drop the response
+    char discarded[256];
+    ssize_t discardedBytes = recv(socketFd, discarded, sizeof(discarded), MSG_DONTWAIT);
+    (void)discardedBytes;
+    
+    Protocol::ServerBusy::Buffer serverBusy;
+    Protocol::ServerBusy::encode(serverBusy.data(), BUSY_RETRY_SECONDS);
+    if (send(socketFd, serverBusy.data(), serverBusy.size(), MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+        SPDLOG_DEBUG("Unable to send SERVER_BUSY on socket {}, errno={}", socketFd, errno);
+    }
+    
+    close(socketFd);
+}
+
+void TcpSocketHandler::processData(int socketFd)
 {
     SPDLOG_DEBUG("Descriptor {} is readable",  socketFd);
-    bool closeConn = false;
     
-    std::unique_lock<std::mutex> lock(mClientsMutex);
+    auto clientIter = mcClients.find(socketFd);
+    if (clientIter == mcClients.end()) {
+        SPDLOG_ERROR("Received data on unexpected socket {}", socketFd);
+        closeClient(socketFd);
+        return;
+    }
+    
+    // A client that ran out of budget in an earlier iteration gets its turn from the ready queue
+    ClientHandler& client = clientIter->second;
+    if (!client.hasDeferredWork()) {
+        serveClient(socketFd, client);
+    }
+}
 
-    // Receive all incoming data on this socket before we loop back and call poll again.
-    if (mcClients.count(socketFd) != 0) {
-        // Close connection on failure
-        ClientHandler& client = mcClients.at(socketFd);
+void TcpSocketHandler::processReadyQueue()
+{
+    // Clients that run out of budget again are queued behind everybody else for the next iteration
+    for (int socketFd : mServingQueue) {
+        if (socketFd == -1) {
+            continue;
+        }
+        
+        mWatchdog.setPhase(LoopPhase::READY_QUEUE, socketFd);
+        auto clientIter = mcClients.find(socketFd);
+        if (clientIter != mcClients.end()) {
+            serveClient(socketFd, clientIter->second);
+        }
+    }
+    mServingQueue.clear();
+}
+
+void TcpSocketHandler::serveClient(int socketFd, ClientHandler& client)
+{
+    // Close connection on failure
+    uint64_t startNanoseconds = MonotonicClock::nowNanoseconds();
+    bool closeConn;
+    {
+        ProfileScope profileScope(mProfiler.get(), ProfilePhase::DECODE);
         closeConn = client.processStream();
-    } else {
-        SPDLOG_ERROR("Received data on unexpected socket {}", socketFd);
-        closeConn = true;
     }
+    uint64_t handlerNanoseconds = MonotonicClock::nowNanoseconds() - startNanoseconds;
+    mSchedulingStatistics.maxHandlerNanoseconds = std::max(mSchedulingStatistics.maxHandlerNanoseconds, handlerNanoseconds);
     
-    // If the closeConn flag was turned on, we need to clean up this active connection. This
-    // clean up process includes removing the descriptor.
+    // If the closeConn flag was turned on, we need to clean up this active connection.
     if (closeConn)
     {
-        SPDLOG_INFO("Connection closed on socket {}", socketFd);
-        close(socketFd);
-        
-        mcClients.erase(socketFd);
-        
-        socketFd = -1;
+        closeClient(socketFd);
+        return;
+    }
+    
+    // If the client connected to its netplay server to send the room number, wait for that socket to
+    // become writable
+    int roomNumberSocket = client.getRoomNumberSocket();
+    if (roomNumberSocket != -1 && mRoomNumberSockets.count(roomNumberSocket) == 0 && !client.isRoomNumberSent()) {
+        mRoomNumberSockets[roomNumberSocket] = socketFd;
+        addFileDescriptor(roomNumberSocket, POLLOUT);
+    }
+    
+    if (client.hasDeferredWork()) {
+        mReadyQueue.push_back(socketFd);
+        ++mSchedulingStatistics.deferrals;
+        mSchedulingStatistics.maxReadyQueueDepth = std::max(mSchedulingStatistics.maxReadyQueueDepth, mReadyQueue.size());
     }
-
-    return closeConn;
 }
 
+void TcpSocketHandler::closeClient(int socketFd)
+{
+    // This clean up process includes removing the descriptor and the room number socket owned by the client.
+    SPDLOG_INFO("Connection closed on socket {}", socketFd);
+    
+    auto clientIter = mcClients.find(socketFd);
+    if (clientIter != mcClients.end()) {
+        int roomNumberSocket = clientIter->second.getRoomNumberSocket();
+        if (mRoomNumberSockets.erase(roomNumberSocket) != 0) {
+            removeFileDescriptor(roomNumberSocket);
+        }
+        
+        mcClients.erase(clientIter);
+    }
+    
+    // A connection accepted later can get the same descriptor, it must not inherit a turn from the ready queue.
+    // The serving queue may be iterated right now, so its entry is only blanked out.
+    mReadyQueue.erase(std::remove(mReadyQueue.begin(), mReadyQueue.end(), socketFd), mReadyQueue.end());
+    std::replace(mServingQueue.begin(), mServingQueue.end(), socketFd, -1);
+    
+    removeFileDescriptor(socketFd);
+    close(socketFd);
+}
 
-void TcpSocketHandler::sendRegistrationData()
+void TcpSocketHandler::publishRoomEvents()
 {
-    while (!mEndServer) {
-        {
-            std::unique_lock<std::mutex> lock(mClientsMutex);
-            for (auto& client : mcClients) {
-                client.second.sendNetplayRoomIfConnected();
+    mRoomManager.takeEvents(mRoomEvents);
+    if (mRoomEvents.empty()) {
+        return;
+    }
+    
+    // Group the events of each room, keeping their order
+    std::stable_sort(mRoomEvents.begin(), mRoomEvents.end(), [](const RoomEvent& first, const RoomEvent& second) {
+        return first.roomNumber < second.roomNumber;
+    });
+    
+    mPushStatistics.roomEvents += mRoomEvents.size();
+    
+    for (size_t firstEvent = 0; firstEvent < mRoomEvents.size();) {
+        uint32_t roomNumber = mRoomEvents[firstEvent].roomNumber;
+        bool roomEnded = false;
+        
+        mRoomEventBuffer.clear();
+        size_t eventIndex = firstEvent;
+        for (; eventIndex < mRoomEvents.size() && mRoomEvents[eventIndex].roomNumber == roomNumber; ++eventIndex) {
+            const RoomEvent& event = mRoomEvents[eventIndex];
+            size_t offset = mRoomEventBuffer.size();
+            mRoomEventBuffer.resize(offset + Protocol::RoomEventPush::SIZE);
+            ClientHandler::encodeRoomEvent(event, mRoomEventBuffer.data() + offset);
+            roomEnded = roomEnded || event.type == RoomEvent::GAME_STARTED || event.type == RoomEvent::ROOM_REMOVED;
+        }
+        firstEvent = eventIndex;
+        
+        const std::vector<int>* subscribers = mRoomManager.getSubscribers(roomNumber);
+        if (subscribers != nullptr) {
+            for (int subscriber : *subscribers) {
+                auto clientIter = mcClients.find(subscriber);
+                if (clientIter == mcClients.end()) {
+                    continue;
+                }
+                
+                ++mPushStatistics.pushes;
+                if (!clientIter->second.sendRoomEvents(mRoomEventBuffer.data(), mRoomEventBuffer.size())) {
+                    mSlowSubscribers.push_back(subscriber);
+                }
             }
         }
-        std::this_thread::sleep_for (std::chrono::milliseconds(100));
+        
+        // Nothing else will happen to a room that is gone
+        if (roomEnded) {
+            mRoomManager.clearSubscribers(roomNumber);
+        }
+    }
+    
+    // Closing a subscriber changes the subscriber lists, so it's only done once everything was sent
+    mPushStatistics.slowSubscribers += mSlowSubscribers.size();
+    for (int subscriber : mSlowSubscribers) {
+        closeClient(subscriber);
+    }
+    mSlowSubscribers.clear();
+}
+
+void TcpSocketHandler::processRoomNumberSocket(int socketFd)
+{
+    int clientSocket = mRoomNumberSockets[socketFd];
+    auto clientIter = mcClients.find(clientSocket);
+    
+    // Stop polling the socket once the client is done with it, the client closes it when the delivery is over
+    if (clientIter == mcClients.end() || clientIter->second.resumeRoomNumberDelivery()) {
+        mRoomNumberSockets.erase(socketFd);
+        removeFileDescriptor(socketFd);
     }
 }
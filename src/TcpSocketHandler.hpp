@@ -23,15 +23,29 @@
 
 #include <sys/poll.h>
 
-#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
 #include <unordered_map>
-#include <thread>
+#include <vector>
 
+#include "BufferPool.hpp"
+#include "ClientContext.hpp"
 #include "ClientHandler.hpp"
+#include "PhaseProfiler.hpp"
+#include "RequestTracer.hpp"
 #include "RoomManager.hpp"
+#include "ServerConfig.hpp"
+#include "SocketTransport.hpp"
+#include "StallWatchdog.hpp"
+#include "TrafficCapture.hpp"
+#include "UdpRelay.hpp"
 
 /**
- * Used to handle message from any client that connects
+ * Used to handle message from any client that connects. All connections are owned by the thread that
+ * calls startServer(). Other threads and signal handlers only talk to it through stopServer() and
+ * requestTraceDump(), which set a flag and wake the event loop up.
  */
 class TcpSocketHandler
 {
@@ -40,9 +54,9 @@ public:
     /**
      * Constructor
      * @param roomManager Room manager for handling room data
-     * @param portNumber Port number to listen in
+     * @param config Server configuration
      */
-    TcpSocketHandler(RoomManager& roomManager, int portNumber);
+    TcpSocketHandler(RoomManager& roomManager, const ServerConfig& config);
 
     /**
      * Destructor
@@ -53,9 +67,161 @@ public:
      * Start listening
      */
     void startServer();
+    
+    /**
+     * Ask the event loop to end, can be called from any thread. This is async-signal-safe, so it can
+     * be called from a signal handler.
+     */
+    void stopServer();
+    
+    /**
+     * Ask the event loop to write trace histograms and slow request exemplars to the log. This is
+     * async-signal-safe, so it can be called from a signal handler.
+     */
+    void requestTraceDump();
 	
 private:
     
+    // Descriptors kept out of the connection capacity for files and sockets opened while running
+    static const int RESERVED_FILE_DESCRIPTORS = 32;
+    
+    // One in this many descriptors of the capacity is left for room number sockets. They are only open while the
+    // room number is delivered, a connect and one 8 byte send, so only hosts registering at the same time need one.
+    static const int ROOM_NUMBER_SOCKET_SHARE = 16;
+    
+    // Seconds a rejected client is asked to wait before connecting again
+    static const uint32_t BUSY_RETRY_SECONDS = 10;
+    
+    /**
+     * Syscall accounting for the accept path
+     */
+    struct AcceptStatistics
+    {
+        // Number of accept4() calls, including the ones that returned no connection
+        uint64_t acceptCalls = 0;
+        
+        // Number of accepted connections
+        uint64_t acceptedConnections = 0;
+        
+        // Number of wakeups that stopped because the per wakeup accept limit was reached
+        uint64_t limitedWakeups = 0;
+        
+        // Number of connections sent SERVER_BUSY because the server was full
+        uint64_t rejectedConnections = 0;
+        
+        // Number of times the reserve descriptor was used because the process ran out of descriptors
+        uint64_t reserveDescriptorUses = 0;
+    };
+    
+    /**
+     * Room event push accounting
+     */
+    struct PushStatistics
+    {
+        // Number of room events published
+        uint64_t roomEvents = 0;
+        
+        // Number of sends to subscribers, every send carries all events of a room from one event loop iteration
+        uint64_t pushes = 0;
+        
+        // Number of subscribers closed because they were not reading their events
+        uint64_t slowSubscribers = 0;
+    };
+    
+    /**
+     * Per connection budget accounting
+     */
+    struct SchedulingStatistics
+    {
+        // Number of times a connection used up its budget and was queued for another turn
+        uint64_t deferrals = 0;
+        
+        // Largest number of connections waiting in the ready queue since the last statistics log entry
+        size_t maxReadyQueueDepth = 0;
+        
+        // Longest single processStream() call since the last statistics log entry, in nanoseconds
+        uint64_t maxHandlerNanoseconds = 0;
+    };
+    
+    /**
+     * Event loop polling accounting
+     */
+    struct PollStatistics
+    {
+        // Number of poll() calls that could block
+        uint64_t blockingPolls = 0;
+        
+        // Number of poll() calls made without blocking because the spin window after the last event was still open
+        uint64_t spinPolls = 0;
+        
+        // Number of spinning poll() calls that found events, each one is a wakeup that didn't go through the scheduler
+        uint64_t spinHits = 0;
+    };
+    
+    /**
+     * Gets the listen backlog to use, based on configuration and somaxconn
+     * @return Listen backlog
+     */
+    int getListenBacklog() const;
+    
+    /**
+     * Gets the maximum number of open connections, based on configuration and the file descriptor limit. The
+     * soft limit is raised to the hard limit first.
+     * @return Connection capacity
+     */
+    int getConnectionCapacity();
+    
+    /**
+     * @return Number of open descriptors that count against the connection capacity
+     */
+    size_t getConnectionCount() const;
+    
+    /**
+     * Apply the low latency options: pin the event loop thread to its CPU and enable SO_BUSY_POLL on the
+     * listening socket. Busy polling is turned off if the kernel refuses it.
+     * @param listenFd Listening socket
+     */
+    void setUpLowLatencyMode(int listenFd);
+    
+    /**
+     * Log statistics if the statistics interval has expired
+     */
+    void logStatisticsIfNeeded();
+    
+    /**
+     * Log the memory used per connection
+     */
+    void logConnectionMemory();
+    
+    /**
+     * Add a file descriptor to the poll set
+     * @param fd File descriptor to add
+     * @param events Events to poll for
+     */
+    void addFileDescriptor(int fd, short events);
+    
+    /**
+     * Remove a file descriptor from the poll set. The entry is only marked as unused, the poll
+     * set is compressed at the end of the event loop iteration.
+     * @param fd File descriptor to remove
+     */
+    void removeFileDescriptor(int fd);
+    
+    /**
+     * Remove unused entries from the poll set
+     */
+    void compressFileDescriptors();
+    
+    /**
+     * Handle the stop and trace dump requests that woke up the event loop
+     */
+    void handleWakeup();
+    
+    /**
+     * Wake up the event loop
+     */
+    void wakeup();
+    
     /**
      * Accept new connections
      * @param socketFd Socket handle to listen on
@@ -63,26 +229,65 @@ private:
      */
     bool acceptNewConnections(int socketFd);
     
+    /**
+     * Take a connection off the backlog when the process is out of descriptors, by giving up the reserve
+     * descriptor for it. Otherwise the listening socket would stay readable and the event loop would spin.
+     * @param socketFd Listening socket
+     * @return true if the reserve descriptor is available again
+     */
+    bool rejectWithReserveDescriptor(int socketFd);
+    
+    /**
+     * Tell a connection that the server is full and close it
+     * @param socketFd Accepted socket
+     */
+    void rejectConnection(int socketFd);
+    
     /**
      * Process any received data
      * @param socketFd Socket to process data from
-     * @return True if socket was closed
      */
-    bool processData(int& socketFd);
+    void processData(int socketFd);
+    
+    /**
+     * Give every connection that used up its budget in an earlier iteration another turn, in the order
+     * they were queued. Connections that used up their budget in this iteration wait for the next one.
+     */
+    void processReadyQueue();
+    
+    /**
+     * Let a client process its data within its budget, queueing it for another turn if the budget ran out
+     * @param socketFd Socket of the client
+     * @param client Client handler
+     */
+    void serveClient(int socketFd, ClientHandler& client);
+    
+    /**
+     * Send the room number through a room number socket that became writable
+     * @param socketFd Room number socket
+     */
+    void processRoomNumberSocket(int socketFd);
+    
+    /**
+     * Close a client connection and the room number socket it owns
+     * @param socketFd Socket of the client
+     */
+    void closeClient(int socketFd);
     
     /**
-     * Send registration data to all servers waiting for it
+     * Push the room events recorded during this event loop iteration to their subscribers. All events of
+     * a room are encoded once and sent with a single send per subscriber.
      */
-    void sendRegistrationData();
+    void publishRoomEvents();
 
-    // Port number used to listen in
-    int mPortNumber;
+    // Server configuration
+    ServerConfig mConfig;
     
     // True if we want to end the server
     bool mEndServer;
     
-    // File descriptors for clients
-    std::array<pollfd, 10000> mFds;
+    // File descriptors for clients, grows with the number of connections
+    std::vector<pollfd> mFds;
     
     // Map of socket handle number to client handlers
     std::unordered_map<int, ClientHandler> mcClients;
@@ -90,12 +295,85 @@ private:
     // Current number of file descriptors
     int mNumberFileDescriptors;
     
+    // Map of file descriptor to its index in mFds
+    std::unordered_map<int, int> mFdIndexes;
+    
+    // True if an entry in mFds was removed during this event loop iteration
+    bool mCompressArray;
+    
+    // Map of room number socket to the socket of the client that owns it
+    std::unordered_map<int, int> mRoomNumberSockets;
+    
     // Room manager
     RoomManager& mRoomManager;
     
-    // Separate thread for sending room registration data
-    std::thread mRoomRegistrationDataThread;
+    // Pool of receive buffers borrowed by clients with partially received messages
+    BufferPool mBufferPool;
+    
+    // Request tracer
+    RequestTracer mTracer;
+    
+    // Traffic capture, only created when capturing is enabled
+    std::unique_ptr<TrafficCapture> mCapture;
+    
+    // UDP relay, only created when relaying is enabled
+    std::unique_ptr<UdpRelay> mRelay;
+    
+    // Event loop phase profiler, only created while the server runs with phase profiling enabled
+    std::unique_ptr<PhaseProfiler> mProfiler;
+    
+    // Watchdog that reports event loop iterations that take too long
+    StallWatchdog mWatchdog;
+    
+    // Transport used by clients
+    SocketTransport mTransport;
+    
+    // Resources shared with every client
+    ClientContext mClientContext;
+    
+    // True if a trace dump was requested
+    std::atomic<bool> mTraceDumpRequested;
+    
+    // True if the server was asked to stop
+    std::atomic<bool> mStopRequested;
+    
+    // Event file descriptor used to wake up the event loop when a stop or trace dump is requested
+    int mWakeupFd;
+    
+    // Descriptor kept open so that a connection can still be accepted and rejected once the process runs out
+    int mReserveFd;
+    
+    // Maximum number of open connections
+    int mMaxConnections;
+    
+    // Room events being published, reused every event loop iteration
+    std::vector<RoomEvent> mRoomEvents;
+    
+    // Encoded room events of a single room
+    std::vector<char> mRoomEventBuffer;
+    
+    // Subscribers to close once publishing is done
+    std::vector<int> mSlowSubscribers;
+    
+    // Clients that used up their budget and are waiting for another turn
+    std::vector<int> mReadyQueue;
+    
+    // Clients taking their turn from the ready queue, swapped with mReadyQueue before the poll events are handled,
+    // closed clients are replaced by -1
+    std::vector<int> mServingQueue;
+    
+    // Accept path statistics
+    AcceptStatistics mAcceptStatistics;
+    
+    // Room event push statistics
+    PushStatistics mPushStatistics;
+    
+    // Per connection budget statistics
+    SchedulingStatistics mSchedulingStatistics;
+    
+    // Event loop polling statistics
+    PollStatistics mPollStatistics;
     
-    // Mutex used for accessing clients
-    std::mutex mClientsMutex;
+    // Last time statistics were logged
+    std::chrono::steady_clock::time_point mLastStatisticsTime;
 };
@@ -0,0 +1,213 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+#include "TrafficCapture.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include "MonotonicClock.hpp"
+
+/**
+ * Write an integer as little endian
+ * @param buffer Destination
+ * @param value Value to write
+ * @param size Number of bytes to write
+ */
+static void writeLittleEndian(char* buffer, uint64_t value, int size)
+{
+    for (int index = 0; index < size; ++index) {
+        buffer[index] = static_cast<char>((value >> (8 * index)) & 0xFF);
+    }
+}
+
+/**
+ * Read a little endian integer
+ * @param buffer Source
+ * @param size Number of bytes to read
+ * @return Value read
+ */
+static uint64_t readLittleEndian(const char* buffer, int size)
+{
+    uint64_t value = 0;
+    for (int index = 0; index < size; ++index) {
+        value |= static_cast<uint64_t>(static_cast<unsigned char>(buffer[index])) << (8 * index);
+    }
+    return value;
+}
+
+TrafficCapture::TrafficCapture(const std::string& filePath, uint64_t maxBytes) :
+    mFile(fopen(filePath.c_str(), "wb")),
+    mStartMicroseconds(MonotonicClock::nowMicroseconds()),
+    mNextConnectionId(1),
+    mCapturedBytes(0),
+    mMaxBytes(maxBytes),
+    mLimitReached(false)
+{
+    if (mFile == nullptr) {
+        return;
+    }
+    
+    // Large buffer so that capturing rarely needs a write system call
+    setvbuf(mFile, nullptr, _IOFBF, 1 << 20);
+    
+    std::array<char, sizeof(CaptureFormat::CAPTURE_MAGIC) + sizeof(uint32_t)> header;
+    std::memcpy(header.data(), CaptureFormat::CAPTURE_MAGIC, sizeof(CaptureFormat::CAPTURE_MAGIC));
+    writeLittleEndian(header.data() + sizeof(CaptureFormat::CAPTURE_MAGIC), CaptureFormat::CAPTURE_VERSION, sizeof(uint32_t));
+    fwrite(header.data(), 1, header.size(), mFile);
+    mCapturedBytes += header.size();
+}
+
+TrafficCapture::~TrafficCapture()
+{
+    if (mFile != nullptr) {
+        fclose(mFile);
+    }
+}
+
+bool TrafficCapture::isOpen() const
+{
+    return mFile != nullptr;
+}
+
+uint32_t TrafficCapture::openConnection()
+{
+    uint32_t connectionId = mNextConnectionId++;
+    writeRecord(CaptureFormat::CONNECTION_OPEN, connectionId, nullptr, 0);
+    return connectionId;
+}
+
+void TrafficCapture::recordData(uint32_t connectionId, const char* data, int length)
+{
+    // Split anything that doesn't fit in the 16 bit payload length
+    while (length > 0) {
+        uint16_t recordLength = static_cast<uint16_t>(std::min(length, 0xFFFF));
+        writeRecord(CaptureFormat::CONNECTION_DATA, connectionId, data, recordLength);
+        data += recordLength;
+        length -= recordLength;
+    }
+}
+
+void TrafficCapture::recordCallback(uint32_t connectionId, uint16_t port, uint32_t roomNumber)
+{
+    char payload[sizeof(uint16_t) + sizeof(uint32_t)];
+    writeLittleEndian(payload, port, sizeof(uint16_t));
+    writeLittleEndian(payload + sizeof(uint16_t), roomNumber, sizeof(uint32_t));
+    writeRecord(CaptureFormat::CALLBACK_CONNECT, connectionId, payload, sizeof(payload));
+}
+
+void TrafficCapture::closeConnection(uint32_t connectionId)
+{
+    writeRecord(CaptureFormat::CONNECTION_CLOSE, connectionId, nullptr, 0);
+}
+
+void TrafficCapture::flush()
+{
+    if (mFile != nullptr) {
+        fflush(mFile);
+    }
+}
+
+uint64_t TrafficCapture::getCapturedBytes() const
+{
+    return mCapturedBytes;
+}
+
+bool TrafficCapture::hasReachedLimit() const
+{
+    return mLimitReached;
+}
+
+void TrafficCapture::writeRecord(CaptureFormat::RecordType type, uint32_t connectionId, const char* payload, uint16_t length)
+{
+    if (mFile == nullptr || mLimitReached) {
+        return;
+    }
+    
+    // Stop at the first record that doesn't fit so that the file only holds whole records
+    if (mCapturedBytes + CaptureFormat::RECORD_HEADER_SIZE + length > mMaxBytes) {
+        mLimitReached = true;
+        return;
+    }
+    
+    std::array<char, CaptureFormat::RECORD_HEADER_SIZE> header;
+    header[0] = static_cast<char>(type);
+    writeLittleEndian(header.data() + 1, connectionId, sizeof(uint32_t));
+    writeLittleEndian(header.data() + 5, MonotonicClock::nowMicroseconds() - mStartMicroseconds, sizeof(uint64_t));
+    writeLittleEndian(header.data() + 13, length, sizeof(uint16_t));
+    
+    fwrite(header.data(), 1, header.size(), mFile);
+    if (length > 0) {
+        fwrite(payload, 1, length, mFile);
+    }
+    mCapturedBytes += header.size() + length;
+}
+
+TrafficCaptureReader::TrafficCaptureReader(const std::string& filePath) :
+    mFile(fopen(filePath.c_str(), "rb")),
+    mValid(false)
+{
+    if (mFile == nullptr) {
+        return;
+    }
+    
+    std::array<char, sizeof(CaptureFormat::CAPTURE_MAGIC) + sizeof(uint32_t)> header;
+    if (fread(header.data(), 1, header.size(), mFile) != header.size()) {
+        return;
+    }
+    
+    mValid = std::memcmp(header.data(), CaptureFormat::CAPTURE_MAGIC, sizeof(CaptureFormat::CAPTURE_MAGIC)) == 0 &&
+        readLittleEndian(header.data() + sizeof(CaptureFormat::CAPTURE_MAGIC), sizeof(uint32_t)) == CaptureFormat::CAPTURE_VERSION;
+}
+
+TrafficCaptureReader::~TrafficCaptureReader()
+{
+    if (mFile != nullptr) {
+        fclose(mFile);
+    }
+}
+
+bool TrafficCaptureReader::isValid() const
+{
+    return mValid;
+}
+
+bool TrafficCaptureReader::next(CaptureRecord& record)
+{
+    if (!mValid) {
+        return false;
+    }
+    
+    std::array<char, CaptureFormat::RECORD_HEADER_SIZE> header;
+    if (fread(header.data(), 1, header.size(), mFile) != header.size()) {
+        return false;
+    }
+    
+    record.type = static_cast<CaptureFormat::RecordType>(header[0]);
+    record.connectionId = static_cast<uint32_t>(readLittleEndian(header.data() + 1, sizeof(uint32_t)));
+    record.timestampMicroseconds = readLittleEndian(header.data() + 5, sizeof(uint64_t));
+    
+    size_t length = static_cast<size_t>(readLittleEndian(header.data() + 13, sizeof(uint16_t)));
+    record.payload.resize(length);
+    
+    return length == 0 || fread(record.payload.data(), 1, length, mFile) == length;
+}
@@ -0,0 +1,225 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/**
+ * Capture file format shared by the server and the replay tool. A capture starts with
+ * CAPTURE_MAGIC and CAPTURE_VERSION, followed by records. Every record has a 15 byte header,
+ * all integers are little endian:
+ *   uint8  type
+ *   uint32 connection id
+ *   uint64 microseconds since the capture started
+ *   uint16 payload length
+ * followed by the payload.
+ */
+namespace CaptureFormat
+{
+    // Magic at the start of every capture file
+    static const char CAPTURE_MAGIC[4] = {'N', 'P', 'C', 'P'};
+    
+    // Version of the capture format
+    static const uint32_t CAPTURE_VERSION = 2;
+    
+    // Size of the record header
+    static const int RECORD_HEADER_SIZE = 15;
+    
+    // Record types
+    enum RecordType {
+        // A connection was accepted, no payload
+        CONNECTION_OPEN = 0,
+        // Bytes received on a connection
+        CONNECTION_DATA = 1,
+        // A connection was closed, no payload
+        CONNECTION_CLOSE = 2,
+        // The server connected back to the netplay server of a connection, payload is the uint16 port
+        // followed by the uint32 room number sent to it
+        CALLBACK_CONNECT = 3
+    };
+}
+
+/**
+ * A single record of a capture file
+ */
+struct CaptureRecord
+{
+    // Record type
+    CaptureFormat::RecordType type;
+    
+    // Connection the record belongs to
+    uint32_t connectionId;
+    
+    // Microseconds since the capture started
+    uint64_t timestampMicroseconds;
+    
+    // Record payload
+    std::vector<char> payload;
+};
+
+/**
+ * Records inbound protocol traffic of every connection to a capture file. Owned by the event loop
+ * thread. Writes are buffered and flushed with flush(), a full buffer is written by the event loop
+ * thread itself and blocks it for as long as the disk takes. Recording stops once the file reaches
+ * its maximum size.
+ */
+class TrafficCapture
+{
+public:
+    
+    /**
+     * Constructor
+     * @param filePath Path of the capture file, it's overwritten if it exists
+     * @param maxBytes Maximum size of the capture file, records that don't fit are dropped
+     */
+    TrafficCapture(const std::string& filePath, uint64_t maxBytes);
+    
+    /**
+     * Destructor, flushes and closes the file
+     */
+    ~TrafficCapture();
+    
+    TrafficCapture(const TrafficCapture&) = delete;
+    TrafficCapture& operator=(const TrafficCapture&) = delete;
+    
+    /**
+     * @return true if the capture file could be opened
+     */
+    bool isOpen() const;
+    
+    /**
+     * Record a new connection
+     * @return Id of the connection in the capture
+     */
+    uint32_t openConnection();
+    
+    /**
+     * Record received bytes
+     * @param connectionId Connection id
+     * @param data Received bytes
+     * @param length Number of received bytes
+     */
+    void recordData(uint32_t connectionId, const char* data, int length);
+    
+    /**
+     * Record that the server connected back to a netplay server
+     * @param connectionId Connection id
+     * @param port Port of the netplay server
+     * @param roomNumber Room number sent to the netplay server
+     */
+    void recordCallback(uint32_t connectionId, uint16_t port, uint32_t roomNumber);
+    
+    /**
+     * Record that a connection closed
+     * @param connectionId Connection id
+     */
+    void closeConnection(uint32_t connectionId);
+    
+    /**
+     * Write buffered records to the file
+     */
+    void flush();
+    
+    /**
+     * @return Number of bytes written to the capture so far
+     */
+    uint64_t getCapturedBytes() const;
+    
+    /**
+     * @return true once a record didn't fit in the maximum size, nothing is recorded after that
+     */
+    bool hasReachedLimit() const;
+	
+private:
+    
+    /**
+     * Write a record
+     * @param type Record type
+     * @param connectionId Connection id
+     * @param payload Record payload
+     * @param length Payload length
+     */
+    void writeRecord(CaptureFormat::RecordType type, uint32_t connectionId, const char* payload, uint16_t length);
+    
+    // Capture file
+    FILE* mFile;
+    
+    // Start time of the capture in microseconds
+    uint64_t mStartMicroseconds;
+    
+    // Next connection id
+    uint32_t mNextConnectionId;
+    
+    // Number of bytes written
+    uint64_t mCapturedBytes;
+    
+    // Maximum size of the capture file
+    uint64_t mMaxBytes;
+    
+    // True once the maximum size was reached
+    bool mLimitReached;
+};
+
+/**
+ * Reads records from a capture file
+ */
+class TrafficCaptureReader
+{
+public:
+    
+    /**
+     * Constructor
+     * @param filePath Path of the capture file
+     */
+    TrafficCaptureReader(const std::string& filePath);
+    
+    /**
+     * Destructor
+     */
+    ~TrafficCaptureReader();
+    
+    TrafficCaptureReader(const TrafficCaptureReader&) = delete;
+    TrafficCaptureReader& operator=(const TrafficCaptureReader&) = delete;
+    
+    /**
+     * @return true if the file was opened and has a valid header
+     */
+    bool isValid() const;
+    
+    /**
+     * Read the next record
+     * @param record Record read
+     * @return false at the end of the file or if the record is truncated
+     */
+    bool next(CaptureRecord& record);
+	
+private:
+    
+    // Capture file
+    FILE* mFile;
+    
+    // True if the header is valid
+    bool mValid;
+};
@@ -0,0 +1,96 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <cstddef>
+
+/**
+ * Byte stream transport used by the connection handlers. Every call mirrors the socket call it replaces:
+ * failures return -1 and set errno, and a transport that can't make progress fails with EWOULDBLOCK.
+ * Handles are file descriptors for kernel sockets, other transports give out their own handles.
+ */
+class Transport
+{
+public:
+    
+    virtual ~Transport() = default;
+    
+    /**
+     * Receive data, like readv()
+     * @param handle Connection to receive from
+     * @param segments Segments to fill in order
+     * @param numberOfSegments Number of segments
+     * @return Number of bytes received, 0 if the peer closed the connection, -1 on failure
+     */
+    virtual ssize_t receive(int handle, const iovec* segments, int numberOfSegments) = 0;
+    
+    /**
+     * Send data, like send()
+     * @param handle Connection to send on
+     * @param data Data to send
+     * @param length Length of the data
+     * @return Number of bytes sent, which can be less than length, -1 on failure
+     */
+    virtual ssize_t send(int handle, const char* data, size_t length) = 0;
+    
+    /**
+     * Start a nonblocking connection, like socket() followed by connect(). The handle becomes writable
+     * once the connection completes or fails, getConnectError() tells which.
+     * @param address Address to connect to
+     * @return Handle of the new connection, -1 on failure
+     */
+    virtual int connect(const sockaddr_in6& address) = 0;
+    
+    /**
+     * Get the result of a connection started with connect()
+     * @param handle Connection returned by connect()
+     * @return 0 if connected, the errno value of the failure otherwise
+     */
+    virtual int getConnectError(int handle) = 0;
+    
+    /**
+     * Get the address of the peer, like getpeername()
+     * @param handle Connection
+     * @param address Address of the peer
+     * @return true on success
+     */
+    virtual bool getPeerAddress(int handle, sockaddr_in6& address) = 0;
+    
+    /**
+     * Get the local address, like getsockname()
+     * @param handle Connection
+     * @param address Local address
+     * @return true on success
+     */
+    virtual bool getLocalAddress(int handle, sockaddr_in6& address) = 0;
+    
+    /**
+     * Close a connection
+     * @param handle Connection to close
+     */
+    virtual void close(int handle) = 0;
+};
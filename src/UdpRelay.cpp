@@ -0,0 +1,595 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+#include "UdpRelay.hpp"
+
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "spdlog/spdlog.h"
+
+#include "Protocol.hpp"
+#include "RingBuffer.hpp"
+
+/**
+ * @return CPU time used by the calling thread, in nanoseconds
+ */
+static uint64_t getThreadCpuNanoseconds()
+{
+    timespec time;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return static_cast<uint64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+/**
+ * Compare the address and port of two IPv6 socket addresses
+ * @return true if both are the same endpoint
+ */
+static bool isSameEndpoint(const sockaddr_in6& first, const sockaddr_in6& second)
+{
+    return first.sin6_port == second.sin6_port &&
+        std::memcmp(&first.sin6_addr, &second.sin6_addr, sizeof(in6_addr)) == 0;
+}
+
+UdpRelay::UdpRelay(int firstPort, int portCount, const std::string& publicAddress, int statsIntervalSeconds) :
+    mFirstPort(firstPort),
+    mPublicAddress(publicAddress),
+    mStatsIntervalSeconds(statsIntervalSeconds),
+    mSessions(portCount),
+    mTokenGenerator(std::random_device()()),
+    mStopRequested(false),
+    mReceiveMessages{},
+    mReceiveBuffers(BATCH_SIZE * MAX_DATAGRAM_SIZE),
+    mSendMessages{},
+    mSendCount(0),
+    mBatchCalls(0),
+    mLastCpuNanoseconds(0)
+{
+    // Hand out the lowest ports first
+    mFreeSessions.reserve(portCount);
+    for (int sessionIndex = portCount - 1; sessionIndex >= 0; --sessionIndex) {
+        mSessions[sessionIndex].port = static_cast<uint16_t>(firstPort + sessionIndex);
+        mFreeSessions.push_back(sessionIndex);
+    }
+    
+    // The receive batch always points to the same buffers, only the address length is reset before every call
+    for (uint32_t messageIndex = 0; messageIndex < BATCH_SIZE; ++messageIndex) {
+        mReceiveSegments[messageIndex].iov_base = &mReceiveBuffers[messageIndex * MAX_DATAGRAM_SIZE];
+        mReceiveSegments[messageIndex].iov_len = MAX_DATAGRAM_SIZE;
+        mReceiveMessages[messageIndex].msg_hdr.msg_name = &mReceiveAddresses[messageIndex];
+        mReceiveMessages[messageIndex].msg_hdr.msg_iov = &mReceiveSegments[messageIndex];
+        mReceiveMessages[messageIndex].msg_hdr.msg_iovlen = 1;
+        
+        mSendMessages[messageIndex].msg_hdr.msg_name = &mSendAddresses[messageIndex];
+        mSendMessages[messageIndex].msg_hdr.msg_namelen = sizeof(sockaddr_in6);
+        mSendMessages[messageIndex].msg_hdr.msg_iov = &mSendSegments[messageIndex * 2];
+    }
+    
+    mWakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mWakeupFd < 0)
+    {
+        SPDLOG_ERROR("eventfd() failed, errno={}", errno);
+    }
+}
+
+UdpRelay::~UdpRelay()
+{
+    stop();
+    
+    for (RelaySession& session : mSessions) {
+        if (session.socketHandle >= 0) {
+            close(session.socketHandle);
+        }
+    }
+    
+    if (mWakeupFd >= 0)
+    {
+        close(mWakeupFd);
+    }
+}
+
+bool UdpRelay::start()
+{
+    if (mWakeupFd < 0) {
+        return false;
+    }
+    
+    for (RelaySession& session : mSessions) {
+        session.socketHandle = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (session.socketHandle < 0) {
+            SPDLOG_ERROR("socket() failed for relay port {}, errno={}", session.port, errno);
+            return false;
+        }
+        
+        // Accept IPv4 joiners as mapped addresses
+        int off = 0;
+        setsockopt(session.socketHandle, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        
+        sockaddr_in6 address = {};
+        address.sin6_family = AF_INET6;
+        address.sin6_addr = in6addr_any;
+        address.sin6_port = htons(session.port);
+        
+        if (bind(session.socketHandle, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+            SPDLOG_ERROR("bind() failed on relay port {}, errno={}", session.port, errno);
+            return false;
+        }
+    }
+    
+    SPDLOG_INFO("Relaying UDP on ports {}-{}", mFirstPort, mFirstPort + static_cast<int>(mSessions.size()) - 1);
+    
+    mThread = std::thread(&UdpRelay::run, this);
+    return true;
+}
+
+void UdpRelay::stop()
+{
+    if (!mThread.joinable()) {
+        return;
+    }
+    
+    mStopRequested.store(true, std::memory_order_release);
+    uint64_t value = 1;
+    ssize_t result = write(mWakeupFd, &value, sizeof(value));
+    (void)result;
+    
+    mThread.join();
+}
+
+bool UdpRelay::reserveSession(uint16_t& relayPort)
+{
+    uint32_t sessionIndex;
+    while (mClosedSessions.pop(sessionIndex)) {
+        mFreeSessions.push_back(sessionIndex);
+    }
+    
+    if (mFreeSessions.empty()) {
+        return false;
+    }
+    
+    // Ports never change after construction, so reading them from any thread is safe
+    relayPort = mSessions[mFreeSessions.back()].port;
+    mFreeSessions.pop_back();
+    return true;
+}
+
+uint32_t UdpRelay::openSession(uint16_t relayPort, uint32_t roomNumber)
+{
+    SessionRequest request;
+    request.type = SessionRequest::OPEN;
+    request.sessionIndex = relayPort - mFirstPort;
+    request.roomNumber = roomNumber;
+    request.token = mTokenGenerator();
+    
+    pushSessionRequest(request);
+    return request.token;
+}
+
+void UdpRelay::closeSession(uint16_t relayPort)
+{
+    SessionRequest request;
+    request.type = SessionRequest::CLOSE;
+    request.sessionIndex = relayPort - mFirstPort;
+    pushSessionRequest(request);
+}
+
+void UdpRelay::releaseSessionWhenIdle(uint16_t relayPort)
+{
+    SessionRequest request;
+    request.type = SessionRequest::RELEASE_WHEN_IDLE;
+    request.sessionIndex = relayPort - mFirstPort;
+    pushSessionRequest(request);
+}
+
+void UdpRelay::pushSessionRequest(const SessionRequest& request)
+{
+    // Requests of a session are handled in order, so a close never overtakes the open it belongs to
+    mSessionRequests.push(request);
+    
+    uint64_t value = 1;
+    ssize_t result = write(mWakeupFd, &value, sizeof(value));
+    (void)result;
+}
+
+const std::string& UdpRelay::getPublicAddress() const
+{
+    return mPublicAddress;
+}
+
+void UdpRelay::run()
+{
+    // The first poll entry is the wakeup event, followed by the socket of every open session
+    std::vector<pollfd> pollFds;
+    std::vector<uint32_t> pollSessions;
+    rebuildPollSet(pollFds, pollSessions);
+    
+    auto lastIdleCheck = std::chrono::steady_clock::now();
+    mLastStatisticsTime = lastIdleCheck;
+    mLastCpuNanoseconds = getThreadCpuNanoseconds();
+    
+    while (!mStopRequested.load(std::memory_order_acquire)) {
+        int pollReturn = poll(pollFds.data(), pollFds.size(), 1000);
+        
+        if (pollReturn < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            
+            SPDLOG_ERROR("Relay poll() failed, errno={}", errno);
+            break;
+        }
+        
+        bool sessionsChanged = false;
+        
+        if (pollFds[0].revents != 0) {
+            uint64_t value = 0;
+            if (read(mWakeupFd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                SPDLOG_ERROR("Unable to read relay wakeup event, errno={}", errno);
+            }
+            
+            sessionsChanged = processSessionRequests();
+        }
+        
+        for (size_t pollIndex = 1; pollIndex < pollFds.size(); ++pollIndex) {
+            if (pollFds[pollIndex].revents != 0) {
+                relaySession(mSessions[pollSessions[pollIndex]]);
+            }
+        }
+        
+        auto now = std::chrono::steady_clock::now();
+        if (now - lastIdleCheck >= std::chrono::seconds(1)) {
+            lastIdleCheck = now;
+            sessionsChanged = closeIdleSessions(now) || sessionsChanged;
+        }
+        
+        if (sessionsChanged) {
+            rebuildPollSet(pollFds, pollSessions);
+        }
+        
+        logStatisticsIfNeeded();
+    }
+}
+
+bool UdpRelay::processSessionRequests()
+{
+    bool sessionsChanged = false;
+    
+    SessionRequest request;
+    while (mSessionRequests.pop(request)) {
+        RelaySession& session = mSessions[request.sessionIndex];
+        
+        switch (request.type) {
+            case SessionRequest::OPEN:
+                session.active = true;
+                session.hostBound = false;
+                session.roomOpen = true;
+                session.roomNumber = request.roomNumber;
+                session.token = request.token;
+                session.peers = {};
+                session.counters = RelayCounters();
+                session.lastActivity = std::chrono::steady_clock::now();
+                sessionsChanged = true;
+                
+                SPDLOG_INFO("Opened relay session for room {} on port {}", session.roomNumber, session.port);
+                break;
+            case SessionRequest::CLOSE:
+                if (session.active) {
+                    deactivateSession(request.sessionIndex, "removed");
+                    sessionsChanged = true;
+                }
+                break;
+            case SessionRequest::RELEASE_WHEN_IDLE:
+                // The idle time counts from the start of the game
+                session.roomOpen = false;
+                session.lastActivity = std::chrono::steady_clock::now();
+                break;
+        }
+    }
+    
+    return sessionsChanged;
+}
+
+void UdpRelay::rebuildPollSet(std::vector<pollfd>& pollFds, std::vector<uint32_t>& pollSessions) const
+{
+    pollFds.clear();
+    pollSessions.clear();
+    
+    pollFds.push_back({mWakeupFd, POLLIN, 0});
+    pollSessions.push_back(0);
+    
+    for (uint32_t sessionIndex = 0; sessionIndex < mSessions.size(); ++sessionIndex) {
+        if (mSessions[sessionIndex].active) {
+            pollFds.push_back({mSessions[sessionIndex].socketHandle, POLLIN, 0});
+            pollSessions.push_back(sessionIndex);
+        }
+    }
+}
+
+bool UdpRelay::closeIdleSessions(std::chrono::steady_clock::time_point now)
+{
+    bool closedSession = false;
+    
+    for (uint32_t sessionIndex = 0; sessionIndex < mSessions.size(); ++sessionIndex) {
+        // Joiners are still sent to the port of an open room, so only sessions of started games are reclaimed
+        const RelaySession& session = mSessions[sessionIndex];
+        if (!session.active || session.roomOpen ||
+            now - session.lastActivity < std::chrono::seconds(SESSION_IDLE_TIMEOUT_SECONDS)) {
+            continue;
+        }
+        
+        deactivateSession(sessionIndex, "idle");
+        closedSession = true;
+    }
+    
+    return closedSession;
+}
+
+void UdpRelay::deactivateSession(uint32_t sessionIndex, const char* reason)
+{
+    RelaySession& session = mSessions[sessionIndex];
+    
+    const RelayCounters& counters = session.counters;
+    SPDLOG_INFO("Closed {} relay session for room {} on port {}: host_packets={}, host_bytes={}, peer_packets={}, "
+        "peer_bytes={}, forwarded={}, dropped={}", reason, session.roomNumber, session.port, counters.hostPackets,
+        counters.hostBytes, counters.peerPackets, counters.peerBytes, counters.forwardedPackets, counters.droppedPackets);
+    
+    session.active = false;
+    session.roomOpen = false;
+    
+    // Discard anything that is still queued, the host of the next session may bind before it is activated
+    while (recv(session.socketHandle, mReceiveBuffers.data(), MAX_DATAGRAM_SIZE, MSG_DONTWAIT) >= 0) {
+    }
+    
+    mClosedSessions.push(sessionIndex);
+}
+
+void UdpRelay::relaySession(RelaySession& session)
+{
+    for (int batch = 0; batch < MAX_BATCHES_PER_WAKEUP; ++batch) {
+        for (uint32_t messageIndex = 0; messageIndex < BATCH_SIZE; ++messageIndex) {
+            mReceiveMessages[messageIndex].msg_hdr.msg_namelen = sizeof(sockaddr_in6);
+        }
+        
+        int received = recvmmsg(session.socketHandle, mReceiveMessages.data(), BATCH_SIZE, MSG_DONTWAIT, nullptr);
+        ++mBatchCalls;
+        
+        if (received <= 0) {
+            if (received < 0 && errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) {
+                SPDLOG_ERROR("recvmmsg() failed on relay port {}, errno={}", session.port, errno);
+            }
+            break;
+        }
+        
+        session.lastActivity = std::chrono::steady_clock::now();
+        
+        for (int messageIndex = 0; messageIndex < received; ++messageIndex) {
+            const mmsghdr& message = mReceiveMessages[messageIndex];
+            
+            if ((message.msg_hdr.msg_flags & MSG_TRUNC) != 0) {
+                ++session.counters.droppedPackets;
+                ++mTotals.droppedPackets;
+                continue;
+            }
+            
+            routeDatagram(session, messageIndex, message.msg_len);
+        }
+        
+        flushSendBatch(session);
+        
+        if (received < static_cast<int>(BATCH_SIZE)) {
+            break;
+        }
+    }
+}
+
+void UdpRelay::routeDatagram(RelaySession& session, uint32_t messageIndex, uint32_t length)
+{
+    char* data = &mReceiveBuffers[messageIndex * MAX_DATAGRAM_SIZE];
+    const sockaddr_in6& source = mReceiveAddresses[messageIndex];
+    FrameView datagram(data, length, nullptr, 0);
+    
+    bool fromHost = session.hostBound && isSameEndpoint(source, session.hostAddress);
+    
+    // The host binds, or rebinds after its NAT mapping changed, by presenting its token
+    if (length == Protocol::RelayBind::SIZE && datagram.readUint32(0) == Protocol::RELAY_BIND_PEER_ID) {
+        auto [token] = Protocol::RelayBind::decode(datagram);
+        if (token == session.token) {
+            if (!fromHost) {
+                char ipAddress[INET6_ADDRSTRLEN];
+                inet_ntop(AF_INET6, &source.sin6_addr, ipAddress, sizeof(ipAddress));
+                SPDLOG_INFO("Host of room {} bound to relay port {} from {}:{}", session.roomNumber, session.port,
+                    ipAddress, ntohs(source.sin6_port));
+            }
+            
+            session.hostAddress = source;
+            session.hostBound = true;
+            ++session.counters.hostPackets;
+            ++mTotals.hostPackets;
+            session.counters.hostBytes += length;
+            mTotals.hostBytes += length;
+            return;
+        }
+    }
+    
+    mmsghdr& sendMessage = mSendMessages[mSendCount];
+    iovec* sendSegments = sendMessage.msg_hdr.msg_iov;
+    
+    if (fromHost) {
+        ++session.counters.hostPackets;
+        ++mTotals.hostPackets;
+        session.counters.hostBytes += length;
+        mTotals.hostBytes += length;
+        
+        uint32_t peerId = length < Protocol::RELAY_PEER_HEADER_SIZE ? Protocol::RELAY_BIND_PEER_ID : datagram.readUint32(0);
+        if (peerId == Protocol::RELAY_BIND_PEER_ID || peerId > MAX_PEERS_PER_SESSION || !session.peers[peerId - 1].active) {
+            ++session.counters.droppedPackets;
+            ++mTotals.droppedPackets;
+            return;
+        }
+        
+        // Answering a joiner shows it's a real one, it keeps its peer id from now on
+        session.peers[peerId - 1].acknowledged = true;
+        
+        // Strip the peer id
+        mSendAddresses[mSendCount] = session.peers[peerId - 1].address;
+        sendSegments[0].iov_base = data + Protocol::RELAY_PEER_HEADER_SIZE;
+        sendSegments[0].iov_len = length - Protocol::RELAY_PEER_HEADER_SIZE;
+        sendMessage.msg_hdr.msg_iovlen = 1;
+    } else {
+        ++session.counters.peerPackets;
+        ++mTotals.peerPackets;
+        session.counters.peerBytes += length;
+        mTotals.peerBytes += length;
+        
+        // The batch was received just now
+        auto now = session.lastActivity;
+        
+        // Find the joiner, or give it the first free peer id. Without a free one, the peer id of a joiner the host
+        // never answered or that went idle is reused, so stray senders can't lock joiners out of the room.
+        uint32_t peerIndex = MAX_PEERS_PER_SESSION;
+        uint32_t freeIndex = MAX_PEERS_PER_SESSION;
+        uint32_t reclaimableIndex = MAX_PEERS_PER_SESSION;
+        for (uint32_t index = 0; index < MAX_PEERS_PER_SESSION; ++index) {
+            const RelayPeer& peer = session.peers[index];
+            if (peer.active && isSameEndpoint(peer.address, source)) {
+                peerIndex = index;
+                break;
+            }
+            if (!peer.active && freeIndex == MAX_PEERS_PER_SESSION) {
+                freeIndex = index;
+            }
+            if (peer.active && reclaimableIndex == MAX_PEERS_PER_SESSION && isPeerReclaimable(peer, now)) {
+                reclaimableIndex = index;
+            }
+        }
+        
+        if (freeIndex == MAX_PEERS_PER_SESSION) {
+            freeIndex = reclaimableIndex;
+        }
+        
+        if (!session.hostBound || (peerIndex == MAX_PEERS_PER_SESSION && freeIndex == MAX_PEERS_PER_SESSION)) {
+            ++session.counters.droppedPackets;
+            ++mTotals.droppedPackets;
+            return;
+        }
+        
+        if (peerIndex == MAX_PEERS_PER_SESSION) {
+            peerIndex = freeIndex;
+            RelayPeer& peer = session.peers[peerIndex];
+            peer.address = source;
+            peer.active = true;
+            peer.acknowledged = false;
+            peer.admitted = now;
+        }
+        session.peers[peerIndex].lastActivity = now;
+        
+        // Prefix the payload with the peer id, without copying it
+        mSendPeerHeaders[mSendCount] = htonl(peerIndex + 1);
+        mSendAddresses[mSendCount] = session.hostAddress;
+        sendSegments[0].iov_base = &mSendPeerHeaders[mSendCount];
+        sendSegments[0].iov_len = Protocol::RELAY_PEER_HEADER_SIZE;
+        sendSegments[1].iov_base = data;
+        sendSegments[1].iov_len = length;
+        sendMessage.msg_hdr.msg_iovlen = 2;
+    }
+    
+    ++mSendCount;
+}
+
+bool UdpRelay::isPeerReclaimable(const RelayPeer& peer, std::chrono::steady_clock::time_point now)
+{
+    if (!peer.acknowledged) {
+        return now - peer.admitted >= std::chrono::seconds(PEER_ACKNOWLEDGE_TIMEOUT_SECONDS);
+    }
+    return now - peer.lastActivity >= std::chrono::seconds(SESSION_IDLE_TIMEOUT_SECONDS);
+}
+
+void UdpRelay::flushSendBatch(RelaySession& session)
+{
+    uint32_t sentCount = 0;
+    uint64_t droppedCount = 0;
+    
+    while (sentCount < mSendCount) {
+        int sent = sendmmsg(session.socketHandle, &mSendMessages[sentCount], mSendCount - sentCount, MSG_DONTWAIT);
+        ++mBatchCalls;
+        
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            
+            // The socket buffer is full, UDP is lossy anyway so the rest of the batch is dropped
+            if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                droppedCount += mSendCount - sentCount;
+                break;
+            }
+            
+            // Only the first datagram failed, for example because of an ICMP error from a joiner that left
+            ++droppedCount;
+            ++sentCount;
+            continue;
+        }
+        
+        session.counters.forwardedPackets += sent;
+        mTotals.forwardedPackets += sent;
+        sentCount += sent;
+    }
+    
+    session.counters.droppedPackets += droppedCount;
+    mTotals.droppedPackets += droppedCount;
+    mSendCount = 0;
+}
+
+void UdpRelay::logStatisticsIfNeeded()
+{
+    auto now = std::chrono::steady_clock::now();
+    if (now - mLastStatisticsTime < std::chrono::seconds(mStatsIntervalSeconds)) {
+        return;
+    }
+    
+    double elapsedSeconds = std::chrono::duration<double>(now - mLastStatisticsTime).count();
+    uint64_t cpuNanoseconds = getThreadCpuNanoseconds();
+    double cpuSeconds = (cpuNanoseconds - mLastCpuNanoseconds) / 1e9;
+    
+    uint64_t packets = mTotals.hostPackets + mTotals.peerPackets - mLastTotals.hostPackets - mLastTotals.peerPackets;
+    uint64_t forwarded = mTotals.forwardedPackets - mLastTotals.forwardedPackets;
+    
+    size_t activeSessions = 0;
+    for (const RelaySession& session : mSessions) {
+        activeSessions += session.active ? 1 : 0;
+    }
+    
+    // Packets per CPU second is the throughput of one fully busy core
+    SPDLOG_INFO("Relay statistics: sessions={}, host_packets={}, host_bytes={}, peer_packets={}, peer_bytes={}, "
+        "forwarded={}, dropped={}, batch_calls={}, packets_per_second={:.0f}, forwarded_per_cpu_second={:.0f}",
+        activeSessions, mTotals.hostPackets, mTotals.hostBytes, mTotals.peerPackets, mTotals.peerBytes,
+        mTotals.forwardedPackets, mTotals.droppedPackets, mBatchCalls, packets / elapsedSeconds,
+        cpuSeconds > 0 ? forwarded / cpuSeconds : 0.0);
+    
+    mLastStatisticsTime = now;
+    mLastCpuNanoseconds = cpuNanoseconds;
+    mLastTotals = mTotals;
+}
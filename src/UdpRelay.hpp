@@ -0,0 +1,382 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "MpscQueue.hpp"
+
+/**
+ * Relays netplay UDP traffic for hosts that can't accept inbound connections. Every relay session owns
+ * one UDP port. The host binds to its session by sending a RelayBind datagram with the session token,
+ * after that, datagrams from any other address are joiners. Datagrams from a joiner are forwarded to
+ * the host prefixed with a uint32 peer id, datagrams from the host start with the peer id of the joiner
+ * they are for, which is stripped before forwarding.
+ *
+ * Forwarding runs on its own thread. Sessions are opened, closed and released from the event loop thread,
+ * which owns the free ports, the relay thread hands the ports of sessions it closed back through a queue. A session lives as long as its room: closeSession() frees the port of a room that was
+ * removed before its game started, releaseSessionWhenIdle() keeps relaying the game of a started room and
+ * frees the port once the session has been idle for SESSION_IDLE_TIMEOUT_SECONDS.
+ */
+class UdpRelay
+{
+public:
+    
+    // Largest datagram that is relayed, larger datagrams are truncated by the kernel and dropped
+    static const uint32_t MAX_DATAGRAM_SIZE = 2048;
+    
+    // Number of datagrams received or sent per recvmmsg/sendmmsg call
+    static const uint32_t BATCH_SIZE = 64;
+    
+    // Maximum number of joiners per session
+    static const uint32_t MAX_PEERS_PER_SESSION = 16;
+    
+    // A joiner the host hasn't sent anything to this long after it arrived gives up its peer id to the next joiner
+    static constexpr int PEER_ACKNOWLEDGE_TIMEOUT_SECONDS = 5;
+    
+    // Sessions of started games without traffic for this long are closed and their port is reused
+    static constexpr int SESSION_IDLE_TIMEOUT_SECONDS = 60;
+    
+    /**
+     * Constructor
+     * @param firstPort First UDP port used by sessions
+     * @param portCount Number of UDP ports, which is the maximum number of sessions
+     * @param publicAddress Address handed out to joiners, empty to use the address the host connected to
+     * @param statsIntervalSeconds Interval between statistics log entries
+     */
+    UdpRelay(int firstPort, int portCount, const std::string& publicAddress, int statsIntervalSeconds);
+    
+    UdpRelay(const UdpRelay&) = delete;
+    UdpRelay& operator=(const UdpRelay&) = delete;
+    
+    /**
+     * Destructor, stops the relay thread and closes all ports
+     */
+    ~UdpRelay();
+    
+    /**
+     * Bind all relay ports and start the relay thread
+     * @return true on success
+     */
+    bool start();
+    
+    /**
+     * Stop the relay thread
+     */
+    void stop();
+    
+    /**
+     * Reserve the port of a relay session, must only be called from the event loop thread
+     * @param relayPort Reserved port
+     * @return false if there is no free port
+     */
+    bool reserveSession(uint16_t& relayPort);
+    
+    /**
+     * Open a relay session on a reserved port, must only be called from the event loop thread
+     * @param relayPort Port returned by reserveSession()
+     * @param roomNumber Room the session belongs to
+     * @return Token the host must send in its RelayBind datagram
+     */
+    uint32_t openSession(uint16_t relayPort, uint32_t roomNumber);
+    
+    /**
+     * Close the session of a room that was removed, its port can be reused right away. Must only be called from the event loop
+     * thread.
+     * @param relayPort Port of the session
+     */
+    void closeSession(uint16_t relayPort);
+    
+    /**
+     * Keep relaying the game of a room that was removed because its game started, the session is closed once
+     * it has been idle for SESSION_IDLE_TIMEOUT_SECONDS. Must only be called from the event loop thread.
+     * @param relayPort Port of the session
+     */
+    void releaseSessionWhenIdle(uint16_t relayPort);
+    
+    /**
+     * @return Address handed out to joiners, empty if the address the host connected to is used
+     */
+    const std::string& getPublicAddress() const;
+    
+private:
+    
+    /**
+     * Packet and byte accounting
+     */
+    struct RelayCounters
+    {
+        // Datagrams received from the host
+        uint64_t hostPackets = 0;
+        
+        // Bytes received from the host
+        uint64_t hostBytes = 0;
+        
+        // Datagrams received from joiners
+        uint64_t peerPackets = 0;
+        
+        // Bytes received from joiners
+        uint64_t peerBytes = 0;
+        
+        // Datagrams forwarded
+        uint64_t forwardedPackets = 0;
+        
+        // Datagrams dropped: unknown peer, no host yet, too many joiners or a full socket buffer
+        uint64_t droppedPackets = 0;
+    };
+    
+    /**
+     * A joiner of a session
+     */
+    struct RelayPeer
+    {
+        // Address of the joiner
+        sockaddr_in6 address;
+        
+        // True if this entry is used
+        bool active = false;
+        
+        // True once the host sent a datagram to this joiner
+        bool acknowledged = false;
+        
+        // Time the joiner got its peer id
+        std::chrono::steady_clock::time_point admitted;
+        
+        // Last time a datagram was received from the joiner
+        std::chrono::steady_clock::time_point lastActivity;
+    };
+    
+    /**
+     * A relay session, one per port
+     */
+    struct RelaySession
+    {
+        // UDP socket bound to the session port
+        int socketHandle = -1;
+        
+        // Session port
+        uint16_t port = 0;
+        
+        // True while the session is open
+        bool active = false;
+        
+        // True once the host has bound to the session
+        bool hostBound = false;
+        
+        // True while the room of the session exists, the session is never closed for being idle then
+        bool roomOpen = false;
+        
+        // Room the session belongs to
+        uint32_t roomNumber = 0;
+        
+        // Token the host must present
+        uint32_t token = 0;
+        
+        // Address of the host
+        sockaddr_in6 hostAddress;
+        
+        // Joiners, the peer id is the index plus one
+        std::array<RelayPeer, MAX_PEERS_PER_SESSION> peers;
+        
+        // Last time a datagram was received
+        std::chrono::steady_clock::time_point lastActivity;
+        
+        // Session accounting
+        RelayCounters counters;
+    };
+    
+    /**
+     * Request to open or close a session, sent to the relay thread
+     */
+    struct SessionRequest
+    {
+        // Request types
+        enum Type {
+            // Open the session for a new room
+            OPEN,
+            // The room was removed, close the session
+            CLOSE,
+            // The game of the room started, close the session once it's idle
+            RELEASE_WHEN_IDLE
+        };
+        
+        // Request type
+        Type type = OPEN;
+        
+        // Index of the session
+        uint32_t sessionIndex = 0;
+        
+        // Room the session belongs to
+        uint32_t roomNumber = 0;
+        
+        // Host token
+        uint32_t token = 0;
+    };
+    
+    // Maximum number of receive batches handled per session before polling the other sessions again
+    static const int MAX_BATCHES_PER_WAKEUP = 4;
+    
+    /**
+     * Relay thread main loop
+     */
+    void run();
+    
+    /**
+     * Open and close sessions as requested by other threads
+     * @return true if a session was opened or closed
+     */
+    bool processSessionRequests();
+    
+    /**
+     * Queue a session request and wake up the relay thread
+     * @param request Request to queue
+     */
+    void pushSessionRequest(const SessionRequest& request);
+    
+    /**
+     * Rebuild the poll set after sessions were opened or closed
+     * @param pollFds Poll set to rebuild
+     * @param pollSessions Session index of every poll entry
+     */
+    void rebuildPollSet(std::vector<pollfd>& pollFds, std::vector<uint32_t>& pollSessions) const;
+    
+    /**
+     * Close sessions of started games that have been idle for too long
+     * @param now Current time
+     * @return true if a session was closed
+     */
+    bool closeIdleSessions(std::chrono::steady_clock::time_point now);
+    
+    /**
+     * Close a session and hand its port back to the event loop thread
+     * @param sessionIndex Index of the session
+     * @param reason Why the session is closed, for the log
+     */
+    void deactivateSession(uint32_t sessionIndex, const char* reason);
+    
+    /**
+     * Receive and forward datagrams of a session until its socket is drained
+     * @param session Session with a readable socket
+     */
+    void relaySession(RelaySession& session);
+    
+    /**
+     * Queue a datagram received by a session for forwarding
+     * @param session Session that received the datagram
+     * @param messageIndex Index of the datagram in the receive batch
+     * @param length Length of the datagram
+     */
+    void routeDatagram(RelaySession& session, uint32_t messageIndex, uint32_t length);
+    
+    /**
+     * Check if the peer id of a joiner can be given to a new joiner: the host never acknowledged it within
+     * PEER_ACKNOWLEDGE_TIMEOUT_SECONDS, or it has been idle for SESSION_IDLE_TIMEOUT_SECONDS
+     * @param peer Joiner
+     * @param now Current time
+     * @return true if the peer id can be reused
+     */
+    static bool isPeerReclaimable(const RelayPeer& peer, std::chrono::steady_clock::time_point now);
+    
+    /**
+     * Send all queued datagrams of a session
+     * @param session Session to send from
+     */
+    void flushSendBatch(RelaySession& session);
+    
+    /**
+     * Log relay statistics if the statistics interval has expired
+     */
+    void logStatisticsIfNeeded();
+    
+    // First UDP port
+    int mFirstPort;
+    
+    // Address handed out to joiners
+    std::string mPublicAddress;
+    
+    // Interval between statistics log entries
+    int mStatsIntervalSeconds;
+    
+    // One session per port
+    std::vector<RelaySession> mSessions;
+    
+    // Indexes of sessions that can be opened, only used by the event loop thread
+    std::vector<uint32_t> mFreeSessions;
+    
+    // Indexes of sessions closed by the relay thread, moved to mFreeSessions by the event loop thread
+    MpscQueue<uint32_t> mClosedSessions;
+    
+    // Generates host tokens, only used by the event loop thread
+    std::mt19937 mTokenGenerator;
+    
+    // Sessions opened or closed by other threads, waiting to be handled by the relay thread
+    MpscQueue<SessionRequest> mSessionRequests;
+    
+    // Event file descriptor used to wake up the relay thread
+    int mWakeupFd;
+    
+    // True if the relay thread was asked to stop
+    std::atomic<bool> mStopRequested;
+    
+    // Relay thread
+    std::thread mThread;
+    
+    // Receive batch, preallocated so the data path never allocates
+    std::array<mmsghdr, BATCH_SIZE> mReceiveMessages;
+    std::array<iovec, BATCH_SIZE> mReceiveSegments;
+    std::array<sockaddr_in6, BATCH_SIZE> mReceiveAddresses;
+    std::vector<char> mReceiveBuffers;
+    
+    // Send batch, datagrams to the host are sent from two segments: the peer id header and the payload
+    std::array<mmsghdr, BATCH_SIZE> mSendMessages;
+    std::array<iovec, BATCH_SIZE * 2> mSendSegments;
+    std::array<sockaddr_in6, BATCH_SIZE> mSendAddresses;
+    std::array<uint32_t, BATCH_SIZE> mSendPeerHeaders;
+    
+    // Number of datagrams in the send batch
+    uint32_t mSendCount;
+    
+    // Totals of all sessions
+    RelayCounters mTotals;
+    
+    // Number of recvmmsg and sendmmsg calls
+    uint64_t mBatchCalls;
+    
+    // Last time statistics were logged
+    std::chrono::steady_clock::time_point mLastStatisticsTime;
+    
+    // Totals and thread CPU time at the last statistics log entry
+    RelayCounters mLastTotals;
+    uint64_t mLastCpuNanoseconds;
+};
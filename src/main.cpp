@@ -19,6 +19,7 @@
  * Authors: fzurita
  */
 
+#include <signal.h>
 #include <unistd.h>
 
 #include <iostream>
@@ -32,8 +33,32 @@
 #include "spdlog/async.h"
 
 #include "RoomManager.hpp"
+#include "ServerConfig.hpp"
 #include "TcpSocketHandler.hpp"
 
+// Socket handler that signals are forwarded to
+static TcpSocketHandler* gSocketHandler = nullptr;
+
+/**
+ * Writes request traces to the log when SIGUSR1 is received
+ */
+void handleTraceDumpSignal(int)
+{
+    if (gSocketHandler != nullptr) {
+        gSocketHandler->requestTraceDump();
+    }
+}
+
+/**
+ * Stops the server when SIGINT or SIGTERM is received
+ */
+void handleStopSignal(int)
+{
+    if (gSocketHandler != nullptr) {
+        gSocketHandler->stopServer();
+    }
+}
+
 void setupLogging()
 {
     spdlog::init_thread_pool(8192, 1);
@@ -66,38 +91,27 @@ int main(int argc, char *argv[])
     SPDLOG_INFO("Netplay room manager started");
     
     RoomManager roomManager;
+    ServerConfig config;
     
-    int port = 37520;
-    
-    // Try to parse port number
-    if (argc > 1) {
-        port = -1;
+    if (parseServerConfig(argc, argv, config)) {
+        std::cout << "Server started on port " << config.portNumber << std::endl;
+        TcpSocketHandler socketHandler(roomManager, config);
         
-        try {
-            std::string argument(argv[1]);
-            port = std::stoi(argument);
-        } catch(std::invalid_argument e) {
-            std::cout << "Invalid argument exception" << std::endl;
-            SPDLOG_ERROR("Invalid argument exception");
-        } catch(std::out_of_range e) {
-            std::cout << "Out of range exception" << std::endl;
-            SPDLOG_ERROR("Out of range exception");
-        }
+        gSocketHandler = &socketHandler;
+        // A peer that closes before we respond must not kill the server
+        signal(SIGPIPE, SIG_IGN);
+        signal(SIGUSR1, handleTraceDumpSignal);
+        signal(SIGINT, handleStopSignal);
+        signal(SIGTERM, handleStopSignal);
         
-        if (port > std::numeric_limits<uint16_t>::max()) {
-            std::cout << "Invalid port, max=" << std::numeric_limits<uint16_t>::max() << std::endl;
-            SPDLOG_ERROR("Invalid port, max={}", std::numeric_limits<uint16_t>::max());
-            port = -1;
-        }
-    }
-    
-    if (port != -1) {
-        std::cout << "Server started on port " << port << std::endl;
-        TcpSocketHandler socketHandler(roomManager, port);
         socketHandler.startServer();
+        
+        signal(SIGUSR1, SIG_IGN);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        gSocketHandler = nullptr;
     } else {
-        std::cout << "Invalid port number: " << argv[1] << std::endl;
-        SPDLOG_ERROR("Invalid port number: {}", argv[1]);
+        SPDLOG_ERROR("Invalid command line");
     }
     
     return 0;
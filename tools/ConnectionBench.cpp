@@ -0,0 +1,223 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+#include <malloc.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+#include "BufferPool.hpp"
+#include "ClientContext.hpp"
+#include "ClientHandler.hpp"
+#include "LatencyHistogram.hpp"
+#include "MemoryTransport.hpp"
+#include "Protocol.hpp"
+#include "RequestTracer.hpp"
+#include "RoomManager.hpp"
+#include "SocketTransport.hpp"
+
+/**
+ * Measures the cost of the connection handlers without the network. With the socket backend every
+ * connection is a socketpair, with the memory backend it's an in-process pipe so no kernel time is
+ * included and the number of connections isn't limited by file descriptors. The server end is driven by
+ * a ClientHandler exactly like the event loop does. Reports the heap bytes held by an idle connection, the
+ * time spent in processStream() per request and the number of lookups per second.
+ */
+
+/**
+ * @return Bytes currently allocated on the heap
+ */
+static size_t getHeapBytes()
+{
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+/**
+ * Reads and discards a response
+ * @param transport Transport of the connection
+ * @param handle Client end of the connection
+ * @param length Length of the response
+ * @return true if the whole response was read
+ */
+static bool readResponse(Transport& transport, int handle, uint32_t length)
+{
+    char buffer[256];
+    uint32_t receivedBytes = 0;
+    while (receivedBytes < length) {
+        iovec segment = {buffer, std::min<size_t>(sizeof(buffer), length - receivedBytes)};
+        ssize_t result = transport.receive(handle, &segment, 1);
+        if (result <= 0) {
+            return false;
+        }
+        receivedBytes += result;
+    }
+    return true;
+}
+
+/**
+ * Sends a request and times how long the handler takes to process it
+ * @param client Handler of the server end
+ * @param transport Transport of the connection
+ * @param clientHandle Client end of the connection
+ * @param request Request to send
+ * @param requestSize Size of the request
+ * @param latency Histogram of processing time in nanoseconds
+ * @return true if the handler kept the connection open
+ */
+static bool timeRequest(ClientHandler& client, Transport& transport, int clientHandle, const char* request, uint32_t requestSize,
+    LatencyHistogram& latency)
+{
+    if (transport.send(clientHandle, request, requestSize) != static_cast<ssize_t>(requestSize)) {
+        return false;
+    }
+    
+    auto start = std::chrono::steady_clock::now();
+    bool closeConnection = client.processStream();
+    auto end = std::chrono::steady_clock::now();
+    
+    latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+    return !closeConnection;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        std::cout << "Usage: " << argv[0] << " <connections> [lookups per connection] [socket|memory]" << std::endl;
+        return 1;
+    }
+    
+    uint32_t connectionCount = std::stoul(argv[1]);
+    uint32_t lookupsPerConnection = argc > 2 ? std::stoul(argv[2]) : 10;
+    std::string backend = argc > 3 ? argv[3] : "socket";
+    
+    if (backend != "socket" && backend != "memory") {
+        std::cout << "Unknown backend " << backend << std::endl;
+        return 1;
+    }
+    bool useMemoryTransport = backend == "memory";
+    
+    spdlog::set_level(spdlog::level::off);
+    
+    SocketTransport socketTransport;
+    MemoryTransport memoryTransport;
+    Transport& transport = useMemoryTransport ? static_cast<Transport&>(memoryTransport) : socketTransport;
+    
+    RoomManager roomManager;
+    BufferPool bufferPool(ClientHandler::RECEIVE_BUFFER_SIZE);
+    RequestTracer tracer(1000000);
+    ClientContext context{roomManager, bufferPool, tracer, nullptr, nullptr, transport};
+    
+    uint32_t roomNumber = roomManager.createRoom("::1", 12345);
+    
+    // Open every connection first, the client map is reserved so that only the handlers are measured
+    std::vector<int> clientFds;
+    std::vector<int> serverFds;
+    clientFds.reserve(connectionCount);
+    serverFds.reserve(connectionCount);
+    for (uint32_t connectionIndex = 0; connectionIndex < connectionCount; ++connectionIndex) {
+        int fds[2];
+        if (useMemoryTransport) {
+            memoryTransport.openConnection(fds[0], fds[1]);
+        } else {
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+                std::cout << "socketpair() failed, errno=" << errno << std::endl;
+                return 1;
+            }
+            fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL, 0) | O_NONBLOCK);
+        }
+        clientFds.push_back(fds[0]);
+        serverFds.push_back(fds[1]);
+    }
+    
+    std::unordered_map<int, ClientHandler> clients;
+    clients.reserve(connectionCount);
+    
+    Protocol::InitSession::Buffer initSession;
+    Protocol::InitSession::encode(initSession.data(), Protocol::NETPLAY_VERSION);
+    Protocol::NpClientRequestRegistration::Buffer lookup;
+    Protocol::NpClientRequestRegistration::encode(lookup.data(), roomNumber);
+    
+    LatencyHistogram initLatency;
+    LatencyHistogram lookupLatency;
+    
+    size_t heapBytesBefore = getHeapBytes();
+    
+    for (uint32_t connectionIndex = 0; connectionIndex < connectionCount; ++connectionIndex) {
+        ClientHandler& client = clients.emplace(std::piecewise_construct, std::forward_as_tuple(serverFds[connectionIndex]),
+            std::forward_as_tuple(context, serverFds[connectionIndex])).first->second;
+        
+        if (!timeRequest(client, transport, clientFds[connectionIndex], initSession.data(), initSession.size(), initLatency) ||
+            !readResponse(transport, clientFds[connectionIndex], Protocol::InitSessionResponse::SIZE)) {
+            std::cout << "INIT_SESSION failed" << std::endl;
+            return 1;
+        }
+    }
+    
+    size_t heapBytesIdle = getHeapBytes();
+    
+    // Throughput includes the client side of every lookup, with the memory backend that's only a copy
+    auto lookupsStart = std::chrono::steady_clock::now();
+    for (uint32_t lookupIndex = 0; lookupIndex < lookupsPerConnection; ++lookupIndex) {
+        for (uint32_t connectionIndex = 0; connectionIndex < connectionCount; ++connectionIndex) {
+            ClientHandler& client = clients.find(serverFds[connectionIndex])->second;
+            
+            if (!timeRequest(client, transport, clientFds[connectionIndex], lookup.data(), lookup.size(), lookupLatency) ||
+                !readResponse(transport, clientFds[connectionIndex], Protocol::NpClientRequestRegistrationResponse::SIZE)) {
+                std::cout << "NP_CLIENT_REQUEST_REGISTRATION failed" << std::endl;
+                return 1;
+            }
+        }
+    }
+    double lookupSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - lookupsStart).count();
+    double lookupsPerSecond = lookupSeconds > 0 ? static_cast<double>(connectionCount) * lookupsPerConnection / lookupSeconds : 0.0;
+    
+    double idleBytesPerConnection = static_cast<double>(heapBytesIdle - heapBytesBefore) / connectionCount;
+    std::cout << "backend=" << backend << " connections=" << connectionCount
+        << " handler_bytes=" << sizeof(ClientHandler)
+        << " idle_heap_bytes_per_connection=" << idleBytesPerConnection << std::endl;
+    std::cout << "init_session p50_ns=" << initLatency.getPercentile(50.0)
+        << " p99_ns=" << initLatency.getPercentile(99.0)
+        << " mean_ns=" << initLatency.getMean() << std::endl;
+    std::cout << "lookup p50_ns=" << lookupLatency.getPercentile(50.0)
+        << " p99_ns=" << lookupLatency.getPercentile(99.0)
+        << " mean_ns=" << lookupLatency.getMean()
+        << " lookups_per_second=" << static_cast<uint64_t>(lookupsPerSecond) << std::endl;
+    
+    clients.clear();
+    for (int fd : clientFds) {
+        transport.close(fd);
+    }
+    for (int fd : serverFds) {
+        transport.close(fd);
+    }
+    
+    return 0;
+}
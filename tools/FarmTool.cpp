@@ -0,0 +1,368 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "MonotonicClock.hpp"
+#include "Protocol.hpp"
+
+/**
+ * Registers the rooms of a hosting farm with a running np-room-manager, either the way a single netplay
+ * server does it, with one host connection and one room number connection per room, or in batches of
+ * REGISTER_NP_SERVERS on a single host connection. Given the pid of a server running on the same machine,
+ * it reports the descriptors and memory the rooms cost the server, and the kernel socket memory they cost
+ * the whole machine.
+ */
+
+// Time to wait for a response before the registration counts as failed
+static const int RESPONSE_TIMEOUT_MILLISECONDS = 5000;
+
+// Largest frame the server accepts, see ClientHandler::RECEIVE_BUFFER_SIZE
+static const uint32_t MAX_FRAME_SIZE = 256;
+
+/**
+ * Resources used by the server and the machine at one point in time
+ */
+struct ResourceSample
+{
+    // Open descriptors of the server, 0 if unknown
+    long serverDescriptors = 0;
+    
+    // Resident memory of the server in kilobytes, 0 if unknown
+    long serverResidentKilobytes = 0;
+    
+    // Pages used by TCP socket buffers on the whole machine
+    long tcpMemoryPages = 0;
+};
+
+/**
+ * Reads exactly the given number of bytes
+ * @param fd Socket to read from
+ * @param buffer Destination
+ * @param length Number of bytes to read
+ * @return true if every byte was read
+ */
+static bool readFully(int fd, void* buffer, size_t length)
+{
+    size_t receivedBytes = 0;
+    while (receivedBytes < length) {
+        ssize_t result = recv(fd, static_cast<char*>(buffer) + receivedBytes, length - receivedBytes, 0);
+        if (result <= 0) {
+            return false;
+        }
+        receivedBytes += result;
+    }
+    return true;
+}
+
+/**
+ * Opens a connection and completes INIT_SESSION
+ * @param serverAddress Address of the server
+ * @return Connected socket, -1 on failure
+ */
+static int openSession(const addrinfo* serverAddress)
+{
+    int fd = socket(serverAddress->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    timeval timeout = {RESPONSE_TIMEOUT_MILLISECONDS / 1000, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    
+    Protocol::InitSession::Buffer initSession;
+    Protocol::InitSession::encode(initSession.data(), Protocol::NETPLAY_VERSION);
+    Protocol::InitSessionResponse::Buffer response;
+    
+    if (connect(fd, serverAddress->ai_addr, serverAddress->ai_addrlen) < 0 ||
+        send(fd, initSession.data(), initSession.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(initSession.size()) ||
+        !readFully(fd, response.data(), response.size()) ||
+        ntohl(*reinterpret_cast<const uint32_t*>(response.data())) != Protocol::InitSessionResponse::ID) {
+        close(fd);
+        return -1;
+    }
+    
+    return fd;
+}
+
+/**
+ * Opens the socket the server delivers room numbers to
+ * @param port Set to the port it listens on
+ * @return Listening socket, -1 on failure
+ */
+static int openCallbackListener(uint16_t& port)
+{
+    // Dual stack, the server connects back to whichever address family we connected from
+    int fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    int off = 0;
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    
+    sockaddr_in6 address = {};
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = in6addr_any;
+    socklen_t addressLength = sizeof(address);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(fd, 16) < 0 ||
+        getsockname(fd, reinterpret_cast<sockaddr*>(&address), &addressLength) < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    port = ntohs(address.sin6_port);
+    return fd;
+}
+
+/**
+ * Registers every room with its own host connection, like separate netplay servers do
+ * @param serverAddress Address of the server
+ * @param roomCount Number of rooms
+ * @param hostFds Host connections, which keep the rooms alive until they are closed
+ * @return Number of rooms registered
+ */
+static uint32_t registerSingleRooms(const addrinfo* serverAddress, uint32_t roomCount, std::vector<int>& hostFds)
+{
+    uint16_t listenPort = 0;
+    int listenFd = openCallbackListener(listenPort);
+    if (listenFd < 0) {
+        std::cout << "Unable to listen for room numbers, errno=" << errno << std::endl;
+        return 0;
+    }
+    
+    Protocol::RegisterNpServer::Buffer registration;
+    Protocol::RegisterNpServer::encode(registration.data(), listenPort);
+    Protocol::RegisterNpServerResponse::Buffer response;
+    
+    uint32_t registeredRooms = 0;
+    for (uint32_t roomIndex = 0; roomIndex < roomCount; ++roomIndex) {
+        int hostFd = openSession(serverAddress);
+        if (hostFd < 0) {
+            break;
+        }
+        hostFds.push_back(hostFd);
+        
+        if (send(hostFd, registration.data(), registration.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(registration.size())) {
+            break;
+        }
+        
+        pollfd listenPollFd = {listenFd, POLLIN, 0};
+        if (poll(&listenPollFd, 1, RESPONSE_TIMEOUT_MILLISECONDS) != 1) {
+            break;
+        }
+        
+        int callbackFd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (callbackFd < 0) {
+            break;
+        }
+        
+        timeval timeout = {RESPONSE_TIMEOUT_MILLISECONDS / 1000, 0};
+        setsockopt(callbackFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        bool received = readFully(callbackFd, response.data(), response.size());
+        close(callbackFd);
+        
+        if (!received || ntohl(*reinterpret_cast<const uint32_t*>(response.data())) != Protocol::RegisterNpServerResponse::ID) {
+            break;
+        }
+        ++registeredRooms;
+    }
+    
+    close(listenFd);
+    return registeredRooms;
+}
+
+/**
+ * Registers every room on a single host connection with REGISTER_NP_SERVERS
+ * @param serverAddress Address of the server
+ * @param roomCount Number of rooms
+ * @param hostFds Host connection, which keeps the rooms alive until it's closed
+ * @return Number of rooms registered
+ */
+static uint32_t registerBatchRooms(const addrinfo* serverAddress, uint32_t roomCount, std::vector<int>& hostFds)
+{
+    using Request = Protocol::RegisterNpServers;
+    using Response = Protocol::RegisterNpServersResponse;
+    
+    int hostFd = openSession(serverAddress);
+    if (hostFd < 0) {
+        return 0;
+    }
+    hostFds.push_back(hostFd);
+    
+    // The farm's netplay servers are given consecutive ports
+    const uint32_t firstPort = 20000;
+    const uint32_t maxRecords = Request::getMaxRecords(MAX_FRAME_SIZE);
+    std::vector<char> request(Request::getSize(maxRecords));
+    std::vector<char> response(Response::getSize(maxRecords));
+    
+    uint32_t registeredRooms = 0;
+    for (uint32_t roomIndex = 0; roomIndex < roomCount;) {
+        uint32_t recordCount = std::min(maxRecords, roomCount - roomIndex);
+        uint32_t requestSize = Request::encodeHeader(request.data(), recordCount);
+        for (uint32_t recordIndex = 0; recordIndex < recordCount; ++recordIndex) {
+            Request::encodeRecord(request.data(), recordIndex, firstPort + roomIndex + recordIndex);
+        }
+        
+        uint32_t responseSize = Response::getSize(recordCount);
+        if (send(hostFd, request.data(), requestSize, MSG_NOSIGNAL) != static_cast<ssize_t>(requestSize) ||
+            !readFully(hostFd, response.data(), responseSize) ||
+            ntohl(*reinterpret_cast<const uint32_t*>(response.data())) != Response::ID) {
+            break;
+        }
+        
+        // Rooms over the per connection limit come back as room number 0
+        FrameView responseFrame(response.data(), responseSize, nullptr, 0);
+        for (uint32_t recordIndex = 0; recordIndex < recordCount; ++recordIndex) {
+            if (std::get<0>(Response::decodeRecord(responseFrame, recordIndex)) != 0) {
+                ++registeredRooms;
+            }
+        }
+        roomIndex += recordCount;
+    }
+    
+    return registeredRooms;
+}
+
+/**
+ * Samples the resources used by the server and the machine
+ * @param serverPid Pid of the server, 0 to only sample the machine
+ * @return Resource sample
+ */
+static ResourceSample sampleResources(int serverPid)
+{
+    ResourceSample sample;
+    
+    if (serverPid > 0) {
+        std::string processDirectory = "/proc/" + std::to_string(serverPid);
+        DIR* descriptors = opendir((processDirectory + "/fd").c_str());
+        if (descriptors != nullptr) {
+            while (readdir(descriptors) != nullptr) {
+                ++sample.serverDescriptors;
+            }
+            // . and ..
+            sample.serverDescriptors -= 2;
+            closedir(descriptors);
+        }
+        
+        std::ifstream status(processDirectory + "/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.compare(0, 6, "VmRSS:") == 0) {
+                sample.serverResidentKilobytes = std::stol(line.substr(6));
+            }
+        }
+    }
+    
+    // TCP: inuse n orphan n tw n alloc n mem n
+    std::ifstream socketStatistics("/proc/net/sockstat");
+    std::string line;
+    while (std::getline(socketStatistics, line)) {
+        size_t memoryPosition = line.find(" mem ");
+        if (line.compare(0, 4, "TCP:") == 0 && memoryPosition != std::string::npos) {
+            sample.tcpMemoryPages = std::stol(line.substr(memoryPosition + 5));
+        }
+    }
+    
+    return sample;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4) {
+        std::cout << "Usage: " << argv[0] << " <host> <port> <rooms> [single|batch] [server pid]" << std::endl
+            << "  single: one host connection and one room number connection per room (default)" << std::endl
+            << "  batch: every room on one host connection with REGISTER_NP_SERVERS" << std::endl
+            << "  server pid: pid of a server on this machine, to report its descriptors and memory" << std::endl;
+        return 1;
+    }
+    
+    uint32_t roomCount = std::stoul(argv[3]);
+    std::string mode = argc > 4 ? argv[4] : "single";
+    int serverPid = argc > 5 ? std::stoi(argv[5]) : 0;
+    
+    if (mode != "single" && mode != "batch") {
+        std::cout << "Unknown mode " << mode << std::endl;
+        return 1;
+    }
+    
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* serverAddress = nullptr;
+    if (getaddrinfo(argv[1], argv[2], &hints, &serverAddress) != 0 || serverAddress == nullptr) {
+        std::cout << "Unable to resolve " << argv[1] << ":" << argv[2] << std::endl;
+        return 1;
+    }
+    
+    ResourceSample before = sampleResources(serverPid);
+    
+    std::vector<int> hostFds;
+    hostFds.reserve(mode == "single" ? roomCount : 1);
+    uint64_t startMicroseconds = MonotonicClock::nowMicroseconds();
+    uint32_t registeredRooms = mode == "single" ? registerSingleRooms(serverAddress, roomCount, hostFds) :
+        registerBatchRooms(serverAddress, roomCount, hostFds);
+    uint64_t elapsedMicroseconds = MonotonicClock::nowMicroseconds() - startMicroseconds;
+    
+    // The server may still be closing room number connections of the last rooms
+    usleep(200000);
+    ResourceSample after = sampleResources(serverPid);
+    
+    double perRoom = registeredRooms > 0 ? 1.0 / registeredRooms : 0.0;
+    long serverDescriptors = after.serverDescriptors - before.serverDescriptors;
+    long serverResidentKilobytes = after.serverResidentKilobytes - before.serverResidentKilobytes;
+    long tcpMemoryPages = after.tcpMemoryPages - before.tcpMemoryPages;
+    
+    std::cout << "mode=" << mode << " rooms=" << registeredRooms << " failed=" << roomCount - registeredRooms
+        << " host_connections=" << hostFds.size() << " elapsed_ms=" << elapsedMicroseconds / 1000 << std::endl;
+    if (serverPid > 0) {
+        std::cout << "server descriptors=" << serverDescriptors << " per_room=" << serverDescriptors * perRoom
+            << " rss_kb=" << serverResidentKilobytes << " rss_bytes_per_room=" << serverResidentKilobytes * 1024 * perRoom
+            << std::endl;
+    }
+    std::cout << "machine tcp_memory_pages=" << tcpMemoryPages << " tcp_memory_bytes_per_room="
+        << tcpMemoryPages * sysconf(_SC_PAGESIZE) * perRoom << std::endl;
+    
+    for (int fd : hostFds) {
+        close(fd);
+    }
+    freeaddrinfo(serverAddress);
+    
+    return registeredRooms == roomCount ? 0 : 1;
+}
@@ -0,0 +1,283 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "LatencyHistogram.hpp"
+#include "MonotonicClock.hpp"
+#include "Protocol.hpp"
+
+/**
+ * Measures request round trip times of a running np-room-manager, one request at a time with a pause in
+ * between, which is how latency sensitive clients use the server. Compare a server started with the low latency
+ * options against one without them to see what they buy.
+ *
+ * A registration round trip goes from sending REGISTER_NP_SERVER to receiving the room number on the callback
+ * connection, a lookup round trip goes from sending NP_CLIENT_REQUEST_REGISTRATION to receiving its response.
+ */
+
+// Time to wait for a response before the request counts as failed
+static const int RESPONSE_TIMEOUT_MILLISECONDS = 5000;
+
+/**
+ * Reads exactly the given number of bytes
+ * @param fd Socket to read from
+ * @param buffer Destination
+ * @param length Number of bytes to read
+ * @return true if every byte was read
+ */
+static bool readFully(int fd, void* buffer, size_t length)
+{
+    size_t receivedBytes = 0;
+    while (receivedBytes < length) {
+        ssize_t result = recv(fd, static_cast<char*>(buffer) + receivedBytes, length - receivedBytes, 0);
+        if (result <= 0) {
+            return false;
+        }
+        receivedBytes += result;
+    }
+    return true;
+}
+
+/**
+ * Opens a connection and completes INIT_SESSION
+ * @param serverAddress Address of the server
+ * @return Connected socket, -1 on failure
+ */
+static int openSession(const addrinfo* serverAddress)
+{
+    int fd = socket(serverAddress->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    timeval timeout = {RESPONSE_TIMEOUT_MILLISECONDS / 1000, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    
+    Protocol::InitSession::Buffer initSession;
+    Protocol::InitSession::encode(initSession.data(), Protocol::NETPLAY_VERSION);
+    Protocol::InitSessionResponse::Buffer response;
+    
+    if (connect(fd, serverAddress->ai_addr, serverAddress->ai_addrlen) < 0 ||
+        send(fd, initSession.data(), initSession.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(initSession.size()) ||
+        !readFully(fd, response.data(), response.size()) ||
+        ntohl(*reinterpret_cast<const uint32_t*>(response.data())) != Protocol::InitSessionResponse::ID) {
+        close(fd);
+        return -1;
+    }
+    
+    return fd;
+}
+
+/**
+ * Opens the socket the server delivers room numbers to
+ * @param port Set to the port it listens on
+ * @return Listening socket, -1 on failure
+ */
+static int openCallbackListener(uint16_t& port)
+{
+    // Dual stack, the server connects back to whichever address family we connected from
+    int fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    int off = 0;
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    
+    sockaddr_in6 address = {};
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = in6addr_any;
+    socklen_t addressLength = sizeof(address);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(fd, 16) < 0 ||
+        getsockname(fd, reinterpret_cast<sockaddr*>(&address), &addressLength) < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    port = ntohs(address.sin6_port);
+    return fd;
+}
+
+/**
+ * Registers a room and waits for its room number
+ * @param serverAddress Address of the server
+ * @param listenFd Socket the room number is delivered to
+ * @param listenPort Port of listenFd
+ * @param hostFd Set to the host connection, which keeps the room alive until it's closed
+ * @param roomNumber Set to the room number
+ * @return Round trip time in microseconds, 0 on failure
+ */
+static uint64_t registerRoom(const addrinfo* serverAddress, int listenFd, uint16_t listenPort, int& hostFd,
+    uint32_t& roomNumber)
+{
+    hostFd = openSession(serverAddress);
+    if (hostFd < 0) {
+        return 0;
+    }
+    
+    Protocol::RegisterNpServer::Buffer registration;
+    Protocol::RegisterNpServer::encode(registration.data(), listenPort);
+    Protocol::RegisterNpServerResponse::Buffer response;
+    
+    uint64_t sendMicroseconds = MonotonicClock::nowMicroseconds();
+    if (send(hostFd, registration.data(), registration.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(registration.size())) {
+        return 0;
+    }
+    
+    pollfd listenPollFd = {listenFd, POLLIN, 0};
+    if (poll(&listenPollFd, 1, RESPONSE_TIMEOUT_MILLISECONDS) != 1) {
+        return 0;
+    }
+    
+    int callbackFd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (callbackFd < 0) {
+        return 0;
+    }
+    
+    timeval timeout = {RESPONSE_TIMEOUT_MILLISECONDS / 1000, 0};
+    setsockopt(callbackFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    bool received = readFully(callbackFd, response.data(), response.size());
+    uint64_t roundTripMicroseconds = MonotonicClock::nowMicroseconds() - sendMicroseconds;
+    close(callbackFd);
+    
+    if (!received || ntohl(*reinterpret_cast<const uint32_t*>(response.data())) != Protocol::RegisterNpServerResponse::ID) {
+        return 0;
+    }
+    
+    roomNumber = std::get<0>(Protocol::RegisterNpServerResponse::decode(
+        FrameView(response.data(), response.size(), nullptr, 0)));
+    return std::max<uint64_t>(1, roundTripMicroseconds);
+}
+
+/**
+ * Prints the percentiles of a histogram
+ * @param name Name of the request type
+ * @param histogram Round trip times
+ * @param failures Number of failed requests
+ */
+static void printLatency(const std::string& name, const LatencyHistogram& histogram, uint64_t failures)
+{
+    std::cout << name << "=" << histogram.getCount()
+        << " failed=" << failures
+        << " p50_us=" << histogram.getPercentile(50.0)
+        << " p99_us=" << histogram.getPercentile(99.0)
+        << " p999_us=" << histogram.getPercentile(99.9)
+        << " max_us=" << histogram.getMax() << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        std::cout << "Usage: " << argv[0] << " <host> <port> [samples] [pause us]" << std::endl
+            << "  samples: number of registrations and of lookups (default 10000)" << std::endl
+            << "  pause us: pause between requests, the server goes idle in between (default 1000)" << std::endl;
+        return 1;
+    }
+    
+    int samples = argc > 3 ? std::stoi(argv[3]) : 10000;
+    int pauseMicroseconds = argc > 4 ? std::stoi(argv[4]) : 1000;
+    
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* serverAddress = nullptr;
+    if (getaddrinfo(argv[1], argv[2], &hints, &serverAddress) != 0 || serverAddress == nullptr) {
+        std::cout << "Unable to resolve " << argv[1] << ":" << argv[2] << std::endl;
+        return 1;
+    }
+    
+    uint16_t listenPort = 0;
+    int listenFd = openCallbackListener(listenPort);
+    if (listenFd < 0) {
+        std::cout << "Unable to listen for room numbers, errno=" << errno << std::endl;
+        return 1;
+    }
+    
+    // Registrations, the last room is kept for the lookups
+    LatencyHistogram registrationLatency;
+    uint64_t failedRegistrations = 0;
+    int roomFd = -1;
+    uint32_t roomNumber = 0;
+    for (int sample = 0; sample < samples; ++sample) {
+        if (roomFd >= 0) {
+            close(roomFd);
+        }
+        
+        uint64_t roundTripMicroseconds = registerRoom(serverAddress, listenFd, listenPort, roomFd, roomNumber);
+        if (roundTripMicroseconds == 0) {
+            ++failedRegistrations;
+        } else {
+            registrationLatency.record(roundTripMicroseconds);
+        }
+        usleep(pauseMicroseconds);
+    }
+    
+    // Lookups of the room on a single connection
+    LatencyHistogram lookupLatency;
+    uint64_t failedLookups = 0;
+    int lookupFd = openSession(serverAddress);
+    Protocol::NpClientRequestRegistration::Buffer lookup;
+    Protocol::NpClientRequestRegistration::encode(lookup.data(), roomNumber);
+    Protocol::NpClientRequestRegistrationResponse::Buffer lookupResponse;
+    
+    for (int sample = 0; sample < samples && lookupFd >= 0; ++sample) {
+        uint64_t sendMicroseconds = MonotonicClock::nowMicroseconds();
+        if (send(lookupFd, lookup.data(), lookup.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(lookup.size()) ||
+            !readFully(lookupFd, lookupResponse.data(), lookupResponse.size())) {
+            ++failedLookups;
+            break;
+        }
+        lookupLatency.record(MonotonicClock::nowMicroseconds() - sendMicroseconds);
+        usleep(pauseMicroseconds);
+    }
+    
+    if (lookupFd < 0) {
+        failedLookups = samples;
+    } else {
+        close(lookupFd);
+    }
+    if (roomFd >= 0) {
+        close(roomFd);
+    }
+    close(listenFd);
+    freeaddrinfo(serverAddress);
+    
+    printLatency("registrations", registrationLatency, failedRegistrations);
+    printLatency("lookups", lookupLatency, failedLookups);
+    
+    return failedRegistrations == 0 && failedLookups == 0 ? 0 : 1;
+}
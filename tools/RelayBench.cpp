@@ -0,0 +1,376 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "LatencyHistogram.hpp"
+#include "MonotonicClock.hpp"
+#include "Protocol.hpp"
+
+/**
+ * Benchmarks the UDP relay of a running np-room-manager started with --relay-ports. A relayed room is
+ * registered over TCP, then a stand-in host bound to the relay echoes every datagram back to the
+ * joiner it came from, while stand-in joiners keep a fixed window of datagrams in flight. Every echo
+ * is two relayed datagrams. The relay thread CPU time is reported by the server, run it with
+ * --stats-interval 1 and read forwarded_per_cpu_second from the "Relay statistics" log entries.
+ */
+
+// Datagrams in flight per joiner
+static const uint32_t WINDOW_SIZE = 32;
+
+// Datagrams per recvmmsg/sendmmsg call
+static const uint32_t BATCH_SIZE = 64;
+
+// A joiner that received nothing for this long assumes its window was lost
+static const uint64_t LOSS_TIMEOUT_MICROSECONDS = 200000;
+
+// The host repeats its RelayBind datagram this often in case one is lost
+static const uint64_t BIND_INTERVAL_MICROSECONDS = 500000;
+
+// Largest datagram exchanged
+static const uint32_t MAX_DATAGRAM_SIZE = 2048;
+
+/**
+ * State of a stand-in joiner
+ */
+struct BenchJoiner
+{
+    // Socket connected to the relay port
+    int fd = -1;
+    
+    // Datagrams in flight
+    uint32_t inFlight = 0;
+    
+    // Last time a datagram was received
+    uint64_t lastReceiveMicroseconds = 0;
+};
+
+/**
+ * Sends and receives a complete message over a blocking TCP socket
+ * @param fd Socket
+ * @param request Request to send
+ * @param requestSize Size of the request
+ * @param response Buffer for the response
+ * @param responseSize Size of the response
+ * @return true on success
+ */
+static bool exchange(int fd, const char* request, uint32_t requestSize, char* response, uint32_t responseSize)
+{
+    if (send(fd, request, requestSize, MSG_NOSIGNAL) != static_cast<ssize_t>(requestSize)) {
+        return false;
+    }
+    
+    uint32_t receivedBytes = 0;
+    while (receivedBytes < responseSize) {
+        ssize_t result = recv(fd, response + receivedBytes, responseSize - receivedBytes, 0);
+        if (result <= 0) {
+            return false;
+        }
+        receivedBytes += result;
+    }
+    
+    return true;
+}
+
+/**
+ * Opens a UDP socket connected to the relay
+ * @param relayAddress Relay address and port
+ * @param relayAddressLength Length of the address
+ * @return Socket, -1 on failure
+ */
+static int openRelaySocket(const sockaddr_storage& relayAddress, socklen_t relayAddressLength)
+{
+    int fd = socket(relayAddress.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    int bufferSize = 4 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+    
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&relayAddress), relayAddressLength) < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    return fd;
+}
+
+/**
+ * Stand-in host, echoes every datagram back through the relay. The peer id header is kept so that the
+ * relay sends the payload back to the joiner it came from.
+ * @param fd Socket connected to the relay port
+ * @param token Host token
+ * @param running Cleared to stop
+ * @param echoed Number of datagrams echoed
+ */
+static void runHost(int fd, uint32_t token, const std::atomic<bool>& running, uint64_t& echoed)
+{
+    std::vector<char> buffers(BATCH_SIZE * MAX_DATAGRAM_SIZE);
+    std::vector<mmsghdr> messages(BATCH_SIZE);
+    std::vector<iovec> segments(BATCH_SIZE);
+    
+    Protocol::RelayBind::Buffer bind;
+    Protocol::RelayBind::encode(bind.data(), token);
+    uint64_t lastBindMicroseconds = 0;
+    
+    while (running.load(std::memory_order_relaxed)) {
+        uint64_t nowMicroseconds = MonotonicClock::nowMicroseconds();
+        if (nowMicroseconds - lastBindMicroseconds >= BIND_INTERVAL_MICROSECONDS) {
+            send(fd, bind.data(), bind.size(), 0);
+            lastBindMicroseconds = nowMicroseconds;
+        }
+        
+        pollfd pollFd = {fd, POLLIN, 0};
+        if (poll(&pollFd, 1, 100) <= 0) {
+            continue;
+        }
+        
+        for (uint32_t messageIndex = 0; messageIndex < BATCH_SIZE; ++messageIndex) {
+            segments[messageIndex].iov_base = &buffers[messageIndex * MAX_DATAGRAM_SIZE];
+            segments[messageIndex].iov_len = MAX_DATAGRAM_SIZE;
+            messages[messageIndex].msg_hdr = {};
+            messages[messageIndex].msg_hdr.msg_iov = &segments[messageIndex];
+            messages[messageIndex].msg_hdr.msg_iovlen = 1;
+        }
+        
+        int received = recvmmsg(fd, messages.data(), BATCH_SIZE, MSG_DONTWAIT, nullptr);
+        if (received <= 0) {
+            continue;
+        }
+        
+        // Send back exactly what was received
+        for (int messageIndex = 0; messageIndex < received; ++messageIndex) {
+            segments[messageIndex].iov_len = messages[messageIndex].msg_len;
+        }
+        
+        int sent = sendmmsg(fd, messages.data(), received, 0);
+        if (sent > 0) {
+            echoed += sent;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        std::cout << "Usage: " << argv[0] << " <host> <port> [seconds] [joiners] [payload bytes]" << std::endl
+            << "  seconds: duration of the benchmark (default 10)" << std::endl
+            << "  joiners: number of stand-in joiners (default 3)" << std::endl
+            << "  payload bytes: size of every datagram sent by a joiner (default 64)" << std::endl;
+        return 1;
+    }
+    
+    int durationSeconds = argc > 3 ? std::stoi(argv[3]) : 10;
+    uint32_t joinerCount = argc > 4 ? std::stoul(argv[4]) : 3;
+    uint32_t payloadSize = argc > 5 ? std::stoul(argv[5]) : 64;
+    payloadSize = std::max<uint32_t>(payloadSize, sizeof(uint64_t));
+    payloadSize = std::min<uint32_t>(payloadSize, MAX_DATAGRAM_SIZE - Protocol::RELAY_PEER_HEADER_SIZE);
+    
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* serverAddress = nullptr;
+    if (getaddrinfo(argv[1], argv[2], &hints, &serverAddress) != 0 || serverAddress == nullptr) {
+        std::cout << "Unable to resolve " << argv[1] << ":" << argv[2] << std::endl;
+        return 1;
+    }
+    
+    // Register a relayed room
+    int controlFd = socket(serverAddress->ai_family, SOCK_STREAM, 0);
+    if (controlFd < 0 || connect(controlFd, serverAddress->ai_addr, serverAddress->ai_addrlen) < 0) {
+        std::cout << "Unable to connect to " << argv[1] << ":" << argv[2] << std::endl;
+        return 1;
+    }
+    
+    Protocol::InitSession::Buffer initSession;
+    Protocol::InitSession::encode(initSession.data(), Protocol::NETPLAY_VERSION);
+    Protocol::InitSessionResponse::Buffer initSessionResponse;
+    Protocol::RegisterNpServerRelay::Buffer registerRelay;
+    Protocol::RegisterNpServerRelay::encode(registerRelay.data());
+    Protocol::RegisterNpServerRelayResponse::Buffer registerRelayResponse;
+    
+    if (!exchange(controlFd, initSession.data(), initSession.size(), initSessionResponse.data(), initSessionResponse.size()) ||
+        !exchange(controlFd, registerRelay.data(), registerRelay.size(), registerRelayResponse.data(), registerRelayResponse.size())) {
+        std::cout << "Relay registration failed" << std::endl;
+        return 1;
+    }
+    
+    auto [roomNumber, relayPort, token] = Protocol::RegisterNpServerRelayResponse::decode(
+        FrameView(registerRelayResponse.data(), registerRelayResponse.size(), nullptr, 0));
+    if (relayPort == 0) {
+        std::cout << "No relay port available, is the server running with --relay-ports?" << std::endl;
+        return 1;
+    }
+    
+    std::cout << "Relaying room " << roomNumber << " through port " << relayPort << " with " << joinerCount
+        << " joiners, " << payloadSize << " byte datagrams" << std::endl;
+    
+    // The relay port is on the same host as the room manager
+    sockaddr_storage relayAddress = {};
+    std::memcpy(&relayAddress, serverAddress->ai_addr, serverAddress->ai_addrlen);
+    socklen_t relayAddressLength = serverAddress->ai_addrlen;
+    if (relayAddress.ss_family == AF_INET6) {
+        reinterpret_cast<sockaddr_in6*>(&relayAddress)->sin6_port = htons(relayPort);
+    } else {
+        reinterpret_cast<sockaddr_in*>(&relayAddress)->sin_port = htons(relayPort);
+    }
+    freeaddrinfo(serverAddress);
+    
+    int hostFd = openRelaySocket(relayAddress, relayAddressLength);
+    if (hostFd < 0) {
+        std::cout << "Unable to open the host socket" << std::endl;
+        return 1;
+    }
+    
+    std::atomic<bool> running(true);
+    uint64_t echoed = 0;
+    std::thread hostThread(runHost, hostFd, token, std::cref(running), std::ref(echoed));
+    
+    // Give the host time to bind before joiners start sending
+    usleep(200000);
+    
+    std::vector<BenchJoiner> joiners(joinerCount);
+    std::vector<pollfd> pollFds(joinerCount);
+    for (uint32_t joinerIndex = 0; joinerIndex < joinerCount; ++joinerIndex) {
+        joiners[joinerIndex].fd = openRelaySocket(relayAddress, relayAddressLength);
+        if (joiners[joinerIndex].fd < 0) {
+            std::cout << "Unable to open a joiner socket" << std::endl;
+            return 1;
+        }
+        pollFds[joinerIndex] = {joiners[joinerIndex].fd, POLLIN, 0};
+    }
+    
+    std::vector<char> sendBuffers(WINDOW_SIZE * payloadSize);
+    std::vector<char> receiveBuffers(BATCH_SIZE * MAX_DATAGRAM_SIZE);
+    std::vector<mmsghdr> messages(std::max(BATCH_SIZE, WINDOW_SIZE));
+    std::vector<iovec> segments(messages.size());
+    LatencyHistogram roundTrip;
+    uint64_t sentDatagrams = 0;
+    uint64_t lostDatagrams = 0;
+    
+    // Fill the window of a joiner, every datagram carries its send time
+    auto refill = [&](BenchJoiner& joiner, uint64_t nowMicroseconds) {
+        uint32_t count = WINDOW_SIZE - joiner.inFlight;
+        for (uint32_t messageIndex = 0; messageIndex < count; ++messageIndex) {
+            char* payload = &sendBuffers[messageIndex * payloadSize];
+            std::memcpy(payload, &nowMicroseconds, sizeof(nowMicroseconds));
+            segments[messageIndex].iov_base = payload;
+            segments[messageIndex].iov_len = payloadSize;
+            messages[messageIndex].msg_hdr = {};
+            messages[messageIndex].msg_hdr.msg_iov = &segments[messageIndex];
+            messages[messageIndex].msg_hdr.msg_iovlen = 1;
+        }
+        
+        int sent = count == 0 ? 0 : sendmmsg(joiner.fd, messages.data(), count, 0);
+        if (sent > 0) {
+            joiner.inFlight += sent;
+            sentDatagrams += sent;
+        }
+    };
+    
+    uint64_t startMicroseconds = MonotonicClock::nowMicroseconds();
+    uint64_t endMicroseconds = startMicroseconds + static_cast<uint64_t>(durationSeconds) * 1000000;
+    for (BenchJoiner& joiner : joiners) {
+        joiner.lastReceiveMicroseconds = startMicroseconds;
+        refill(joiner, startMicroseconds);
+    }
+    
+    uint64_t nowMicroseconds = startMicroseconds;
+    while (nowMicroseconds < endMicroseconds) {
+        poll(pollFds.data(), pollFds.size(), 10);
+        nowMicroseconds = MonotonicClock::nowMicroseconds();
+        
+        for (uint32_t joinerIndex = 0; joinerIndex < joinerCount; ++joinerIndex) {
+            BenchJoiner& joiner = joiners[joinerIndex];
+            
+            if (pollFds[joinerIndex].revents != 0) {
+                for (uint32_t messageIndex = 0; messageIndex < BATCH_SIZE; ++messageIndex) {
+                    segments[messageIndex].iov_base = &receiveBuffers[messageIndex * MAX_DATAGRAM_SIZE];
+                    segments[messageIndex].iov_len = MAX_DATAGRAM_SIZE;
+                    messages[messageIndex].msg_hdr = {};
+                    messages[messageIndex].msg_hdr.msg_iov = &segments[messageIndex];
+                    messages[messageIndex].msg_hdr.msg_iovlen = 1;
+                }
+                
+                int received = recvmmsg(joiner.fd, messages.data(), BATCH_SIZE, MSG_DONTWAIT, nullptr);
+                for (int messageIndex = 0; messageIndex < received; ++messageIndex) {
+                    uint64_t sentMicroseconds = 0;
+                    std::memcpy(&sentMicroseconds, &receiveBuffers[messageIndex * MAX_DATAGRAM_SIZE], sizeof(sentMicroseconds));
+                    roundTrip.record(nowMicroseconds - sentMicroseconds);
+                }
+                
+                if (received > 0) {
+                    joiner.inFlight -= std::min<uint32_t>(joiner.inFlight, received);
+                    joiner.lastReceiveMicroseconds = nowMicroseconds;
+                }
+            }
+            
+            // Datagrams that didn't come back in time are lost
+            if (nowMicroseconds - joiner.lastReceiveMicroseconds > LOSS_TIMEOUT_MICROSECONDS) {
+                lostDatagrams += joiner.inFlight;
+                joiner.inFlight = 0;
+                joiner.lastReceiveMicroseconds = nowMicroseconds;
+            }
+            
+            refill(joiner, nowMicroseconds);
+        }
+    }
+    
+    double elapsedSeconds = (nowMicroseconds - startMicroseconds) / 1000000.0;
+    running.store(false, std::memory_order_relaxed);
+    hostThread.join();
+    
+    for (BenchJoiner& joiner : joiners) {
+        close(joiner.fd);
+    }
+    close(hostFd);
+    close(controlFd);
+    
+    // A round trip is relayed twice, once towards the host and once back to the joiner
+    uint64_t roundTrips = roundTrip.getCount();
+    std::cout << "elapsed_s=" << elapsedSeconds
+        << " sent=" << sentDatagrams
+        << " round_trips=" << roundTrips
+        << " host_echoed=" << echoed
+        << " lost=" << lostDatagrams
+        << " relayed_datagrams_per_s=" << (elapsedSeconds > 0 ? 2 * roundTrips / elapsedSeconds : 0.0) << std::endl;
+    std::cout << "rtt_p50_us=" << roundTrip.getPercentile(50.0)
+        << " rtt_p99_us=" << roundTrip.getPercentile(99.0)
+        << " rtt_max_us=" << roundTrip.getMax() << std::endl;
+    
+    return 0;
+}
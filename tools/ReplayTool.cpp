@@ -0,0 +1,722 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "LatencyHistogram.hpp"
+#include "MonotonicClock.hpp"
+#include "Protocol.hpp"
+#include "TrafficCapture.hpp"
+
+/**
+ * Replays a capture recorded with np-room-manager --capture-file against a running server. Every
+ * captured connection is opened, fed the captured bytes with the captured timing (scaled by the speed
+ * factor) and closed. Netplay server callback ports seen in the capture get a local stand-in listener
+ * that accepts the room number connections. The room numbers delivered to those listeners are mapped
+ * to the captured ones, and requests that carry a captured room number are rewritten with the mapped
+ * one so that they reach the rooms created by the replay.
+ */
+
+// Time to wait for outstanding responses once every record has been replayed
+static const uint64_t DRAIN_TIMEOUT_MICROSECONDS = 2000000;
+
+/**
+ * State of a replayed connection
+ */
+struct ReplayConnection
+{
+    // Socket, -1 when closed
+    int fd = -1;
+    
+    // True once the connect completed
+    bool connected = false;
+    
+    // True if the capture closed the connection, it's closed once the pending output is sent
+    bool closeRequested = false;
+    
+    // Captured bytes that aren't a complete frame yet or that wait for a room number to be mapped
+    std::vector<char> capturedInput;
+    
+    // Bytes waiting to be sent
+    std::vector<char> pendingOutput;
+    
+    // Time the last request was sent, used to measure response latency
+    uint64_t requestMicroseconds = 0;
+    
+    // True while waiting for a response to the last request
+    bool awaitingResponse = false;
+};
+
+/**
+ * Room number connection accepted by a stand-in listener
+ */
+struct CallbackSocket
+{
+    // Socket
+    int fd;
+    
+    // Port of the listener that accepted the connection
+    uint16_t port;
+    
+    // Bytes received so far
+    std::vector<char> receivedBytes;
+};
+
+/**
+ * Maps the room numbers of the capture to the room numbers handed out by the server under test
+ */
+struct RoomNumberMap
+{
+    // Captured room numbers waiting for their room number connection, in registration order, by callback
+    // port. Only ports with a stand-in listener have an entry.
+    std::unordered_map<uint16_t, std::deque<uint32_t>> pendingRoomsByPort;
+    
+    // Connection that registered the room by captured room number, for rooms waiting for their room number connection
+    std::unordered_map<uint32_t, uint32_t> pendingRooms;
+    
+    // Room number handed out by the server under test by captured room number
+    std::unordered_map<uint32_t, uint32_t> mappedRooms;
+};
+
+/**
+ * Replay statistics
+ */
+struct ReplayStatistics
+{
+    uint64_t connectionsOpened = 0;
+    uint64_t connectFailures = 0;
+    uint64_t bytesSent = 0;
+    uint64_t bytesReceived = 0;
+    uint64_t callbacksAccepted = 0;
+    uint64_t callbackBytesReceived = 0;
+    uint64_t callbackPortsUnavailable = 0;
+    uint64_t roomsMapped = 0;
+    uint64_t roomsUnmapped = 0;
+    uint64_t roomNumbersRewritten = 0;
+    LatencyHistogram responseLatency;
+};
+
+/**
+ * Makes a socket nonblocking
+ * @param fd Socket
+ */
+static void setNonBlocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+/**
+ * Opens a stand-in netplay server listener
+ * @param port Port to listen on
+ * @return Listening socket, -1 on failure
+ */
+static int openCallbackListener(uint16_t port)
+{
+    int fd = socket(AF_INET6, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    
+    sockaddr_in6 address = {};
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = in6addr_any;
+    address.sin6_port = htons(port);
+    
+    if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    setNonBlocking(fd);
+    return fd;
+}
+
+/**
+ * Read a big endian integer
+ * @param buffer Source
+ * @return Value read
+ */
+static uint32_t readUint32(const char* buffer)
+{
+    uint32_t value;
+    std::memcpy(&value, buffer, sizeof(value));
+    return ntohl(value);
+}
+
+/**
+ * Decodes a CALLBACK_CONNECT record
+ * @param record Record to decode
+ * @param port Port of the netplay server
+ * @param roomNumber Captured room number sent to the netplay server
+ * @return false if the record isn't a valid CALLBACK_CONNECT record
+ */
+static bool decodeCallbackRecord(const CaptureRecord& record, uint16_t& port, uint32_t& roomNumber)
+{
+    if (record.type != CaptureFormat::CALLBACK_CONNECT || record.payload.size() != sizeof(uint16_t) + sizeof(uint32_t)) {
+        return false;
+    }
+    
+    const unsigned char* payload = reinterpret_cast<const unsigned char*>(record.payload.data());
+    port = static_cast<uint16_t>(payload[0] | (payload[1] << 8));
+    roomNumber = static_cast<uint32_t>(payload[2]) | (static_cast<uint32_t>(payload[3]) << 8) |
+        (static_cast<uint32_t>(payload[4]) << 16) | (static_cast<uint32_t>(payload[5]) << 24);
+    return true;
+}
+
+/**
+ * Gets the offsets of the room number fields of a request
+ * @param frame Complete frame
+ * @param frameSize Size of the frame
+ * @param offsets Offsets of the room numbers from the start of the frame
+ */
+static void getRoomNumberOffsets(const char* frame, size_t frameSize, std::vector<uint32_t>& offsets)
+{
+    offsets.clear();
+    
+    switch (readUint32(frame)) {
+        case Protocol::NpClientRequestRegistration::ID:
+            offsets.push_back(Protocol::NpClientRequestRegistration::getFieldOffset<0>());
+            break;
+        case Protocol::SubscribeRoom::ID:
+            offsets.push_back(Protocol::SubscribeRoom::getFieldOffset<0>());
+            break;
+        case Protocol::InitNpClientRequestRegistration::ID:
+            offsets.push_back(Protocol::InitNpClientRequestRegistration::getFieldOffset<1>());
+            break;
+        case Protocol::RenewNpServers::ID:
+            for (uint32_t recordIndex = 0; Protocol::RenewNpServers::getSize(recordIndex + 1) <= frameSize; ++recordIndex) {
+                offsets.push_back(Protocol::RenewNpServers::getSize(recordIndex) + Protocol::RenewNpServers::getFieldOffset<0>());
+            }
+            break;
+        case Protocol::CloseNpServers::ID:
+            for (uint32_t recordIndex = 0; Protocol::CloseNpServers::getSize(recordIndex + 1) <= frameSize; ++recordIndex) {
+                offsets.push_back(Protocol::CloseNpServers::getSize(recordIndex) + Protocol::CloseNpServers::getFieldOffset<0>());
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Moves complete captured frames to the pending output, rewriting captured room numbers with the mapped
+ * ones. Frames are kept in order, so a frame that refers to a room whose room number connection hasn't
+ * arrived yet holds back the rest of the connection.
+ * @param connection Connection
+ * @param roomNumbers Room number map
+ * @param flushIncomplete Forward a trailing incomplete frame as is, used once the capture closed the connection
+ * @param stats Statistics
+ */
+static void forwardCapturedInput(ReplayConnection& connection, const RoomNumberMap& roomNumbers, bool flushIncomplete,
+    ReplayStatistics& stats)
+{
+    std::vector<char>& input = connection.capturedInput;
+    std::vector<uint32_t> roomNumberOffsets;
+    size_t forwardedBytes = 0;
+    bool waitingForRoom = false;
+    
+    while (input.size() - forwardedBytes >= Protocol::MESSAGE_ID_SIZE_BYTES) {
+        char* frame = input.data() + forwardedBytes;
+        size_t availableBytes = input.size() - forwardedBytes;
+        
+        // The server closes the connection on unknown messages, there is nothing left to frame
+        int messageFrameSize = Protocol::InboundMessages::getFrameSize(readUint32(frame));
+        if (messageFrameSize == Protocol::UNKNOWN_FRAME_SIZE) {
+            forwardedBytes = input.size();
+            break;
+        }
+        
+        size_t frameSize = static_cast<size_t>(messageFrameSize);
+        if (messageFrameSize == Protocol::VARIABLE_FRAME_SIZE) {
+            if (availableBytes < Protocol::VARIABLE_FRAME_HEADER_SIZE) {
+                break;
+            }
+            frameSize = Protocol::VARIABLE_FRAME_HEADER_SIZE + readUint32(frame + Protocol::MESSAGE_ID_SIZE_BYTES);
+        }
+        
+        if (availableBytes < frameSize) {
+            break;
+        }
+        
+        getRoomNumberOffsets(frame, frameSize, roomNumberOffsets);
+        
+        waitingForRoom = std::any_of(roomNumberOffsets.begin(), roomNumberOffsets.end(), [&](uint32_t offset) {
+            return roomNumbers.pendingRooms.count(readUint32(frame + offset)) != 0;
+        });
+        if (waitingForRoom) {
+            break;
+        }
+        
+        for (uint32_t offset : roomNumberOffsets) {
+            auto mappedRoom = roomNumbers.mappedRooms.find(readUint32(frame + offset));
+            if (mappedRoom != roomNumbers.mappedRooms.end()) {
+                Protocol::Uint32Field::encode(frame + offset, mappedRoom->second);
+                ++stats.roomNumbersRewritten;
+            }
+        }
+        
+        forwardedBytes += frameSize;
+    }
+    
+    if (flushIncomplete && !waitingForRoom) {
+        forwardedBytes = input.size();
+    }
+    
+    if (forwardedBytes == 0) {
+        return;
+    }
+    
+    connection.pendingOutput.insert(connection.pendingOutput.end(), input.begin(), input.begin() + forwardedBytes);
+    input.erase(input.begin(), input.begin() + forwardedBytes);
+    
+    if (!connection.awaitingResponse) {
+        connection.requestMicroseconds = MonotonicClock::nowMicroseconds();
+        connection.awaitingResponse = true;
+    }
+}
+
+/**
+ * Sends as much pending output as the socket accepts
+ * @param connection Connection
+ * @param stats Statistics
+ */
+static void flushConnection(ReplayConnection& connection, ReplayStatistics& stats)
+{
+    while (connection.connected && !connection.pendingOutput.empty()) {
+        ssize_t sentBytes = send(connection.fd, connection.pendingOutput.data(), connection.pendingOutput.size(), MSG_NOSIGNAL);
+        if (sentBytes <= 0) {
+            if (sentBytes < 0 && errno != EWOULDBLOCK && errno != EAGAIN) {
+                close(connection.fd);
+                connection.fd = -1;
+                connection.pendingOutput.clear();
+            }
+            return;
+        }
+        
+        stats.bytesSent += sentBytes;
+        connection.pendingOutput.erase(connection.pendingOutput.begin(), connection.pendingOutput.begin() + sentBytes);
+    }
+    
+    if (connection.closeRequested && connection.capturedInput.empty() && connection.pendingOutput.empty() && connection.fd != -1) {
+        close(connection.fd);
+        connection.fd = -1;
+    }
+}
+
+/**
+ * Applies a captured record
+ * @param record Record to apply
+ * @param serverAddress Address of the server under test
+ * @param connections Replayed connections
+ * @param roomNumbers Room number map
+ * @param stats Statistics
+ */
+static void applyRecord(const CaptureRecord& record, const addrinfo& serverAddress,
+    std::unordered_map<uint32_t, ReplayConnection>& connections, RoomNumberMap& roomNumbers, ReplayStatistics& stats)
+{
+    switch (record.type) {
+        case CaptureFormat::CONNECTION_OPEN: {
+            ReplayConnection& connection = connections[record.connectionId];
+            connection.fd = socket(serverAddress.ai_family, SOCK_STREAM, 0);
+            if (connection.fd < 0) {
+                ++stats.connectFailures;
+                break;
+            }
+            
+            setNonBlocking(connection.fd);
+            if (connect(connection.fd, serverAddress.ai_addr, serverAddress.ai_addrlen) < 0 && errno != EINPROGRESS) {
+                ++stats.connectFailures;
+                close(connection.fd);
+                connection.fd = -1;
+                break;
+            }
+            ++stats.connectionsOpened;
+            break;
+        }
+        case CaptureFormat::CONNECTION_DATA: {
+            auto connectionIter = connections.find(record.connectionId);
+            if (connectionIter == connections.end() || connectionIter->second.fd == -1) {
+                break;
+            }
+            
+            ReplayConnection& connection = connectionIter->second;
+            connection.capturedInput.insert(connection.capturedInput.end(), record.payload.begin(), record.payload.end());
+            forwardCapturedInput(connection, roomNumbers, false, stats);
+            flushConnection(connection, stats);
+            break;
+        }
+        case CaptureFormat::CONNECTION_CLOSE: {
+            auto connectionIter = connections.find(record.connectionId);
+            if (connectionIter != connections.end()) {
+                connectionIter->second.closeRequested = true;
+                forwardCapturedInput(connectionIter->second, roomNumbers, true, stats);
+                flushConnection(connectionIter->second, stats);
+            }
+            break;
+        }
+        case CaptureFormat::CALLBACK_CONNECT: {
+            uint16_t port;
+            uint32_t roomNumber;
+            if (!decodeCallbackRecord(record, port, roomNumber)) {
+                break;
+            }
+            
+            // Later requests for this room wait until the replayed room has a number
+            auto pendingRooms = roomNumbers.pendingRoomsByPort.find(port);
+            if (pendingRooms != roomNumbers.pendingRoomsByPort.end()) {
+                pendingRooms->second.push_back(roomNumber);
+                roomNumbers.pendingRooms[roomNumber] = record.connectionId;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+/**
+ * Maps the room number delivered to a stand-in listener to the oldest captured room number waiting on
+ * that port, then forwards the requests that were waiting for it
+ * @param callbackSocket Room number connection that received a complete REGISTER_NP_SERVER_RESPONSE
+ * @param connections Replayed connections
+ * @param roomNumbers Room number map
+ * @param stats Statistics
+ */
+static void mapRoomNumber(const CallbackSocket& callbackSocket, std::unordered_map<uint32_t, ReplayConnection>& connections,
+    RoomNumberMap& roomNumbers, ReplayStatistics& stats)
+{
+    std::deque<uint32_t>& pendingRooms = roomNumbers.pendingRoomsByPort[callbackSocket.port];
+    if (readUint32(callbackSocket.receivedBytes.data()) != Protocol::RegisterNpServerResponse::ID || pendingRooms.empty()) {
+        return;
+    }
+    
+    uint32_t capturedRoomNumber = pendingRooms.front();
+    pendingRooms.pop_front();
+    roomNumbers.pendingRooms.erase(capturedRoomNumber);
+    roomNumbers.mappedRooms[capturedRoomNumber] =
+        readUint32(callbackSocket.receivedBytes.data() + Protocol::RegisterNpServerResponse::getFieldOffset<0>());
+    ++stats.roomsMapped;
+    
+    for (auto& connection : connections) {
+        if (connection.second.fd != -1 && !connection.second.capturedInput.empty()) {
+            forwardCapturedInput(connection.second, roomNumbers, connection.second.closeRequested, stats);
+            flushConnection(connection.second, stats);
+        }
+    }
+}
+
+/**
+ * Stops waiting for rooms whose registering connection closed before the room number arrived, the server
+ * never delivers them. Requests for those rooms are sent with the captured room number.
+ * @param connections Replayed connections
+ * @param roomNumbers Room number map
+ * @param stats Statistics
+ */
+static void releaseOrphanedRooms(std::unordered_map<uint32_t, ReplayConnection>& connections, RoomNumberMap& roomNumbers,
+    ReplayStatistics& stats)
+{
+    bool released = false;
+    for (auto pendingRoom = roomNumbers.pendingRooms.begin(); pendingRoom != roomNumbers.pendingRooms.end();) {
+        auto connection = connections.find(pendingRoom->second);
+        if (connection != connections.end() && connection->second.fd != -1) {
+            ++pendingRoom;
+            continue;
+        }
+        
+        for (auto& pendingRoomsOfPort : roomNumbers.pendingRoomsByPort) {
+            std::deque<uint32_t>& portRooms = pendingRoomsOfPort.second;
+            portRooms.erase(std::remove(portRooms.begin(), portRooms.end(), pendingRoom->first), portRooms.end());
+        }
+        pendingRoom = roomNumbers.pendingRooms.erase(pendingRoom);
+        ++stats.roomsUnmapped;
+        released = true;
+    }
+    
+    if (!released) {
+        return;
+    }
+    
+    for (auto& connection : connections) {
+        if (connection.second.fd != -1 && !connection.second.capturedInput.empty()) {
+            forwardCapturedInput(connection.second, roomNumbers, connection.second.closeRequested, stats);
+            flushConnection(connection.second, stats);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4) {
+        std::cout << "Usage: " << argv[0] << " <capture file> <host> <port> [speed]" << std::endl
+            << "  speed: replay speed factor, 1 replays with the captured timing, 0 replays as fast as possible (default 1)" << std::endl;
+        return 1;
+    }
+    
+    std::string captureFile(argv[1]);
+    double speed = argc > 4 ? std::stod(argv[4]) : 1.0;
+    
+    // Load the whole capture so that reading the file doesn't skew the replay timing
+    TrafficCaptureReader reader(captureFile);
+    if (!reader.isValid()) {
+        std::cout << "Invalid capture file " << captureFile << std::endl;
+        return 1;
+    }
+    
+    std::vector<CaptureRecord> records;
+    CaptureRecord record;
+    while (reader.next(record)) {
+        records.push_back(record);
+    }
+    
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* serverAddress = nullptr;
+    if (getaddrinfo(argv[2], argv[3], &hints, &serverAddress) != 0 || serverAddress == nullptr) {
+        std::cout << "Unable to resolve " << argv[2] << ":" << argv[3] << std::endl;
+        return 1;
+    }
+    
+    ReplayStatistics stats;
+    RoomNumberMap roomNumbers;
+    
+    // One stand-in listener per distinct netplay server port
+    std::vector<int> callbackListeners;
+    std::vector<uint16_t> callbackListenerPorts;
+    std::vector<uint16_t> callbackPorts;
+    for (const CaptureRecord& captureRecord : records) {
+        uint16_t port;
+        uint32_t roomNumber;
+        if (!decodeCallbackRecord(captureRecord, port, roomNumber) ||
+            std::find(callbackPorts.begin(), callbackPorts.end(), port) != callbackPorts.end()) {
+            continue;
+        }
+        
+        callbackPorts.push_back(port);
+        int listener = openCallbackListener(port);
+        if (listener < 0) {
+            ++stats.callbackPortsUnavailable;
+        } else {
+            callbackListeners.push_back(listener);
+            callbackListenerPorts.push_back(port);
+            roomNumbers.pendingRoomsByPort[port];
+        }
+    }
+    
+    std::cout << "Replaying " << records.size() << " records at speed " << speed << " with "
+        << callbackListeners.size() << " callback listeners" << std::endl;
+    
+    std::unordered_map<uint32_t, ReplayConnection> connections;
+    std::vector<CallbackSocket> callbackSockets;
+    std::vector<pollfd> fds;
+    std::vector<uint32_t> fdConnections;
+    std::vector<char> receiveBuffer(4096);
+    
+    uint64_t startMicroseconds = MonotonicClock::nowMicroseconds();
+    uint64_t drainDeadline = 0;
+    size_t nextRecord = 0;
+    
+    while (true) {
+        uint64_t nowMicroseconds = MonotonicClock::nowMicroseconds();
+        
+        // Apply every record that is due
+        while (nextRecord < records.size()) {
+            uint64_t dueMicroseconds = speed <= 0.0 ? 0 :
+                static_cast<uint64_t>(records[nextRecord].timestampMicroseconds / speed);
+            if (startMicroseconds + dueMicroseconds > nowMicroseconds) {
+                break;
+            }
+            applyRecord(records[nextRecord], *serverAddress, connections, roomNumbers, stats);
+            ++nextRecord;
+        }
+        
+        releaseOrphanedRooms(connections, roomNumbers, stats);
+        
+        bool activeConnections = std::any_of(connections.begin(), connections.end(),
+            [](const std::pair<const uint32_t, ReplayConnection>& connection) { return connection.second.fd != -1; });
+        
+        if (nextRecord == records.size()) {
+            if (drainDeadline == 0) {
+                drainDeadline = nowMicroseconds + DRAIN_TIMEOUT_MICROSECONDS;
+            }
+            if (!activeConnections || nowMicroseconds >= drainDeadline) {
+                break;
+            }
+        }
+        
+        // Wait for socket events until the next record is due
+        fds.clear();
+        fdConnections.clear();
+        for (auto& connection : connections) {
+            if (connection.second.fd == -1) {
+                continue;
+            }
+            short events = POLLIN;
+            if (!connection.second.connected || !connection.second.pendingOutput.empty()) {
+                events |= POLLOUT;
+            }
+            fds.push_back({connection.second.fd, events, 0});
+            fdConnections.push_back(connection.first);
+        }
+        size_t numberOfConnectionFds = fds.size();
+        for (int listener : callbackListeners) {
+            fds.push_back({listener, POLLIN, 0});
+        }
+        size_t numberOfListenerFds = fds.size();
+        for (const CallbackSocket& callbackSocket : callbackSockets) {
+            fds.push_back({callbackSocket.fd, POLLIN, 0});
+        }
+        
+        int timeoutMilliseconds = 10;
+        if (nextRecord < records.size()) {
+            uint64_t dueMicroseconds = speed <= 0.0 ? 0 :
+                static_cast<uint64_t>(records[nextRecord].timestampMicroseconds / speed);
+            uint64_t dueTime = startMicroseconds + dueMicroseconds;
+            timeoutMilliseconds = dueTime <= nowMicroseconds ? 0 :
+                static_cast<int>(std::min<uint64_t>((dueTime - nowMicroseconds) / 1000, 10));
+        }
+        
+        if (poll(fds.data(), fds.size(), timeoutMilliseconds) <= 0) {
+            continue;
+        }
+        
+        uint64_t eventMicroseconds = MonotonicClock::nowMicroseconds();
+        
+        for (size_t fdIndex = 0; fdIndex < fds.size(); ++fdIndex) {
+            if (fds[fdIndex].revents == 0) {
+                continue;
+            }
+            
+            if (fdIndex < numberOfConnectionFds) {
+                ReplayConnection& connection = connections[fdConnections[fdIndex]];
+                
+                if ((fds[fdIndex].revents & POLLOUT) != 0 && !connection.connected) {
+                    int socketError = 0;
+                    socklen_t socketErrorLength = sizeof(socketError);
+                    getsockopt(connection.fd, SOL_SOCKET, SO_ERROR, &socketError, &socketErrorLength);
+                    if (socketError != 0) {
+                        ++stats.connectFailures;
+                        close(connection.fd);
+                        connection.fd = -1;
+                        continue;
+                    }
+                    connection.connected = true;
+                }
+                
+                if ((fds[fdIndex].revents & (POLLIN | POLLHUP | POLLERR)) != 0) {
+                    ssize_t receivedBytes = recv(connection.fd, receiveBuffer.data(), receiveBuffer.size(), 0);
+                    if (receivedBytes > 0) {
+                        stats.bytesReceived += receivedBytes;
+                        if (connection.awaitingResponse) {
+                            stats.responseLatency.record(eventMicroseconds - connection.requestMicroseconds);
+                            connection.awaitingResponse = false;
+                        }
+                    } else if (receivedBytes == 0 || (errno != EWOULDBLOCK && errno != EAGAIN)) {
+                        close(connection.fd);
+                        connection.fd = -1;
+                        continue;
+                    }
+                }
+                
+                flushConnection(connection, stats);
+            } else if (fdIndex < numberOfListenerFds) {
+                uint16_t port = callbackListenerPorts[fdIndex - numberOfConnectionFds];
+                int callbackSocket = accept(fds[fdIndex].fd, nullptr, nullptr);
+                while (callbackSocket >= 0) {
+                    setNonBlocking(callbackSocket);
+                    callbackSockets.push_back({callbackSocket, port, {}});
+                    ++stats.callbacksAccepted;
+                    callbackSocket = accept(fds[fdIndex].fd, nullptr, nullptr);
+                }
+            } else {
+                auto callbackSocket = std::find_if(callbackSockets.begin(), callbackSockets.end(),
+                    [&](const CallbackSocket& socket) { return socket.fd == fds[fdIndex].fd; });
+                ssize_t receivedBytes = recv(callbackSocket->fd, receiveBuffer.data(), receiveBuffer.size(), 0);
+                if (receivedBytes > 0) {
+                    stats.callbackBytesReceived += receivedBytes;
+                    if (callbackSocket->receivedBytes.size() < Protocol::RegisterNpServerResponse::SIZE) {
+                        callbackSocket->receivedBytes.insert(callbackSocket->receivedBytes.end(), receiveBuffer.begin(),
+                            receiveBuffer.begin() + receivedBytes);
+                        if (callbackSocket->receivedBytes.size() >= Protocol::RegisterNpServerResponse::SIZE) {
+                            mapRoomNumber(*callbackSocket, connections, roomNumbers, stats);
+                        }
+                    }
+                } else if (receivedBytes == 0 || (errno != EWOULDBLOCK && errno != EAGAIN)) {
+                    close(callbackSocket->fd);
+                    callbackSockets.erase(callbackSocket);
+                }
+            }
+        }
+    }
+    
+    double elapsedSeconds = (MonotonicClock::nowMicroseconds() - startMicroseconds) / 1000000.0;
+    
+    for (auto& connection : connections) {
+        if (connection.second.fd != -1) {
+            close(connection.second.fd);
+        }
+    }
+    for (const CallbackSocket& callbackSocket : callbackSockets) {
+        close(callbackSocket.fd);
+    }
+    for (int fd : callbackListeners) {
+        close(fd);
+    }
+    freeaddrinfo(serverAddress);
+    
+    std::cout << "elapsed_s=" << elapsedSeconds
+        << " connections=" << stats.connectionsOpened
+        << " connections_per_s=" << (elapsedSeconds > 0 ? stats.connectionsOpened / elapsedSeconds : 0.0)
+        << " connect_failures=" << stats.connectFailures
+        << " bytes_sent=" << stats.bytesSent
+        << " bytes_received=" << stats.bytesReceived << std::endl;
+    std::cout << "responses=" << stats.responseLatency.getCount()
+        << " p50_us=" << stats.responseLatency.getPercentile(50.0)
+        << " p90_us=" << stats.responseLatency.getPercentile(90.0)
+        << " p99_us=" << stats.responseLatency.getPercentile(99.0)
+        << " max_us=" << stats.responseLatency.getMax() << std::endl;
+    std::cout << "callbacks_accepted=" << stats.callbacksAccepted
+        << " callback_bytes=" << stats.callbackBytesReceived
+        << " callback_ports_unavailable=" << stats.callbackPortsUnavailable
+        << " rooms_mapped=" << stats.roomsMapped
+        << " rooms_unmapped=" << stats.roomsUnmapped
+        << " room_numbers_rewritten=" << stats.roomNumbersRewritten << std::endl;
+    
+    return 0;
+}
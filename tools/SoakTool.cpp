@@ -0,0 +1,369 @@
+/*
+ * Mupen64PlusAE, an N64 emulator for the Android platform
+ *
+ * Copyright (C) 2021 Francisco Zurita
+ *
+ * This file is part of Mupen64PlusAE.
+ *
+ * Mupen64PlusAE is free software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Mupen64PlusAE is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with Mupen64PlusAE. If
+ * not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors: fzurita
+ */
+
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "LatencyHistogram.hpp"
+#include "MonotonicClock.hpp"
+#include "Protocol.hpp"
+
+/**
+ * Soak test for a running np-room-manager: opens a large number of connections, completes INIT_SESSION on
+ * each and keeps them open while a steady rate of lookups is sent through random connections. Connections
+ * are spread over worker processes, so the number of connections isn't bound by the descriptor limit of a
+ * single process. Reports how many connections were established, rejected with SERVER_BUSY or failed, how
+ * many the server dropped while they were idle, and the lookup latency under that load.
+ */
+
+// Descriptors of a worker that aren't used for connections
+static const int WORKER_RESERVED_DESCRIPTORS = 64;
+
+// Connections per loopback source address, each address has its own range of ephemeral ports
+static const uint32_t CONNECTIONS_PER_SOURCE_ADDRESS = 20000;
+
+// Time to wait for a response before the connection counts as failed
+static const int RESPONSE_TIMEOUT_SECONDS = 5;
+
+/**
+ * Results of a worker, sent to the parent through a pipe
+ */
+struct SoakResult
+{
+    // Connections that completed INIT_SESSION
+    uint64_t established = 0;
+    
+    // Connections rejected with SERVER_BUSY
+    uint64_t busy = 0;
+    
+    // Connections that failed to connect or didn't get a valid response
+    uint64_t failed = 0;
+    
+    // Established connections closed by the server while idle
+    uint64_t dropped = 0;
+    
+    // Lookups that didn't get a response
+    uint64_t failedLookups = 0;
+    
+    // Time taken to open every connection, in microseconds
+    uint64_t openMicroseconds = 0;
+    
+    // Lookup round trip times in microseconds
+    LatencyHistogram lookupLatency;
+};
+
+static_assert(std::is_trivially_copyable<SoakResult>::value, "Results are copied through a pipe");
+
+/**
+ * Reads exactly the given number of bytes
+ * @param fd Socket to read from
+ * @param buffer Destination
+ * @param length Number of bytes to read
+ * @return true if every byte was read
+ */
+static bool readFully(int fd, void* buffer, size_t length)
+{
+    size_t receivedBytes = 0;
+    while (receivedBytes < length) {
+        ssize_t result = recv(fd, static_cast<char*>(buffer) + receivedBytes, length - receivedBytes, 0);
+        if (result <= 0) {
+            return false;
+        }
+        receivedBytes += result;
+    }
+    return true;
+}
+
+/**
+ * Opens a connection and completes INIT_SESSION
+ * @param serverAddress Address of the server
+ * @param connectionIndex Index of the connection among all workers, used to pick the source address
+ * @param result Counters to update
+ * @return Connected socket, -1 if the connection was rejected or failed
+ */
+static int openConnection(const addrinfo* serverAddress, uint32_t connectionIndex, SoakResult& result)
+{
+    int fd = socket(serverAddress->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        ++result.failed;
+        return -1;
+    }
+    
+    // Loopback has a whole /8 of source addresses, use more than one to get past the ephemeral port range
+    const sockaddr_in* ipv4Address = reinterpret_cast<const sockaddr_in*>(serverAddress->ai_addr);
+    if (serverAddress->ai_family == AF_INET && (ntohl(ipv4Address->sin_addr.s_addr) >> 24) == 127) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+        
+        sockaddr_in sourceAddress = {};
+        sourceAddress.sin_family = AF_INET;
+        sourceAddress.sin_addr.s_addr = htonl((127u << 24) + 1 + connectionIndex / CONNECTIONS_PER_SOURCE_ADDRESS);
+        bind(fd, reinterpret_cast<sockaddr*>(&sourceAddress), sizeof(sourceAddress));
+    }
+    
+    timeval timeout = {RESPONSE_TIMEOUT_SECONDS, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    
+    Protocol::InitSession::Buffer initSession;
+    Protocol::InitSession::encode(initSession.data(), Protocol::NETPLAY_VERSION);
+    Protocol::InitSessionResponse::Buffer response;
+    static_assert(Protocol::ServerBusy::SIZE == Protocol::InitSessionResponse::SIZE, "Both responses are read the same way");
+    
+    if (connect(fd, serverAddress->ai_addr, serverAddress->ai_addrlen) < 0 ||
+        send(fd, initSession.data(), initSession.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(initSession.size()) ||
+        !readFully(fd, response.data(), response.size())) {
+        ++result.failed;
+        close(fd);
+        return -1;
+    }
+    
+    uint32_t messageId = ntohl(*reinterpret_cast<const uint32_t*>(response.data()));
+    if (messageId == Protocol::ServerBusy::ID) {
+        ++result.busy;
+        close(fd);
+        return -1;
+    }
+    
+    if (messageId != Protocol::InitSessionResponse::ID) {
+        ++result.failed;
+        close(fd);
+        return -1;
+    }
+    
+    ++result.established;
+    return fd;
+}
+
+/**
+ * Runs the connections of one worker
+ * @param serverAddress Address of the server
+ * @param firstConnection Index of the first connection of this worker
+ * @param connectionCount Number of connections of this worker
+ * @param durationSeconds How long connections are kept open once they are all established
+ * @param lookupsPerSecond Lookups sent by this worker per second
+ * @return Results
+ */
+static SoakResult runWorker(const addrinfo* serverAddress, uint32_t firstConnection, uint32_t connectionCount,
+    int durationSeconds, double lookupsPerSecond)
+{
+    SoakResult result;
+    std::vector<int> fds;
+    fds.reserve(connectionCount);
+    
+    uint64_t openStart = MonotonicClock::nowMicroseconds();
+    for (uint32_t connectionIndex = 0; connectionIndex < connectionCount; ++connectionIndex) {
+        int fd = openConnection(serverAddress, firstConnection + connectionIndex, result);
+        if (fd >= 0) {
+            fds.push_back(fd);
+        }
+    }
+    result.openMicroseconds = MonotonicClock::nowMicroseconds() - openStart;
+    
+    // Keep everything open while a steady trickle of lookups goes through random connections
+    Protocol::NpClientRequestRegistration::Buffer lookup;
+    Protocol::NpClientRequestRegistration::encode(lookup.data(), 0);
+    Protocol::NpClientRequestRegistrationResponse::Buffer lookupResponse;
+    
+    std::mt19937 random(firstConnection);
+    uint64_t lookupIntervalMicroseconds = lookupsPerSecond > 0 ? static_cast<uint64_t>(1000000.0 / lookupsPerSecond) : 0;
+    uint64_t endMicroseconds = MonotonicClock::nowMicroseconds() + static_cast<uint64_t>(durationSeconds) * 1000000;
+    uint64_t nextLookupMicroseconds = MonotonicClock::nowMicroseconds();
+    
+    while (MonotonicClock::nowMicroseconds() < endMicroseconds) {
+        if (fds.empty() || lookupIntervalMicroseconds == 0) {
+            usleep(100000);
+            continue;
+        }
+        
+        uint64_t nowMicroseconds = MonotonicClock::nowMicroseconds();
+        if (nowMicroseconds < nextLookupMicroseconds) {
+            usleep(std::min<uint64_t>(nextLookupMicroseconds - nowMicroseconds, 100000));
+            continue;
+        }
+        nextLookupMicroseconds += lookupIntervalMicroseconds;
+        
+        int fd = fds[random() % fds.size()];
+        uint64_t sendMicroseconds = MonotonicClock::nowMicroseconds();
+        if (send(fd, lookup.data(), lookup.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(lookup.size()) ||
+            !readFully(fd, lookupResponse.data(), lookupResponse.size())) {
+            ++result.failedLookups;
+            continue;
+        }
+        result.lookupLatency.record(MonotonicClock::nowMicroseconds() - sendMicroseconds);
+    }
+    
+    // An idle connection has nothing to read, anything else means the server closed it
+    std::vector<pollfd> pollFds(fds.size());
+    for (size_t fdIndex = 0; fdIndex < fds.size(); ++fdIndex) {
+        pollFds[fdIndex] = {fds[fdIndex], POLLIN, 0};
+    }
+    if (!pollFds.empty() && poll(pollFds.data(), pollFds.size(), 0) > 0) {
+        for (const pollfd& pollFd : pollFds) {
+            if (pollFd.revents != 0) {
+                ++result.dropped;
+            }
+        }
+    }
+    
+    for (int fd : fds) {
+        close(fd);
+    }
+    
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4) {
+        std::cout << "Usage: " << argv[0] << " <host> <port> <connections> [seconds] [lookups per second]" << std::endl
+            << "  seconds: how long connections are kept open once established (default 60)" << std::endl
+            << "  lookups per second: lookups sent through random connections (default 100)" << std::endl;
+        return 1;
+    }
+    
+    uint32_t connectionCount = std::stoul(argv[3]);
+    int durationSeconds = argc > 4 ? std::stoi(argv[4]) : 60;
+    double lookupsPerSecond = argc > 5 ? std::stod(argv[5]) : 100.0;
+    
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* serverAddress = nullptr;
+    if (getaddrinfo(argv[1], argv[2], &hints, &serverAddress) != 0 || serverAddress == nullptr) {
+        std::cout << "Unable to resolve " << argv[1] << ":" << argv[2] << std::endl;
+        return 1;
+    }
+    
+    // Every worker gets as many connections as its descriptor limit allows
+    rlimit limit = {};
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    
+    uint32_t connectionsPerWorker = static_cast<uint32_t>(std::max<int64_t>(1,
+        static_cast<int64_t>(std::min<rlim_t>(limit.rlim_cur, 1 << 30)) - WORKER_RESERVED_DESCRIPTORS));
+    uint32_t workerCount = (connectionCount + connectionsPerWorker - 1) / connectionsPerWorker;
+    
+    std::cout << "Opening " << connectionCount << " connections with " << workerCount << " workers" << std::endl;
+    
+    std::vector<pid_t> workers;
+    std::vector<int> resultPipes;
+    for (uint32_t workerIndex = 0; workerIndex < workerCount; ++workerIndex) {
+        uint32_t firstConnection = workerIndex * connectionsPerWorker;
+        uint32_t workerConnections = std::min(connectionsPerWorker, connectionCount - firstConnection);
+        
+        int pipeFds[2];
+        if (pipe(pipeFds) < 0) {
+            std::cout << "pipe() failed, errno=" << errno << std::endl;
+            return 1;
+        }
+        
+        pid_t pid = fork();
+        if (pid < 0) {
+            std::cout << "fork() failed, errno=" << errno << std::endl;
+            return 1;
+        }
+        
+        if (pid == 0) {
+            close(pipeFds[0]);
+            SoakResult result = runWorker(serverAddress, firstConnection, workerConnections, durationSeconds,
+                lookupsPerSecond / workerCount);
+            
+            const char* data = reinterpret_cast<const char*>(&result);
+            size_t writtenBytes = 0;
+            while (writtenBytes < sizeof(result)) {
+                ssize_t written = write(pipeFds[1], data + writtenBytes, sizeof(result) - writtenBytes);
+                if (written <= 0) {
+                    _exit(1);
+                }
+                writtenBytes += written;
+            }
+            _exit(0);
+        }
+        
+        close(pipeFds[1]);
+        workers.push_back(pid);
+        resultPipes.push_back(pipeFds[0]);
+    }
+    
+    SoakResult total;
+    uint64_t slowestOpenMicroseconds = 0;
+    for (size_t workerIndex = 0; workerIndex < workers.size(); ++workerIndex) {
+        SoakResult result;
+        char* data = reinterpret_cast<char*>(&result);
+        size_t readBytes = 0;
+        while (readBytes < sizeof(result)) {
+            ssize_t received = read(resultPipes[workerIndex], data + readBytes, sizeof(result) - readBytes);
+            if (received <= 0) {
+                break;
+            }
+            readBytes += received;
+        }
+        close(resultPipes[workerIndex]);
+        waitpid(workers[workerIndex], nullptr, 0);
+        
+        if (readBytes != sizeof(result)) {
+            std::cout << "Worker " << workerIndex << " didn't report its results" << std::endl;
+            continue;
+        }
+        
+        total.established += result.established;
+        total.busy += result.busy;
+        total.failed += result.failed;
+        total.dropped += result.dropped;
+        total.failedLookups += result.failedLookups;
+        total.lookupLatency.add(result.lookupLatency);
+        slowestOpenMicroseconds = std::max(slowestOpenMicroseconds, result.openMicroseconds);
+    }
+    
+    freeaddrinfo(serverAddress);
+    
+    std::cout << "connections=" << connectionCount
+        << " established=" << total.established
+        << " busy=" << total.busy
+        << " failed=" << total.failed
+        << " dropped_while_idle=" << total.dropped
+        << " open_seconds=" << slowestOpenMicroseconds / 1000000.0 << std::endl;
+    std::cout << "lookups=" << total.lookupLatency.getCount()
+        << " failed_lookups=" << total.failedLookups
+        << " p50_us=" << total.lookupLatency.getPercentile(50.0)
+        << " p99_us=" << total.lookupLatency.getPercentile(99.0)
+        << " max_us=" << total.lookupLatency.getMax() << std::endl;
+    
+    return total.failed == 0 && total.dropped == 0 && total.failedLookups == 0 ? 0 : 1;
+}